@@ -23,6 +23,8 @@
 #include <fcntl.h>
 #include <semaphore.h>
 
+#include "message_queue.h"
+
 #define MESSAGE_LENGTH 100
 #define LOAD_BALANCER_CHANNEL 4000
 #define PRIMARY_SERVER_CHANNEL 4001
@@ -35,6 +37,15 @@ struct data
     long seq_num;
     long operation;
     char graph_name[MESSAGE_LENGTH];
+    // Arena handle of the parameters of the request, -1 if it has none
+    int request_handle;
+    // Arena handle and number of vertices of the result of a traversal, -1 and 0 otherwise
+    int result_handle;
+    int result_length;
+    // pid of the client, its replies go to its own queue when MESSAGE_QUEUE=posix
+    int client_id;
+    // Scheduling class of a read, PRIORITY_AUTO lets the load balancer choose it from the size of the graph
+    int priority;
 };
 
 struct msg_buffer
@@ -49,7 +60,7 @@ struct msg_buffer
  * and terminate itself. We will set operation to 5 to indicate that we wish to terminate
  * and set the msg_type to 1
  */
-void clean(int msg_queue_id, struct msg_buffer msg_buf)
+void clean(struct message_queue *queue, struct msg_buffer msg_buf)
 {
     // Asking for the user's approval to terminate
     while (1)
@@ -63,13 +74,14 @@ void clean(int msg_queue_id, struct msg_buffer msg_buf)
             msg_buf.data.operation = 5;
 
             // Sending a message to the message queue if the user wishes to exit
-            if (msgsnd(msg_queue_id, &msg_buf, sizeof(msg_buf.data), 0) == -1)
+            if (message_queue_send(queue, &msg_buf, sizeof(msg_buf.data)) == -1 || message_queue_flush(queue) == -1)
             {
                 printf("[Cleanup] Message could not be sent, please try again\n");
             }
             else
             {
                 printf("[Cleanup] Message sent to Load Balancer\n");
+                message_queue_close(queue);
                 exit(EXIT_SUCCESS);
             }
         }
@@ -106,7 +118,15 @@ int main()
 
     printf("Successfully connected to the Message Queue Key:%d ID:%d\n", key, msg_queue_id);
 
-    clean(msg_queue_id, msg_buf);
+    // The cleanup process only sends, it has no queue of its own
+    struct message_queue queue;
+    if (message_queue_open(&queue, msg_queue_id, MESSAGE_QUEUE_NO_INTAKE, sizeof(struct msg_buffer)) == -1)
+    {
+        perror("Error while opening the POSIX message queues");
+        exit(EXIT_FAILURE);
+    }
+
+    clean(&queue, msg_buf);
 
     return 0;
 }
\ No newline at end of file
@@ -23,6 +23,11 @@
 #include <fcntl.h>
 #include <semaphore.h>
 #include <errno.h>
+#include <stdint.h>
+
+#include "message_queue.h"
+#include "result_ring.h"
+#include "shm_arena.h"
 
 #define MESSAGE_LENGTH 100
 #define LOAD_BALANCER_CHANNEL 4000
@@ -30,12 +35,34 @@
 #define SECONDARY_SERVER_CHANNEL_1 4002
 #define SECONDARY_SERVER_CHANNEL_2 4003
 #define MAX_THREADS 200
+// Sequence numbers from here on are reserved for the replies to secondary servers that register
+#define REGISTRATION_REPLY_BASE 1000000000L
+// Scheduling classes of reads, interactive reads go ahead of batch reads
+#define PRIORITY_AUTO 0
+#define PRIORITY_INTERACTIVE 1
+#define PRIORITY_BATCH 2
+// Status in the operation of a reply when the load balancer turned the request away
+#define BUSY -2
+
+// Direction of a BFS, BFS_DEFAULT lets the secondary server choose
+#define BFS_DEFAULT 0
+#define BFS_TOP_DOWN 1
+#define BFS_DIRECTION_OPTIMIZING 2
 
 struct data
 {
     long seq_num;
     long operation;
     char graph_name[MESSAGE_LENGTH];
+    // Arena handle of the parameters of the request, -1 if it has none
+    int request_handle;
+    // Arena handle and number of vertices of the result of a traversal, -1 and 0 otherwise
+    int result_handle;
+    int result_length;
+    // pid of the client, its replies go to its own queue when MESSAGE_QUEUE=posix
+    int client_id;
+    // Scheduling class of a read, PRIORITY_AUTO lets the load balancer choose it from the size of the graph
+    int priority;
 };
 
 struct msg_buffer
@@ -44,14 +71,68 @@ struct msg_buffer
     struct data data;
 };
 
+// Set BFS_STREAM=1 to receive BFS results through a ring buffer while the traversal runs
+int stream_bfs = 0;
+
+// Set BFS_DIRECTION to top-down or direction-optimizing to choose how BFS traversals are run
+int bfs_direction = BFS_DEFAULT;
+
+// Set REQUEST_PRIORITY to interactive or batch to choose the scheduling class of reads, the load
+// balancer chooses it from the size of the graph otherwise
+int request_priority = PRIORITY_AUTO;
+
+// Shared memory arena of the load balancer, which holds request parameters and traversal results
+struct arena *arena = NULL;
+
+// Transport to the load balancer, and the queue the replies arrive on with MESSAGE_QUEUE=posix
+struct message_queue queue;
+
+/**
+ * @brief Prints the vertices of a traversal result. The result is in a block of the arena
+ * leased by the secondary server, which the client gives back once it has read it.
+ *
+ * @param message reply of the secondary server
+ */
+void print_result(struct msg_buffer *message)
+{
+    if (message->data.operation == BUSY)
+    {
+        printf("[Client] The database is busy, try again later");
+        return;
+    }
+    if (message->data.result_handle == -1)
+    {
+        printf("[Client] The traversal did not return a result");
+        return;
+    }
+
+    uint32_t *vertices = (uint32_t *)arena_resolve(arena, message->data.result_handle);
+    if (vertices == NULL)
+    {
+        perror("[Client] Error while attaching to the result\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < message->data.result_length; i++)
+    {
+        printf("%u ", vertices[i]);
+    }
+
+    if (arena_release(arena, message->data.result_handle, vertices) == -1)
+    {
+        perror("[Client] Error while deleting the result\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
 /**
  * @brief
  *
- * @param msg_queue_id
+ * @param queue
  * @param seq_num
  * @param message
  */
-void operation_one(int msg_queue_id, int seq_num, struct msg_buffer message)
+void operation_one(struct message_queue *queue, int seq_num, struct msg_buffer message)
 {
     // Input number of nodes
     int number_of_nodes;
@@ -69,31 +150,15 @@ void operation_one(int msg_queue_id, int seq_num, struct msg_buffer message)
         }
     }
 
-    // Connect to shared memory
-    key_t shm_key;
-    int shm_id;
-    // Generate key for the shared memory
-    // Here, we are using the client_id as the key because
-    // we want to ensure that each client has a unique shared memory
-    while ((shm_key = ftok(".", seq_num)) == -1)
+    // Lease a block of the arena for the parameters of the request
+    int request_handle;
+    int *shmptr = (int *)arena_lease(arena, sizeof(adjacency_matrix) + sizeof(number_of_nodes), &request_handle);
+    if (shmptr == NULL)
     {
-        perror("[Client] Error while generating key for shared memory");
-        exit(EXIT_FAILURE);
-    }
-    printf("[Client] Generated shared memory key %d\n", shm_key);
-    // Connect to the shared memory using the key
-    if ((shm_id = shmget(shm_key, sizeof(adjacency_matrix) + sizeof(number_of_nodes), 0666 | IPC_CREAT)) == -1)
-    {
-        perror("[Client] Error occurred while connecting to shm\n");
-        exit(EXIT_FAILURE);
-    }
-    // Attach to the shared memory
-    int *shmptr = (int *)shmat(shm_id, NULL, 0);
-    if (shmptr == (void *)-1)
-    {
-        perror("[Client] Error while attaching to shared memory\n");
+        perror("[Client] Error while leasing shared memory\n");
         exit(EXIT_FAILURE);
     }
+    message.data.request_handle = request_handle;
 
     int shmptr_index = 0;
     // Store data in shared memory using array traversals
@@ -112,30 +177,114 @@ void operation_one(int msg_queue_id, int seq_num, struct msg_buffer message)
     message.data.seq_num = seq_num;
 
     // Send the message to the load balancer
-    if (msgsnd(msg_queue_id, &message, sizeof(message.data), 0) == -1)
+    if (message_queue_send(queue, &message, sizeof(message.data)) == -1)
     {
         perror("[Client] Message could not be sent, please try again");
         exit(EXIT_FAILURE);
     }
     else
     {
-        while (msgrcv(msg_queue_id, &message, sizeof(message.data), seq_num, 0) == -1)
+        while (message_queue_receive(queue, &message, sizeof(message.data), seq_num) == -1)
         {
             perror("[Client] Error while receiving message from Primary server");
         }
         printf("[Client] Message received from the Primary Server: %ld -> %s using %ld\n", message.msg_type, message.data.graph_name, message.data.operation);
-        printf("[Client] File written successfully");
+        printf(message.data.operation == BUSY ? "[Client] The database is busy, try again later"
+               : message.data.operation != 0 ? "[Client] The file could not be written"
+                                              : "[Client] File written successfully");
     }
 
-    // Detach shared memory and delete it
-    if (shmdt(shmptr) == -1)
+    // Give the block back to the arena, the server is done with it once it has replied
+    if (arena_release(arena, request_handle, shmptr) == -1)
     {
-        perror("[Client] Could not detach from shared memory\n");
+        perror("[Client] Error while releasing shared memory\n");
         exit(EXIT_FAILURE);
     }
-    if (shmctl(shm_id, IPC_RMID, 0) == -1)
+}
+
+/**
+ * @brief Sends a list of changes to an existing graph. Each change is one of
+ * 1 u v (add edge), 2 u v (remove edge), 3 (add vertex) or 4 v (remove vertex)
+ *
+ * @param queue
+ * @param seq_num
+ * @param message
+ */
+void operation_two(struct message_queue *queue, int seq_num, struct msg_buffer message)
+{
+    // Input the changes
+    int number_of_changes;
+    printf("Enter Number of Changes: ");
+    scanf("%d", &number_of_changes);
+    if (number_of_changes < 0)
+    {
+        number_of_changes = 0;
+    }
+
+    int changes[number_of_changes + 1][3];
+    printf("Enter the changes, one per line: 1 u v to add an edge, 2 u v to remove an edge, 3 to add a vertex, 4 v to remove a vertex: \n");
+    for (int i = 0; i < number_of_changes; i++)
+    {
+        changes[i][1] = changes[i][2] = 0;
+        scanf("%d", &changes[i][0]);
+        if (changes[i][0] == 1 || changes[i][0] == 2)
+        {
+            scanf("%d %d", &changes[i][1], &changes[i][2]);
+        }
+        else if (changes[i][0] == 4)
+        {
+            scanf("%d", &changes[i][1]);
+        }
+        // Vertices are numbered from 1 for the user and from 0 in the graph files
+        changes[i][1]--;
+        changes[i][2]--;
+    }
+
+    // Lease a block of the arena for the parameters of the request
+    int request_handle;
+    int *shmptr = (int *)arena_lease(arena, sizeof(int) * (1 + 3 * number_of_changes), &request_handle);
+    if (shmptr == NULL)
+    {
+        perror("[Client] Error while leasing shared memory\n");
+        exit(EXIT_FAILURE);
+    }
+    message.data.request_handle = request_handle;
+
+    int shmptr_index = 0;
+    // Store data in shared memory using array traversals
+    shmptr[shmptr_index++] = number_of_changes;
+    for (int i = 0; i < number_of_changes; i++)
     {
-        perror("[Client] Error while deleting the shared memory\n");
+        for (int j = 0; j < 3; j++)
+        {
+            shmptr[shmptr_index++] = changes[i][j];
+        }
+    }
+
+    // Change message channel to load balancer and send it to load balancer
+    message.msg_type = LOAD_BALANCER_CHANNEL;
+    message.data.operation = 2;
+    message.data.seq_num = seq_num;
+
+    // Send the message to the load balancer
+    if (message_queue_send(queue, &message, sizeof(message.data)) == -1)
+    {
+        perror("[Client] Message could not be sent, please try again");
+        exit(EXIT_FAILURE);
+    }
+    else
+    {
+        while (message_queue_receive(queue, &message, sizeof(message.data), seq_num) == -1)
+        {
+            perror("[Client] Error while receiving message from Primary server");
+        }
+        printf("[Client] Message received from the Primary Server: %ld -> %s using %ld\n", message.msg_type, message.data.graph_name, message.data.operation);
+    }
+
+    // Give the block back to the arena, the server is done with it once it has replied
+    if (arena_release(arena, request_handle, shmptr) == -1)
+    {
+        perror("[Client] Error while releasing shared memory\n");
         exit(EXIT_FAILURE);
     }
 }
@@ -143,42 +292,26 @@ void operation_one(int msg_queue_id, int seq_num, struct msg_buffer message)
 /**
  * @brief
  *
- * @param msg_queue_id
+ * @param queue
  * @param seq_num
  * @param message
  */
-void operation_three(int msg_queue_id, int seq_num, struct msg_buffer message)
+void operation_three(struct message_queue *queue, int seq_num, struct msg_buffer message)
 {
     // Input starting vertex
     int starting_vertex;
     printf("Enter Starting Vertex: \n");
     scanf("%d", &starting_vertex);
 
-    // Connect to shared memory
-    key_t shm_key;
-    int shm_id;
-    // Generate key for the shared memory
-    // Here, we are using the client_id as the key because
-    // we want to ensure that each client has a unique shared memory
-    while ((shm_key = ftok(".", seq_num)) == -1)
-    {
-        perror("[Client] Error while generating key for shared memory");
-        exit(EXIT_FAILURE);
-    }
-    printf("[Client] Generated shared memory key %d\n", shm_key);
-    // Connect to the shared memory using the key
-    if ((shm_id = shmget(shm_key, sizeof(starting_vertex), 0666 | IPC_CREAT)) == -1)
+    // Lease a block of the arena for the parameters of the request
+    int request_handle;
+    int *shmptr = (int *)arena_lease(arena, sizeof(starting_vertex), &request_handle);
+    if (shmptr == NULL)
     {
-        perror("[Client] Error occurred while connecting to shm\n");
-        exit(EXIT_FAILURE);
-    }
-    // Attach to the shared memory
-    int *shmptr = (int *)shmat(shm_id, NULL, 0);
-    if (shmptr == (void *)-1)
-    {
-        perror("[Client] Error while attaching to shared memory\n");
+        perror("[Client] Error while leasing shared memory\n");
         exit(EXIT_FAILURE);
     }
+    message.data.request_handle = request_handle;
 
     int shmptr_index = 0;
     // Store data in shared memory using array traversals
@@ -190,14 +323,14 @@ void operation_three(int msg_queue_id, int seq_num, struct msg_buffer message)
     message.data.seq_num = seq_num;
 
     // Send the message to the load balancer
-    if (msgsnd(msg_queue_id, &message, sizeof(message.data), 0) == -1)
+    if (message_queue_send(queue, &message, sizeof(message.data)) == -1)
     {
         perror("[Client] Message could not be sent, please try again");
         exit(EXIT_FAILURE);
     }
     else
     {
-        while (msgrcv(msg_queue_id, &message, sizeof(message.data), seq_num, 0) == -1)
+        while (message_queue_receive(queue, &message, sizeof(message.data), seq_num) == -1)
         {
             if (errno == EIDRM)
             {
@@ -207,25 +340,14 @@ void operation_three(int msg_queue_id, int seq_num, struct msg_buffer message)
             perror("[Client] Error while receiving message from secondary server");
         }
         printf("[Client] Message received from the secondary Server: %ld\nThe list of Leaf Nodes while travelling from %d is: \n", message.msg_type, starting_vertex);
-        int i = 0;
-
-        while (message.data.graph_name[i] != '*')
-        {
-            printf("%d ", message.data.graph_name[i]);
-            i++;
-        }
+        print_result(&message);
         printf("\n[Client] Operation done successfully\n");
     }
 
-    // Detach shared memory and delete it
-    if (shmdt(shmptr) == -1)
-    {
-        perror("[Client] Could not detach from shared memory\n");
-        exit(EXIT_FAILURE);
-    }
-    if (shmctl(shm_id, IPC_RMID, 0) == -1)
+    // Give the block back to the arena, the server is done with it once it has replied
+    if (arena_release(arena, request_handle, shmptr) == -1)
     {
-        perror("[Client] Error while deleting the shared memory\n");
+        perror("[Client] Error while releasing shared memory\n");
         exit(EXIT_FAILURE);
     }
 }
@@ -233,61 +355,81 @@ void operation_three(int msg_queue_id, int seq_num, struct msg_buffer message)
 /**
  * @brief
  *
- * @param msg_queue_id
+ * @param queue
  * @param seq_num
  * @param message
  */
-void operation_four(int msg_queue_id, int seq_num, struct msg_buffer message)
+void operation_four(struct message_queue *queue, int seq_num, struct msg_buffer message)
 {
     // Input starting vertex
     int starting_vertex;
     printf("Enter Starting Vertex: \n");
     scanf("%d", &starting_vertex);
 
-    // Connect to shared memory
-    key_t shm_key;
-    int shm_id;
-    // Generate key for the shared memory
-    // Here, we are using the client_id as the key because
-    // we want to ensure that each client has a unique shared memory
-    while ((shm_key = ftok(".", seq_num)) == -1)
+    // Lease a block of the arena for the parameters of the request
+    int request_handle;
+    int *shmptr = (int *)arena_lease(arena, 3 * sizeof(int), &request_handle);
+    if (shmptr == NULL)
     {
-        perror("[Client] Error while generating key for shared memory");
-        exit(EXIT_FAILURE);
-    }
-    printf("[Client] Generated shared memory key %d\n", shm_key);
-    // Connect to the shared memory using the key
-    if ((shm_id = shmget(shm_key, sizeof(starting_vertex), 0666 | IPC_CREAT)) == -1)
-    {
-        perror("[Client] Error occurred while connecting to shm\n");
-        exit(EXIT_FAILURE);
-    }
-    // Attach to the shared memory
-    int *shmptr = (int *)shmat(shm_id, NULL, 0);
-    if (shmptr == (void *)-1)
-    {
-        perror("[Client] Error while attaching to shared memory\n");
+        perror("[Client] Error while leasing shared memory\n");
         exit(EXIT_FAILURE);
     }
+    message.data.request_handle = request_handle;
 
     int shmptr_index = 0;
     // Store data in shared memory using array traversals
     shmptr[shmptr_index++] = (starting_vertex - 1);
 
+    // The shared memory id of the ring to stream the result through, -1 to get it all at the end
+    int ring_id = -1;
+    struct result_ring *ring = NULL;
+    if (stream_bfs && (ring = result_ring_create(&ring_id)) == NULL)
+    {
+        perror("[Client] Error while creating the result ring\n");
+        exit(EXIT_FAILURE);
+    }
+    shmptr[shmptr_index++] = ring_id;
+    shmptr[shmptr_index++] = bfs_direction;
+
     // Change message channel to load balancer and send it to load balancer
     message.msg_type = LOAD_BALANCER_CHANNEL;
     message.data.operation = 4;
     message.data.seq_num = seq_num;
 
     // Send the message to the load balancer
-    if (msgsnd(msg_queue_id, &message, sizeof(message.data), 0) == -1)
+    if (message_queue_send(queue, &message, sizeof(message.data)) == -1)
     {
         perror("[Client] Message could not be sent, please try again");
         exit(EXIT_FAILURE);
     }
     else
     {
-        while (msgrcv(msg_queue_id, &message, sizeof(message.data), seq_num, 0) == -1)
+        if (ring != NULL)
+        {
+            // Print the vertices level by level while the secondary server is still traversing
+            printf("[Client] Streaming the BFS result: \n");
+            uint32_t vertices[256];
+            long popped;
+            useconds_t backoff = 1;
+            while ((popped = result_ring_pop(ring, vertices, 256)) != -1)
+            {
+                if (popped == 0)
+                {
+                    usleep(backoff);
+                    backoff = backoff < 1000 ? backoff * 2 : backoff;
+                    continue;
+                }
+                backoff = 1;
+                for (long i = 0; i < popped; i++)
+                {
+                    printf("%u ", vertices[i]);
+                }
+                fflush(stdout);
+            }
+            printf("\n");
+        }
+
+        while (message_queue_receive(queue, &message, sizeof(message.data), seq_num) == -1)
         {
             if (errno == EIDRM)
             {
@@ -297,25 +439,28 @@ void operation_four(int msg_queue_id, int seq_num, struct msg_buffer message)
             perror("[Client] Error while receiving message from secondary server");
         }
         printf("[Client] Message received from the secondary Server: %ld -> %s using %ld\n", message.msg_type, message.data.graph_name, message.data.operation);
-        int i = 0;
-
-        while (message.data.graph_name[i] != '*')
+        if (ring == NULL || message.data.operation == BUSY)
         {
-            printf("%d ", message.data.graph_name[i]);
-            i++;
+            print_result(&message);
+        }
+        else
+        {
+            printf("[Client] Received %d streamed vertices", message.data.result_length);
         }
         printf("\n[Client] Operation done successfully");
     }
 
-    // Detach shared memory and delete it
-    if (shmdt(shmptr) == -1)
+    // Remove the ring
+    if (ring != NULL && (shmdt(ring) == -1 || shmctl(ring_id, IPC_RMID, 0) == -1))
     {
-        perror("[Client] Could not detach from shared memory\n");
+        perror("[Client] Error while deleting the result ring\n");
         exit(EXIT_FAILURE);
     }
-    if (shmctl(shm_id, IPC_RMID, 0) == -1)
+
+    // Give the block back to the arena, the server is done with it once it has replied
+    if (arena_release(arena, request_handle, shmptr) == -1)
     {
-        perror("[Client] Error while deleting the shared memory\n");
+        perror("[Client] Error while releasing shared memory\n");
         exit(EXIT_FAILURE);
     }
 }
@@ -333,6 +478,29 @@ int main()
     // Initialize the client
     printf("[Client] Initializing Client...\n");
 
+    char *stream_setting = getenv("BFS_STREAM");
+    stream_bfs = stream_setting != NULL && strcmp(stream_setting, "1") == 0;
+
+    char *direction_setting = getenv("BFS_DIRECTION");
+    if (direction_setting != NULL && strcmp(direction_setting, "top-down") == 0)
+    {
+        bfs_direction = BFS_TOP_DOWN;
+    }
+    else if (direction_setting != NULL && strcmp(direction_setting, "direction-optimizing") == 0)
+    {
+        bfs_direction = BFS_DIRECTION_OPTIMIZING;
+    }
+
+    char *priority_setting = getenv("REQUEST_PRIORITY");
+    if (priority_setting != NULL && strcmp(priority_setting, "interactive") == 0)
+    {
+        request_priority = PRIORITY_INTERACTIVE;
+    }
+    else if (priority_setting != NULL && strcmp(priority_setting, "batch") == 0)
+    {
+        request_priority = PRIORITY_BATCH;
+    }
+
     key_t key;
     int msg_queue_id;
     struct msg_buffer message;
@@ -353,6 +521,20 @@ int main()
 
     printf("[Client] Successfully connected to the Message Queue %d %d\n", key, msg_queue_id);
 
+    // With POSIX message queues the replies of the servers arrive on a queue of the client
+    if (message_queue_open(&queue, msg_queue_id, MESSAGE_QUEUE_CLIENT, sizeof(struct msg_buffer)) == -1)
+    {
+        perror("[Client] Error while creating the reply queue");
+        exit(EXIT_FAILURE);
+    }
+
+    // Attach to the arena created by the load balancer
+    if ((arena = arena_attach()) == NULL)
+    {
+        perror("[Client] Error while attaching to the shared memory arena");
+        exit(EXIT_FAILURE);
+    }
+
     // Display the menu
     while (1)
     {
@@ -367,6 +549,15 @@ int main()
         int seq_num;
         printf("Enter Sequence Number: ");
         scanf("%d", &seq_num);
+        while (seq_num < 1 || seq_num >= REGISTRATION_REPLY_BASE)
+        {
+            printf("Sequence numbers go from 1 to %ld, enter another one: ", REGISTRATION_REPLY_BASE - 1);
+            if (scanf("%d", &seq_num) != 1)
+            {
+                message_queue_close(&queue);
+                exit(EXIT_FAILURE);
+            }
+        }
 
         int operation;
         printf("Enter Operation Number: ");
@@ -374,25 +565,35 @@ int main()
 
         if (operation == 5)
         {
+            message_queue_close(&queue);
             exit(EXIT_SUCCESS);
         }
 
         printf("Enter Graph Name: ");
         scanf("%s", message.data.graph_name);
+        message.data.request_handle = -1;
+        message.data.result_handle = -1;
+        message.data.result_length = 0;
+        message.data.client_id = getpid();
+        message.data.priority = request_priority;
 
         printf("\nInput given: Seq: %d Op: %d Name: %s\n", seq_num, operation, message.data.graph_name);
 
-        if (operation == 1 || operation == 2)
+        if (operation == 1)
+        {
+            operation_one(&queue, seq_num, message);
+        }
+        else if (operation == 2)
         {
-            operation_one(msg_queue_id, seq_num, message);
+            operation_two(&queue, seq_num, message);
         }
         else if (operation == 3)
         {
-            operation_three(msg_queue_id, seq_num, message);
+            operation_three(&queue, seq_num, message);
         }
         else if (operation == 4)
         {
-            operation_four(msg_queue_id, seq_num, message);
+            operation_four(&queue, seq_num, message);
         }
         else
         {
@@ -0,0 +1,85 @@
+/**
+ * @file convert_graph.c
+ * @brief
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ * POSIX-compliant C program convert_graph.c
+ *
+ * One-time converter from the old text adjacency matrix files (Gn.txt) to the
+ * binary CSR files (Gn.csr) that the servers use as their native storage.
+ *
+ */
+
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "graph_store.h"
+
+/**
+ * @brief Converts a single text graph file into a binary CSR file next to it
+ *
+ * @param text_path
+ * @return int 0 on success, -1 on failure
+ */
+int convert(const char *text_path)
+{
+    struct graph graph;
+    if (graph_read_text(text_path, &graph) == -1)
+    {
+        fprintf(stderr, "[Convert] Could not read %s: %s\n", text_path, strerror(errno));
+        return -1;
+    }
+
+    char csr_path[GRAPH_PATH_LENGTH];
+    graph_storage_path(text_path, csr_path, sizeof(csr_path));
+    graph.generation = 1;
+    if (graph_write(csr_path, &graph) == -1)
+    {
+        fprintf(stderr, "[Convert] Could not write %s: %s\n", csr_path, strerror(errno));
+        graph_free(&graph);
+        return -1;
+    }
+
+    printf("[Convert] %s -> %s (%u nodes, %lu edges)\n", text_path, csr_path, graph.number_of_nodes, (unsigned long)graph.number_of_edges);
+    graph_free(&graph);
+    return 0;
+}
+
+/**
+ * @brief Converts the files given on the command line, or every G*.txt file in the
+ * current directory when no arguments are given (so that 'make convert_graph' works)
+ *
+ * @return int
+ */
+int main(int argc, char *argv[])
+{
+    int failures = 0;
+
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            failures += convert(argv[i]) == -1;
+        }
+    }
+    else
+    {
+        glob_t files;
+        if (glob("G*.txt", 0, NULL, &files) != 0)
+        {
+            printf("[Convert] No G*.txt files found in the current directory\n");
+            return 0;
+        }
+        for (size_t i = 0; i < files.gl_pathc; i++)
+        {
+            failures += convert(files.gl_pathv[i]) == -1;
+        }
+        globfree(&files);
+    }
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,485 @@
+/**
+ * @file graph_bfs.h
+ * @brief Level-synchronous parallel BFS, top-down or direction-optimizing
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * The BFS order is built in place in 'order': the frontier (the vertices of the current level)
+ * is always the slice order[frontier_begin, frontier_end), and the next level is appended right
+ * after it. A vertex is claimed with an atomic test-and-set on a bitmap of visited vertices, so
+ * it is added to the order exactly once even when several threads reach it at the same time.
+ *
+ * A small level is expanded by the calling thread alone, in order, so small graphs give the
+ * same order as a sequential BFS and pay nothing for threads. A level with at least
+ * BFS_PARALLEL_FRONTIER vertices of work is split across the threads of a traversal_pool: each
+ * thread takes chunks of the work and appends the vertices it claims to a buffer of its own,
+ * without any lock. The buffers are then copied after the frontier in thread order, each
+ * thread at the offset given by a prefix sum of the buffer lengths.
+ *
+ * A top-down step scans the neighbors of every frontier vertex. Once the frontier is large
+ * most of those neighbors are visited already, so a direction-optimizing BFS switches to
+ * bottom-up steps: every unvisited vertex scans its own neighbors and stops at the first one
+ * in the frontier. It switches when the edges out of the frontier are more than 1/BFS_ALPHA of
+ * the edges of the unvisited vertices, and back to top-down once the frontier has fewer than
+ * 1/BFS_BETA of the vertices (Beamer et al.). Bottom-up steps need the edges into a vertex, so
+ * they are only correct on symmetric (undirected) graphs, see bfs_graph_is_symmetric. Both
+ * directions give the same levels, only the order of the vertices within a level differs.
+ *
+ * struct bfs keeps its buffers between traversals, it only grows them for larger graphs.
+ */
+
+#ifndef GRAPH_BFS_H
+#define GRAPH_BFS_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "graph_dense.h"
+#include "graph_store.h"
+#include "traversal_pool.h"
+
+#define BFS_CHUNK 64
+#define BFS_BOTTOM_UP_CHUNK 16 // words of the visited bitmap, 1024 vertices
+#define BFS_PARALLEL_FRONTIER 1024
+#define BFS_ALPHA 14
+#define BFS_BETA 24
+// Below this the edges saved by bottom-up steps do not pay for the bitmaps
+#define BFS_BOTTOM_UP_MIN_VERTICES 4096
+
+// Direction of a BFS, BFS_DEFAULT lets the server choose
+#define BFS_DEFAULT 0
+#define BFS_TOP_DOWN 1
+#define BFS_DIRECTION_OPTIMIZING 2
+
+/**
+ * @brief Vertices claimed by one thread while a level is expanded
+ */
+struct bfs_buffer
+{
+    uint32_t *vertices;
+    uint64_t length;
+    uint64_t capacity;
+    uint64_t edges;  // sum of the degrees of the vertices
+    uint64_t offset; // of the first vertex in the next level
+    int failed;
+};
+
+struct bfs
+{
+    struct traversal_pool *pool;
+    const struct graph *graph;
+    const struct dense_graph *dense;
+    uint64_t *visited;
+    uint64_t *frontier_bits; // the frontier as a bitmap, during bottom-up steps
+    uint32_t *order;
+    uint64_t capacity; // vertices that the bitmaps and order have room for
+    uint64_t frontier_begin;
+    uint64_t frontier_end;
+    uint64_t next_end;   // end of the next level, while the calling thread expands it alone
+    uint64_t next_chunk; // next piece of work to be taken by a thread
+    struct bfs_buffer *buffers;
+    int direction;
+    int bottom_up;
+    uint64_t frontier_edges;   // sum of the degrees of the frontier
+    uint64_t unexplored_edges; // sum of the degrees of the unvisited vertices
+    uint64_t next_edges;
+    uint64_t levels;
+    uint64_t parallel_levels;
+    uint64_t bottom_up_levels;
+};
+
+static inline void bfs_init(struct bfs *bfs, struct traversal_pool *pool)
+{
+    memset(bfs, 0, sizeof(*bfs));
+    bfs->pool = pool;
+}
+
+static inline void bfs_free(struct bfs *bfs)
+{
+    free(bfs->visited);
+    free(bfs->frontier_bits);
+    free(bfs->order);
+    if (bfs->buffers != NULL)
+    {
+        for (int i = 0; i < bfs->pool->number_of_threads; i++)
+        {
+            free(bfs->buffers[i].vertices);
+        }
+        free(bfs->buffers);
+    }
+    memset(bfs, 0, sizeof(*bfs));
+}
+
+/**
+ * @brief Checks that every edge (u, v) of the graph has its reverse edge (v, u).
+ * Relies on the neighbors of every vertex being sorted, as graph files keep them. A dense
+ * graph is checked on its bit matrix, its CSR arrays are not kept.
+ */
+static inline int bfs_graph_is_symmetric(const struct graph *graph, const struct dense_graph *dense)
+{
+    if (dense != NULL)
+    {
+        for (uint32_t u = 0; u < dense->number_of_nodes; u++)
+        {
+            struct neighbor_iterator neighbors;
+            uint32_t v;
+            neighbors_begin(&neighbors, graph, dense, u);
+            while (neighbors_next(&neighbors, &v))
+            {
+                if (!((dense_row(dense, v)[u / 64] >> (u % 64)) & 1))
+                {
+                    return 0;
+                }
+            }
+        }
+        return 1;
+    }
+    for (uint32_t u = 0; u < graph->number_of_nodes; u++)
+    {
+        for (uint64_t edge = graph->offsets[u]; edge < graph->offsets[u + 1]; edge++)
+        {
+            uint32_t v = graph->neighbors[edge];
+            uint64_t low = graph->offsets[v];
+            uint64_t high = graph->offsets[v + 1];
+            while (low < high)
+            {
+                uint64_t middle = low + (high - low) / 2;
+                if (graph->neighbors[middle] < u)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            if (low == graph->offsets[v + 1] || graph->neighbors[low] != u)
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Marks a vertex visited
+ *
+ * @return 1 if this call visited it, 0 if it had been visited before
+ */
+static inline int bfs_claim(uint64_t *visited, uint32_t vertex)
+{
+    uint64_t bit = 1ULL << (vertex & 63);
+    // Most neighbors of a large frontier are already visited, test before the atomic write
+    if (__atomic_load_n(&visited[vertex >> 6], __ATOMIC_RELAXED) & bit)
+    {
+        return 0;
+    }
+    return !(__atomic_fetch_or(&visited[vertex >> 6], bit, __ATOMIC_RELAXED) & bit);
+}
+
+static inline int bfs_is_visited(const uint64_t *visited, uint32_t vertex)
+{
+    return (visited[vertex >> 6] >> (vertex & 63)) & 1;
+}
+
+static inline uint64_t bfs_degree(const struct bfs *bfs, uint32_t vertex)
+{
+    if (bfs->dense != NULL)
+    {
+        return dense_degree(bfs->dense, vertex);
+    }
+    return bfs->graph->offsets[vertex + 1] - bfs->graph->offsets[vertex];
+}
+
+static inline uint64_t bfs_words(uint64_t number_of_nodes)
+{
+    return (number_of_nodes + 63) / 64;
+}
+
+/**
+ * @brief Starts a traversal of graph from start, whose level 0 is then order[0, 1).
+ * direction is BFS_TOP_DOWN or BFS_DIRECTION_OPTIMIZING, the latter only for symmetric graphs.
+ *
+ * @return 0 on success, -1 on failure with errno set (EINVAL if start is not a vertex)
+ */
+static inline int bfs_begin(struct bfs *bfs, const struct graph *graph, const struct dense_graph *dense, uint32_t start, int direction)
+{
+    bfs->levels = 0;
+    bfs->parallel_levels = 0;
+    bfs->bottom_up_levels = 0;
+    bfs->frontier_begin = bfs->frontier_end = 0;
+    if (start >= graph->number_of_nodes)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t number_of_nodes = graph->number_of_nodes;
+    if (number_of_nodes > bfs->capacity)
+    {
+        uint64_t capacity = number_of_nodes > 2 * bfs->capacity ? number_of_nodes : 2 * bfs->capacity;
+        free(bfs->visited);
+        free(bfs->frontier_bits);
+        free(bfs->order);
+        bfs->visited = (uint64_t *)malloc(bfs_words(capacity) * sizeof(uint64_t));
+        bfs->frontier_bits = (uint64_t *)malloc(bfs_words(capacity) * sizeof(uint64_t));
+        bfs->order = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+        if (bfs->visited == NULL || bfs->frontier_bits == NULL || bfs->order == NULL)
+        {
+            free(bfs->visited);
+            free(bfs->frontier_bits);
+            free(bfs->order);
+            bfs->visited = bfs->frontier_bits = NULL;
+            bfs->order = NULL;
+            bfs->capacity = 0;
+            errno = ENOMEM;
+            return -1;
+        }
+        bfs->capacity = capacity;
+    }
+    if (bfs->buffers == NULL &&
+        (bfs->buffers = (struct bfs_buffer *)calloc(bfs->pool->number_of_threads, sizeof(struct bfs_buffer))) == NULL)
+    {
+        return -1;
+    }
+
+    memset(bfs->visited, 0, bfs_words(number_of_nodes) * sizeof(uint64_t));
+    bfs->graph = graph;
+    bfs->dense = dense;
+    bfs->direction = direction;
+    bfs->bottom_up = 0;
+    bfs_claim(bfs->visited, start);
+    bfs->order[0] = start;
+    bfs->frontier_begin = 0;
+    bfs->frontier_end = 1;
+    bfs->frontier_edges = bfs_degree(bfs, start);
+    bfs->unexplored_edges = graph->number_of_edges - bfs->frontier_edges;
+    return 0;
+}
+
+/**
+ * @brief Appends a vertex to a buffer, growing it if it is full
+ *
+ * @return 0 on success, -1 if the buffer could not be grown
+ */
+static inline int bfs_buffer_push(struct bfs_buffer *buffer, uint32_t vertex)
+{
+    if (buffer->length == buffer->capacity)
+    {
+        uint64_t capacity = buffer->capacity > 0 ? 2 * buffer->capacity : 4096;
+        uint32_t *vertices = (uint32_t *)realloc(buffer->vertices, capacity * sizeof(uint32_t));
+        if (vertices == NULL)
+        {
+            buffer->failed = 1;
+            return -1;
+        }
+        buffer->vertices = vertices;
+        buffer->capacity = capacity;
+    }
+    buffer->vertices[buffer->length++] = vertex;
+    return 0;
+}
+
+/**
+ * @brief Adds a vertex to the next level, in the buffer of a thread or right into the order
+ * when buffer is NULL
+ *
+ * @return 0 on success, -1 if the buffer could not be grown
+ */
+static inline int bfs_emit(struct bfs *bfs, struct bfs_buffer *buffer, uint32_t vertex)
+{
+    uint64_t degree = bfs->direction == BFS_DIRECTION_OPTIMIZING ? bfs_degree(bfs, vertex) : 0;
+    if (buffer == NULL)
+    {
+        bfs->order[bfs->next_end++] = vertex;
+        bfs->next_edges += degree;
+        return 0;
+    }
+    if (bfs_buffer_push(buffer, vertex) == -1)
+    {
+        return -1;
+    }
+    buffer->edges += degree;
+    return 0;
+}
+
+/**
+ * @brief Top-down step for the frontier vertices order[begin, end): claims their unvisited neighbors
+ */
+static inline int bfs_top_down(struct bfs *bfs, struct bfs_buffer *buffer, uint64_t begin, uint64_t end)
+{
+    for (uint64_t i = begin; i < end; i++)
+    {
+        struct neighbor_iterator neighbors;
+        uint32_t neighbor;
+        neighbors_begin(&neighbors, bfs->graph, bfs->dense, bfs->order[i]);
+        while (neighbors_next(&neighbors, &neighbor))
+        {
+            if (bfs_claim(bfs->visited, neighbor) && bfs_emit(bfs, buffer, neighbor) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Bottom-up step for the vertices of the words [begin, end) of the visited bitmap: every
+ * unvisited vertex with a neighbor in the frontier joins the next level. A word is only handled
+ * by one thread, and the frontier bitmap is not changed during the step.
+ */
+static inline int bfs_bottom_up(struct bfs *bfs, struct bfs_buffer *buffer, uint64_t begin, uint64_t end)
+{
+    uint64_t number_of_nodes = bfs->graph->number_of_nodes;
+    for (uint64_t word = begin; word < end; word++)
+    {
+        uint64_t unvisited = ~bfs->visited[word];
+        if (word == number_of_nodes / 64)
+        {
+            unvisited &= (1ULL << (number_of_nodes % 64)) - 1;
+        }
+        uint64_t found = 0;
+        while (unvisited != 0)
+        {
+            uint32_t vertex = (uint32_t)(word * 64 + __builtin_ctzll(unvisited));
+            unvisited &= unvisited - 1;
+            struct neighbor_iterator neighbors;
+            uint32_t neighbor;
+            neighbors_begin(&neighbors, bfs->graph, bfs->dense, vertex);
+            while (neighbors_next(&neighbors, &neighbor))
+            {
+                if (bfs_is_visited(bfs->frontier_bits, neighbor))
+                {
+                    found |= 1ULL << (vertex & 63);
+                    if (bfs_emit(bfs, buffer, vertex) == -1)
+                    {
+                        return -1;
+                    }
+                    break;
+                }
+            }
+        }
+        __atomic_fetch_or(&bfs->visited[word], found, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/**
+ * @brief Expands chunks of the level into the buffer of one thread, until the level is used up
+ */
+static inline void bfs_expand_job(void *arg, int thread)
+{
+    struct bfs *bfs = (struct bfs *)arg;
+    struct bfs_buffer *buffer = &bfs->buffers[thread];
+    buffer->length = 0;
+    buffer->edges = 0;
+    buffer->failed = 0;
+    uint64_t chunk = bfs->bottom_up ? BFS_BOTTOM_UP_CHUNK : BFS_CHUNK;
+    uint64_t last = bfs->bottom_up ? bfs_words(bfs->graph->number_of_nodes) : bfs->frontier_end;
+    while (1)
+    {
+        uint64_t begin = __atomic_fetch_add(&bfs->next_chunk, chunk, __ATOMIC_RELAXED);
+        if (begin >= last)
+        {
+            return;
+        }
+        uint64_t end = begin + chunk < last ? begin + chunk : last;
+        int result = bfs->bottom_up ? bfs_bottom_up(bfs, buffer, begin, end) : bfs_top_down(bfs, buffer, begin, end);
+        if (result == -1)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Copies the buffer of one thread to its place in the next level
+ */
+static inline void bfs_merge_job(void *arg, int thread)
+{
+    struct bfs *bfs = (struct bfs *)arg;
+    struct bfs_buffer *buffer = &bfs->buffers[thread];
+    if (buffer->length > 0)
+    {
+        memcpy(bfs->order + bfs->frontier_end + buffer->offset, buffer->vertices, buffer->length * sizeof(uint32_t));
+    }
+}
+
+/**
+ * @brief Replaces the frontier with the next level
+ *
+ * @return number of vertices in the new frontier, 0 when the traversal is over, -1 on failure with errno set
+ */
+static inline long bfs_next_level(struct bfs *bfs)
+{
+    uint64_t number_of_nodes = bfs->graph->number_of_nodes;
+    uint64_t frontier = bfs->frontier_end - bfs->frontier_begin;
+
+    if (bfs->direction == BFS_DIRECTION_OPTIMIZING && number_of_nodes >= BFS_BOTTOM_UP_MIN_VERTICES)
+    {
+        if (!bfs->bottom_up && bfs->frontier_edges > bfs->unexplored_edges / BFS_ALPHA)
+        {
+            bfs->bottom_up = 1;
+        }
+        else if (bfs->bottom_up && frontier < number_of_nodes / BFS_BETA)
+        {
+            bfs->bottom_up = 0;
+        }
+    }
+    if (bfs->bottom_up)
+    {
+        memset(bfs->frontier_bits, 0, bfs_words(number_of_nodes) * sizeof(uint64_t));
+        for (uint64_t i = bfs->frontier_begin; i < bfs->frontier_end; i++)
+        {
+            bfs->frontier_bits[bfs->order[i] >> 6] |= 1ULL << (bfs->order[i] & 63);
+        }
+    }
+
+    // A bottom-up step looks at every vertex, a top-down step at the frontier
+    uint64_t work = bfs->bottom_up ? number_of_nodes : frontier;
+    bfs->next_end = bfs->frontier_end;
+    bfs->next_edges = 0;
+    if (work < BFS_PARALLEL_FRONTIER || bfs->pool->number_of_threads == 1)
+    {
+        int result = bfs->bottom_up ? bfs_bottom_up(bfs, NULL, 0, bfs_words(number_of_nodes))
+                                    : bfs_top_down(bfs, NULL, bfs->frontier_begin, bfs->frontier_end);
+        if (result == -1)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    else
+    {
+        bfs->next_chunk = bfs->bottom_up ? 0 : bfs->frontier_begin;
+        traversal_pool_run(bfs->pool, bfs_expand_job, bfs);
+
+        // Prefix sum of the buffer lengths gives every thread its place in the next level
+        uint64_t offset = 0;
+        for (int i = 0; i < bfs->pool->number_of_threads; i++)
+        {
+            if (bfs->buffers[i].failed)
+            {
+                errno = ENOMEM;
+                return -1;
+            }
+            bfs->buffers[i].offset = offset;
+            offset += bfs->buffers[i].length;
+            bfs->next_edges += bfs->buffers[i].edges;
+        }
+        traversal_pool_run(bfs->pool, bfs_merge_job, bfs);
+        bfs->next_end += offset;
+        bfs->parallel_levels++;
+    }
+
+    bfs->levels++;
+    bfs->bottom_up_levels += bfs->bottom_up;
+    bfs->frontier_edges = bfs->next_edges;
+    bfs->unexplored_edges -= bfs->next_edges < bfs->unexplored_edges ? bfs->next_edges : bfs->unexplored_edges;
+    bfs->frontier_begin = bfs->frontier_end;
+    bfs->frontier_end = bfs->next_end;
+    return (long)(bfs->frontier_end - bfs->frontier_begin);
+}
+
+#endif
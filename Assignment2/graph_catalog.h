@@ -0,0 +1,296 @@
+/**
+ * @file graph_catalog.h
+ * @brief Shared memory catalog of the graphs in the database
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * The catalog is a small shared memory segment created by the load balancer and attached
+ * by the servers. It holds one entry per graph with the latest version of the graph, which
+ * is the generation number of the last graph file written by the primary server. The
+ * secondary servers compare it against the generation of the graph they have cached, so a
+ * cached graph is never served once a newer version has been written. Entries are keyed on the
+ * CSR file the graph is stored in, not on the name a client used, so G1 and G1.txt share one.
+ *
+ * Lookups are lock free, only adding a new graph takes the process-shared mutex.
+ *
+ * An entry also holds the size of its graph, the number of vertices plus the number of edges.
+ * The primary server records it when a graph is uploaded and the secondary servers whenever they
+ * load a graph, so that the load balancer can tell cheap requests from expensive ones.
+ *
+ * Every entry also holds the reader-writer lock of its graph, so every name of the same files
+ * takes the same lock. The locks are process-shared, writer-preferring pthread rwlocks
+ * initialised by the load balancer, so taking one is a few atomic operations in the common
+ * case instead of several semaphore system calls, and graphs never wait on each other. Writers are preferred so that a steady stream of readers cannot
+ * keep the primary server from writing a new version. The writer preference is a glibc
+ * extension, so the programs that include this file define _GNU_SOURCE.
+ */
+
+#ifndef GRAPH_CATALOG_H
+#define GRAPH_CATALOG_H
+
+// The writer preference of the locks is a glibc extension
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "graph_store.h"
+
+#define CATALOG_PROJECT_ID 'C'
+#define CATALOG_SIZE 256
+#define CATALOG_NAME_LENGTH GRAPH_PATH_LENGTH
+
+struct catalog_entry
+{
+    char graph_name[CATALOG_NAME_LENGTH];
+    int in_use;
+    uint64_t version;
+    uint64_t size; // vertices plus edges of the graph, 0 until a server has seen it
+    pthread_rwlock_t lock;
+};
+
+struct catalog
+{
+    pthread_mutex_t mutex;
+    struct catalog_entry entries[CATALOG_SIZE];
+};
+
+/**
+ * @brief Creates and initialises the catalog, called once by the load balancer
+ *
+ * @param catalog_id set to the shared memory id so that the creator can remove it
+ * @return struct catalog* or NULL on failure with errno set
+ */
+static inline struct catalog *catalog_create(int *catalog_id)
+{
+    key_t key = ftok(".", CATALOG_PROJECT_ID);
+    if (key == -1)
+    {
+        return NULL;
+    }
+    if ((*catalog_id = shmget(key, sizeof(struct catalog), 0666 | IPC_CREAT)) == -1)
+    {
+        return NULL;
+    }
+    struct catalog *catalog = (struct catalog *)shmat(*catalog_id, NULL, 0);
+    if (catalog == (void *)-1)
+    {
+        return NULL;
+    }
+
+    memset(catalog, 0, sizeof(struct catalog));
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&catalog->mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    // The locks are initialised up front, an entry can then be used as soon as it is added
+    pthread_rwlockattr_t lock_attributes;
+    pthread_rwlockattr_init(&lock_attributes);
+    pthread_rwlockattr_setpshared(&lock_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_rwlockattr_setkind_np(&lock_attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < CATALOG_SIZE; i++)
+    {
+        pthread_rwlock_init(&catalog->entries[i].lock, &lock_attributes);
+    }
+    pthread_rwlockattr_destroy(&lock_attributes);
+    return catalog;
+}
+
+/**
+ * @brief Attaches to the catalog created by the load balancer
+ *
+ * @return struct catalog* or NULL on failure with errno set
+ */
+static inline struct catalog *catalog_attach(void)
+{
+    key_t key = ftok(".", CATALOG_PROJECT_ID);
+    if (key == -1)
+    {
+        return NULL;
+    }
+    int catalog_id = shmget(key, sizeof(struct catalog), 0666);
+    if (catalog_id == -1)
+    {
+        return NULL;
+    }
+    struct catalog *catalog = (struct catalog *)shmat(catalog_id, NULL, 0);
+    return catalog == (void *)-1 ? NULL : catalog;
+}
+
+static inline uint64_t catalog_hash(const char *graph_name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = graph_name; *c != '\0'; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Key of a graph in the catalog, the path of its CSR file
+ */
+static inline void catalog_key(const char *graph_name, char *key, size_t size)
+{
+    graph_storage_path(graph_name, key, size);
+}
+
+/**
+ * @brief Finds the entry of a graph by its catalog_key, adding it if 'create' is set
+ *
+ * @return struct catalog_entry* or NULL if the graph is not in the catalog (or the catalog is full)
+ */
+static inline struct catalog_entry *catalog_find(struct catalog *catalog, const char *graph_name, int create)
+{
+    uint64_t start = catalog_hash(graph_name) % CATALOG_SIZE;
+
+    // Entries are never removed, so a probe can stop at the first unused entry
+    for (int probe = 0; probe < CATALOG_SIZE; probe++)
+    {
+        struct catalog_entry *entry = &catalog->entries[(start + probe) % CATALOG_SIZE];
+        if (!__atomic_load_n(&entry->in_use, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+        if (strncmp(entry->graph_name, graph_name, CATALOG_NAME_LENGTH) == 0)
+        {
+            return entry;
+        }
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+
+    // Probe again under the mutex, someone else may have added the graph in the meantime
+    struct catalog_entry *found = NULL;
+    pthread_mutex_lock(&catalog->mutex);
+    for (int probe = 0; probe < CATALOG_SIZE; probe++)
+    {
+        struct catalog_entry *entry = &catalog->entries[(start + probe) % CATALOG_SIZE];
+        if (!entry->in_use)
+        {
+            snprintf(entry->graph_name, CATALOG_NAME_LENGTH, "%s", graph_name);
+            entry->version = 0;
+            entry->size = 0;
+            __atomic_store_n(&entry->in_use, 1, __ATOMIC_RELEASE);
+            found = entry;
+            break;
+        }
+        if (strncmp(entry->graph_name, graph_name, CATALOG_NAME_LENGTH) == 0)
+        {
+            found = entry;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&catalog->mutex);
+    return found;
+}
+
+/**
+ * @brief Latest version of a graph, 0 if it has not been written since the catalog was created
+ */
+static inline uint64_t catalog_version(struct catalog *catalog, const char *graph_name)
+{
+    char key[CATALOG_NAME_LENGTH];
+    catalog_key(graph_name, key, sizeof(key));
+    struct catalog_entry *entry = catalog_find(catalog, key, 0);
+    return entry == NULL ? 0 : __atomic_load_n(&entry->version, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Publishes a new version of a graph. Versions only ever move forward.
+ */
+static inline void catalog_publish(struct catalog *catalog, const char *graph_name, uint64_t version)
+{
+    char key[CATALOG_NAME_LENGTH];
+    catalog_key(graph_name, key, sizeof(key));
+    struct catalog_entry *entry = catalog_find(catalog, key, 1);
+    if (entry == NULL)
+    {
+        fprintf(stderr, "[Catalog] Catalog is full, could not publish %s\n", graph_name);
+        return;
+    }
+    uint64_t current = __atomic_load_n(&entry->version, __ATOMIC_ACQUIRE);
+    while (current < version && !__atomic_compare_exchange_n(&entry->version, &current, version, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+    }
+}
+
+/**
+ * @brief Records the number of vertices plus the number of edges of a graph
+ */
+static inline void catalog_set_size(struct catalog *catalog, const char *graph_name, uint64_t size)
+{
+    char key[CATALOG_NAME_LENGTH];
+    catalog_key(graph_name, key, sizeof(key));
+    struct catalog_entry *entry = catalog_find(catalog, key, 1);
+    if (entry != NULL)
+    {
+        __atomic_store_n(&entry->size, size, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Number of vertices plus number of edges of a graph, 0 if no server has seen it yet
+ */
+static inline uint64_t catalog_size(struct catalog *catalog, const char *graph_name)
+{
+    char key[CATALOG_NAME_LENGTH];
+    catalog_key(graph_name, key, sizeof(key));
+    struct catalog_entry *entry = catalog_find(catalog, key, 0);
+    return entry != NULL ? __atomic_load_n(&entry->size, __ATOMIC_RELAXED) : 0;
+}
+
+/**
+ * @brief Takes the lock of a graph for reading, adding the graph to the catalog if needed.
+ * Readers share the lock with each other but not with a writer of the same graph.
+ *
+ * @return the entry to pass to catalog_unlock, NULL if the catalog is full
+ */
+static inline struct catalog_entry *catalog_read_lock(struct catalog *catalog, const char *graph_name)
+{
+    char key[CATALOG_NAME_LENGTH];
+    catalog_key(graph_name, key, sizeof(key));
+    struct catalog_entry *entry = catalog_find(catalog, key, 1);
+    if (entry != NULL)
+    {
+        pthread_rwlock_rdlock(&entry->lock);
+    }
+    return entry;
+}
+
+/**
+ * @brief Takes the lock of a graph for writing, adding the graph to the catalog if needed
+ *
+ * @return the entry to pass to catalog_unlock, NULL if the catalog is full
+ */
+static inline struct catalog_entry *catalog_write_lock(struct catalog *catalog, const char *graph_name)
+{
+    char key[CATALOG_NAME_LENGTH];
+    catalog_key(graph_name, key, sizeof(key));
+    struct catalog_entry *entry = catalog_find(catalog, key, 1);
+    if (entry != NULL)
+    {
+        pthread_rwlock_wrlock(&entry->lock);
+    }
+    return entry;
+}
+
+static inline void catalog_unlock(struct catalog_entry *entry)
+{
+    pthread_rwlock_unlock(&entry->lock);
+}
+
+#endif
@@ -0,0 +1,405 @@
+/**
+ * @file graph_delta.h
+ * @brief Edge and vertex changes to a graph, stored next to its CSR file
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * Modifying a graph (operation 2) does not rewrite the CSR file. The changes are appended to
+ * a delta file (G1.txt -> G1.delta), so a write costs O(changed edges):
+ *
+ *   struct graph_delta_header   base_generation is the generation of the CSR file it applies to
+ *   struct graph_delta_record[] one per change, in the order they were made
+ *
+ * Every record gets the next version number of the graph in 'generation', so the version of a
+ * graph is the generation of its last delta record, or of its CSR file if there are none.
+ * A delta file whose base_generation does not match the CSR file is left over from before the
+ * graph was replaced and is ignored.
+ *
+ * Records are only ever appended and a new delta file replaces the old one with a rename, so
+ * a reader that opened a delta file can read any version in it without holding a lock while
+ * newer changes are appended. The writer renames under the write lock of the graph, so the CSR
+ * file and the delta file a reader pins under the read lock always belong together.
+ *
+ * Edge changes are undirected, they add or remove both (u, v) and (v, u). Vertex ids never
+ * change: a new vertex gets the next id, and removing a vertex removes all of its edges.
+ */
+
+#ifndef GRAPH_DELTA_H
+#define GRAPH_DELTA_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "graph_store.h"
+
+#define GRAPH_DELTA_MAGIC "GRAPHDLT"
+#define GRAPH_DELTA_VERSION 1
+#define GRAPH_DELTA_EXTENSION ".delta"
+
+#define DELTA_ADD_EDGE 1
+#define DELTA_REMOVE_EDGE 2
+#define DELTA_ADD_VERTEX 3
+#define DELTA_REMOVE_VERTEX 4
+
+struct graph_delta_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t base_generation;
+};
+
+/**
+ * @brief One change to a graph. number_of_nodes is the number of vertices after the change,
+ * so the size of the graph is known from the last record alone.
+ */
+struct graph_delta_record
+{
+    uint64_t generation;
+    uint32_t operation;
+    uint32_t u;
+    uint32_t v;
+    uint32_t number_of_nodes;
+};
+
+/**
+ * @brief Maps a graph name used by the clients (e.g. G1.txt) to its delta file (G1.delta)
+ */
+static inline void graph_delta_path(const char *graph_name, char *path, size_t size)
+{
+    size_t length = strlen(graph_name);
+    if (length > 4 && strcmp(graph_name + length - 4, ".txt") == 0)
+    {
+        length -= 4;
+    }
+    snprintf(path, size, "%.*s%s", (int)length, graph_name, GRAPH_DELTA_EXTENSION);
+}
+
+/**
+ * @brief Opens a delta file for reading and checks that it belongs to the given CSR generation
+ *
+ * @return the file descriptor, or -1 if there is no usable delta file
+ */
+static inline int graph_delta_open(const char *path, uint64_t base_generation, off_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    struct graph_delta_header header;
+    struct stat file_stat;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, GRAPH_DELTA_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != GRAPH_DELTA_VERSION || header.base_generation != base_generation || fstat(fd, &file_stat) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    *size = file_stat.st_size;
+    return fd;
+}
+
+/**
+ * @brief Reads the changes of a delta file opened with graph_delta_open, up to and including
+ * version max_generation, and closes it. Records are appended in version order and never
+ * rewritten, so the changes of a version stay readable while newer ones are being appended.
+ *
+ * @param records set to a malloc'ed array of the changes, NULL if there are none
+ * @return number of records, or -1 if memory could not be allocated
+ */
+static inline long graph_delta_read_open(int fd, off_t size, uint64_t max_generation, struct graph_delta_record **records)
+{
+    *records = NULL;
+    // A record that is only partially written is not part of the graph yet
+    long count = (size - (off_t)sizeof(struct graph_delta_header)) / (off_t)sizeof(struct graph_delta_record);
+    if (count > 0)
+    {
+        *records = (struct graph_delta_record *)malloc(count * sizeof(struct graph_delta_record));
+        if (*records == NULL)
+        {
+            close(fd);
+            errno = ENOMEM;
+            return -1;
+        }
+        ssize_t bytes = pread(fd, *records, count * sizeof(struct graph_delta_record), sizeof(struct graph_delta_header));
+        count = bytes < 0 ? 0 : bytes / (ssize_t)sizeof(struct graph_delta_record);
+        long visible = 0;
+        while (visible < count && (*records)[visible].generation <= max_generation)
+        {
+            visible++;
+        }
+        count = visible;
+    }
+    close(fd);
+    return count;
+}
+
+/**
+ * @brief Reads every change made on top of the CSR file with the given generation
+ *
+ * @param records set to a malloc'ed array of the changes, NULL if there are none
+ * @return number of records, or -1 if memory could not be allocated
+ */
+static inline long graph_delta_read(const char *path, uint64_t base_generation, struct graph_delta_record **records)
+{
+    *records = NULL;
+    off_t size;
+    int fd = graph_delta_open(path, base_generation, &size);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    return graph_delta_read_open(fd, size, UINT64_MAX, records);
+}
+
+/**
+ * @brief Reads the last change made on top of the CSR file with the given generation, in O(1)
+ *
+ * @return 1 if there is one, 0 otherwise
+ */
+static inline int graph_delta_last(const char *path, uint64_t base_generation, struct graph_delta_record *record)
+{
+    off_t size;
+    int fd = graph_delta_open(path, base_generation, &size);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    long count = (size - (off_t)sizeof(struct graph_delta_header)) / (off_t)sizeof(struct graph_delta_record);
+    int found = count > 0 && pread(fd, record, sizeof(*record), sizeof(struct graph_delta_header) + (count - 1) * sizeof(*record)) == sizeof(*record);
+    close(fd);
+    return found;
+}
+
+/**
+ * @brief Writes a new delta file with the given changes to exactly 'path', replacing the file.
+ * The file is not synced, the write-ahead log has the changes.
+ *
+ * @return 0 on success, -1 on failure with errno set (the file is removed)
+ */
+static inline int graph_delta_write(const char *path, uint64_t base_generation, const struct graph_delta_record *records, long count)
+{
+    struct graph_delta_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GRAPH_DELTA_MAGIC, sizeof(header.magic));
+    header.version = GRAPH_DELTA_VERSION;
+    header.base_generation = base_generation;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    size_t bytes = count * sizeof(struct graph_delta_record);
+    if (write(fd, &header, sizeof(header)) != sizeof(header) || (bytes > 0 && write(fd, records, bytes) != (ssize_t)bytes))
+    {
+        int saved_errno = errno;
+        close(fd);
+        unlink(path);
+        errno = saved_errno == 0 ? EIO : saved_errno;
+        return -1;
+    }
+    return close(fd);
+}
+
+/**
+ * @brief Appends changes to the delta file of the CSR file with the given generation. The records
+ * are written with a single write. If the existing delta file belongs to an older CSR file, a new
+ * delta file is written to 'temporary_path' instead, and the caller renames it over the old one
+ * while it holds the write lock of the graph, so a reader never pairs a CSR file with a delta
+ * file of another generation.
+ *
+ * @return 0 if the changes were appended in place, 1 if they were written to 'temporary_path',
+ * -1 on failure with errno set
+ */
+static inline int graph_delta_append(const char *path, const char *temporary_path, uint64_t base_generation, const struct graph_delta_record *records, long count)
+{
+    off_t size;
+    int fd = graph_delta_open(path, base_generation, &size);
+    if (fd == -1)
+    {
+        return graph_delta_write(temporary_path, base_generation, records, count) == -1 ? -1 : 1;
+    }
+    close(fd);
+    fd = open(path, O_WRONLY | O_APPEND);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    // Drop a partially written record left behind by a failed append
+    long whole = (size - (off_t)sizeof(struct graph_delta_header)) / (off_t)sizeof(struct graph_delta_record);
+    off_t expected = sizeof(struct graph_delta_header) + whole * sizeof(struct graph_delta_record);
+    if (size != expected && ftruncate(fd, expected) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    size_t bytes = count * sizeof(struct graph_delta_record);
+    if (write(fd, records, bytes) != (ssize_t)bytes)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno == 0 ? EIO : saved_errno;
+        return -1;
+    }
+    return close(fd);
+}
+
+/**
+ * @brief Order of directed edge changes used by graph_apply_delta: by source, target and then
+ * by the order in which the changes were made
+ */
+struct graph_delta_edge
+{
+    uint32_t u;
+    uint32_t v;
+    long sequence;
+    uint32_t operation;
+};
+
+static inline int graph_delta_edge_compare(const void *a, const void *b)
+{
+    const struct graph_delta_edge *x = (const struct graph_delta_edge *)a;
+    const struct graph_delta_edge *y = (const struct graph_delta_edge *)b;
+    if (x->u != y->u)
+        return x->u < y->u ? -1 : 1;
+    if (x->v != y->v)
+        return x->v < y->v ? -1 : 1;
+    return x->sequence < y->sequence ? -1 : (x->sequence > y->sequence);
+}
+
+/**
+ * @brief Builds the graph that results from applying the changes to a CSR graph, in
+ * O(V + E + D log D) for D changes. The result is heap allocated and its generation is the
+ * generation of the last change.
+ *
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+static inline int graph_apply_delta(const struct graph *base, const struct graph_delta_record *records, long count, struct graph *merged)
+{
+    uint32_t number_of_nodes = count > 0 ? records[count - 1].number_of_nodes : base->number_of_nodes;
+    if (number_of_nodes < base->number_of_nodes)
+    {
+        number_of_nodes = base->number_of_nodes;
+    }
+
+    // removed[v] is one past the sequence number of the last time v was removed, 0 if never.
+    // An edge change only counts if it was made after both of its vertices were last removed
+    long *removed = (long *)calloc(number_of_nodes + 1, sizeof(long));
+    struct graph_delta_edge *edges = (struct graph_delta_edge *)malloc((2 * count + 1) * sizeof(struct graph_delta_edge));
+    merged->offsets = (uint64_t *)malloc(((size_t)number_of_nodes + 1) * sizeof(uint64_t));
+    merged->neighbors = NULL;
+    merged->mapping = NULL;
+    if (removed == NULL || edges == NULL || merged->offsets == NULL)
+    {
+        free(removed);
+        free(edges);
+        graph_free(merged);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    long number_of_changes = 0;
+    for (long i = 0; i < count; i++)
+    {
+        const struct graph_delta_record *record = &records[i];
+        if (record->operation == DELTA_REMOVE_VERTEX && record->u < number_of_nodes)
+        {
+            removed[record->u] = i + 1;
+        }
+        else if ((record->operation == DELTA_ADD_EDGE || record->operation == DELTA_REMOVE_EDGE) && record->u < number_of_nodes && record->v < number_of_nodes)
+        {
+            edges[number_of_changes++] = (struct graph_delta_edge){record->u, record->v, i + 1, record->operation};
+            if (record->u != record->v)
+            {
+                edges[number_of_changes++] = (struct graph_delta_edge){record->v, record->u, i + 1, record->operation};
+            }
+        }
+    }
+    qsort(edges, number_of_changes, sizeof(struct graph_delta_edge), graph_delta_edge_compare);
+
+    merged->number_of_nodes = number_of_nodes;
+    merged->generation = count > 0 ? records[count - 1].generation : base->generation;
+
+    // Two passes over the merge of the base neighbors and the changes of every vertex,
+    // the first one counts the edges and the second one fills them in
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint64_t edge = 0;
+        long change = 0;
+        for (uint32_t u = 0; u < number_of_nodes; u++)
+        {
+            merged->offsets[u] = edge;
+            uint64_t base_edge = u < base->number_of_nodes ? base->offsets[u] : 0;
+            uint64_t base_end = u < base->number_of_nodes ? base->offsets[u + 1] : 0;
+
+            while (base_edge < base_end || (change < number_of_changes && edges[change].u == u))
+            {
+                uint32_t base_v = base_edge < base_end ? base->neighbors[base_edge] : UINT32_MAX;
+                uint32_t change_v = (change < number_of_changes && edges[change].u == u) ? edges[change].v : UINT32_MAX;
+                uint32_t v = base_v < change_v ? base_v : change_v;
+                int present = 0;
+
+                if (base_v == v)
+                {
+                    // Base edges are older than every change
+                    present = removed[u] == 0 && removed[v] == 0;
+                    base_edge++;
+                }
+                if (change_v == v)
+                {
+                    // The last change to (u, v) decides, unless a vertex was removed after it
+                    while (change + 1 < number_of_changes && edges[change + 1].u == u && edges[change + 1].v == v)
+                    {
+                        change++;
+                    }
+                    long cleared = removed[u] > removed[v] ? removed[u] : removed[v];
+                    if (edges[change].sequence > cleared)
+                    {
+                        present = edges[change].operation == DELTA_ADD_EDGE;
+                    }
+                    change++;
+                }
+
+                if (present)
+                {
+                    if (pass == 1)
+                    {
+                        merged->neighbors[edge] = v;
+                    }
+                    edge++;
+                }
+            }
+        }
+        merged->offsets[number_of_nodes] = edge;
+        merged->number_of_edges = edge;
+        if (pass == 0)
+        {
+            merged->neighbors = (uint32_t *)malloc((edge > 0 ? edge : 1) * sizeof(uint32_t));
+            if (merged->neighbors == NULL)
+            {
+                break;
+            }
+        }
+    }
+
+    free(removed);
+    free(edges);
+    if (merged->neighbors == NULL)
+    {
+        graph_free(merged);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+#endif
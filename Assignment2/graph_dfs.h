@@ -0,0 +1,378 @@
+/**
+ * @file graph_dfs.h
+ * @brief Parallel DFS on a fixed team of threads with work stealing
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * A DFS task is a vertex to expand. Expanding a vertex claims each of its unvisited neighbors
+ * (atomic test-and-set on a visited bitmap, as in graph_bfs.h) and makes every claimed neighbor
+ * a new task. A vertex that claims no neighbor is a leaf of the DFS tree. These are the same
+ * leaves as when every claimed neighbor got a thread of its own, but the number of threads is
+ * the size of the traversal_pool whatever the depth of the graph.
+ *
+ * Every thread of the pool has a deque of tasks. A thread pushes the neighbors it claims at
+ * the bottom of its own deque and takes its next task from the bottom too, so it goes deep
+ * first. A thread whose deque is empty steals half of the tasks at the top of the deque of
+ * another thread. Those are the oldest tasks, closest to the root, with the most work under them.
+ * 'pending' counts the tasks in the deques and the ones being expanded, the traversal is over
+ * once it is 0.
+ *
+ * While fewer than DFS_PARALLEL_TASKS tasks are waiting, the calling thread expands them alone,
+ * so small graphs and long paths pay nothing for threads. Otherwise the team runs rounds of at
+ * most DFS_ROUND vertices per thread, so other requests get the pool between rounds.
+ * The deques keep every vertex at most once, so their memory is bounded by the size of the graph.
+ */
+
+#ifndef GRAPH_DFS_H
+#define GRAPH_DFS_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "graph_bfs.h"
+#include "graph_dense.h"
+#include "graph_store.h"
+#include "traversal_pool.h"
+
+#define DFS_PARALLEL_TASKS 1024
+#define DFS_ROUND 65536
+#define DFS_SEQUENTIAL_STEP 1024 // vertices expanded alone before looking at the number of tasks again
+#define DFS_STEAL_MAX 256
+
+/**
+ * @brief Tasks and leaves of one thread of the team
+ */
+struct dfs_deque
+{
+    pthread_mutex_t lock;
+    uint32_t *tasks; // tasks[top, bottom) are waiting, the owner works at the bottom
+    uint64_t top;
+    uint64_t bottom;
+    uint64_t capacity;
+    uint32_t *leaves;
+    uint64_t number_of_leaves;
+    uint64_t leaf_capacity;
+    unsigned long expanded;
+    unsigned long steals;
+};
+
+struct dfs
+{
+    struct traversal_pool *pool;
+    const struct graph *graph;
+    const struct dense_graph *dense;
+    uint64_t *visited;
+    uint64_t capacity; // vertices that the bitmap has room for
+    struct dfs_deque *deques;
+    uint64_t pending;
+    uint64_t budget; // vertices each thread may expand in this round
+    int failed;
+    unsigned long rounds;
+    unsigned long parallel_rounds;
+};
+
+static inline void dfs_init(struct dfs *dfs, struct traversal_pool *pool)
+{
+    memset(dfs, 0, sizeof(*dfs));
+    dfs->pool = pool;
+}
+
+static inline void dfs_free(struct dfs *dfs)
+{
+    free(dfs->visited);
+    if (dfs->deques != NULL)
+    {
+        for (int i = 0; i < dfs->pool->number_of_threads; i++)
+        {
+            pthread_mutex_destroy(&dfs->deques[i].lock);
+            free(dfs->deques[i].tasks);
+            free(dfs->deques[i].leaves);
+        }
+        free(dfs->deques);
+    }
+    memset(dfs, 0, sizeof(*dfs));
+}
+
+/**
+ * @brief Adds a task at the bottom of a deque
+ *
+ * @return 0 on success, -1 if the deque could not be grown
+ */
+static inline int dfs_push(struct dfs_deque *deque, uint32_t vertex)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity)
+    {
+        if (deque->top >= deque->capacity / 2 && deque->top > 0)
+        {
+            // Most of the deque was stolen, move the rest to the front instead of growing
+            memmove(deque->tasks, deque->tasks + deque->top, (deque->bottom - deque->top) * sizeof(uint32_t));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        }
+        else
+        {
+            uint64_t capacity = deque->capacity > 0 ? 2 * deque->capacity : 1024;
+            uint32_t *tasks = (uint32_t *)realloc(deque->tasks, capacity * sizeof(uint32_t));
+            if (tasks == NULL)
+            {
+                pthread_mutex_unlock(&deque->lock);
+                return -1;
+            }
+            deque->tasks = tasks;
+            deque->capacity = capacity;
+        }
+    }
+    deque->tasks[deque->bottom++] = vertex;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+/**
+ * @brief Takes the task at the bottom of a deque, the last one pushed
+ *
+ * @return 1 if there was a task, 0 if the deque is empty
+ */
+static inline int dfs_pop(struct dfs_deque *deque, uint32_t *vertex)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->top)
+    {
+        pthread_mutex_unlock(&deque->lock);
+        return 0;
+    }
+    *vertex = deque->tasks[--deque->bottom];
+    if (deque->bottom == deque->top)
+    {
+        deque->top = deque->bottom = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+}
+
+/**
+ * @brief Moves half of the tasks at the top of the deque of another thread to the deque of
+ * this thread, and takes the oldest of them
+ *
+ * @return 1 if a task was stolen, 0 if every other deque is empty, -1 on failure
+ */
+static inline int dfs_steal(struct dfs *dfs, int thread, uint32_t *vertex)
+{
+    uint32_t stolen[DFS_STEAL_MAX];
+    for (int i = 1; i < dfs->pool->number_of_threads; i++)
+    {
+        struct dfs_deque *victim = &dfs->deques[(thread + i) % dfs->pool->number_of_threads];
+        pthread_mutex_lock(&victim->lock);
+        uint64_t available = victim->bottom - victim->top;
+        if (available == 0)
+        {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        uint64_t count = (available + 1) / 2 < DFS_STEAL_MAX ? (available + 1) / 2 : DFS_STEAL_MAX;
+        memcpy(stolen, victim->tasks + victim->top, count * sizeof(uint32_t));
+        victim->top += count;
+        if (victim->bottom == victim->top)
+        {
+            victim->top = victim->bottom = 0;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        struct dfs_deque *deque = &dfs->deques[thread];
+        deque->steals++;
+        // Push the newest first, so the ones closest to the root are taken last by this thread
+        for (uint64_t j = count - 1; j > 0; j--)
+        {
+            if (dfs_push(deque, stolen[j]) == -1)
+            {
+                return -1;
+            }
+        }
+        *vertex = stolen[0];
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Claims the unvisited neighbors of a vertex as new tasks, or records it as a leaf
+ *
+ * @return 0 on success, -1 if memory ran out
+ */
+static inline int dfs_expand(struct dfs *dfs, int thread, uint32_t vertex)
+{
+    struct dfs_deque *deque = &dfs->deques[thread];
+    int leaf = 1;
+    struct neighbor_iterator neighbors;
+    uint32_t neighbor;
+    neighbors_begin(&neighbors, dfs->graph, dfs->dense, vertex);
+    while (neighbors_next(&neighbors, &neighbor))
+    {
+        if (bfs_claim(dfs->visited, neighbor))
+        {
+            leaf = 0;
+            // Counted before it can be stolen, so pending never drops to 0 while tasks are left
+            __atomic_fetch_add(&dfs->pending, 1, __ATOMIC_RELAXED);
+            if (dfs_push(deque, neighbor) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+
+    if (leaf)
+    {
+        if (deque->number_of_leaves == deque->leaf_capacity)
+        {
+            uint64_t capacity = deque->leaf_capacity > 0 ? 2 * deque->leaf_capacity : 1024;
+            uint32_t *leaves = (uint32_t *)realloc(deque->leaves, capacity * sizeof(uint32_t));
+            if (leaves == NULL)
+            {
+                return -1;
+            }
+            deque->leaves = leaves;
+            deque->leaf_capacity = capacity;
+        }
+        deque->leaves[deque->number_of_leaves++] = vertex;
+    }
+    deque->expanded++;
+    __atomic_fetch_sub(&dfs->pending, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Expands tasks, its own or stolen ones, until the budget of the round is spent or the
+ * traversal is over
+ */
+static inline void dfs_round_job(void *arg, int thread)
+{
+    struct dfs *dfs = (struct dfs *)arg;
+    uint64_t budget = dfs->budget;
+    uint32_t vertex;
+    while (budget > 0 && !__atomic_load_n(&dfs->failed, __ATOMIC_RELAXED))
+    {
+        if (!dfs_pop(&dfs->deques[thread], &vertex))
+        {
+            int stolen = dfs_steal(dfs, thread, &vertex);
+            if (stolen == -1)
+            {
+                __atomic_store_n(&dfs->failed, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            if (stolen == 0)
+            {
+                // Another thread may still be expanding a vertex with neighbors to claim
+                if (__atomic_load_n(&dfs->pending, __ATOMIC_ACQUIRE) == 0)
+                {
+                    return;
+                }
+                sched_yield();
+                continue;
+            }
+        }
+        if (dfs_expand(dfs, thread, vertex) == -1)
+        {
+            __atomic_store_n(&dfs->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        budget--;
+    }
+}
+
+/**
+ * @brief Starts a traversal of graph from start, the only task of the first deque
+ *
+ * @return 0 on success, -1 on failure with errno set (EINVAL if start is not a vertex)
+ */
+static inline int dfs_begin(struct dfs *dfs, const struct graph *graph, const struct dense_graph *dense, uint32_t start)
+{
+    if (dfs->deques == NULL)
+    {
+        if ((dfs->deques = (struct dfs_deque *)calloc(dfs->pool->number_of_threads, sizeof(struct dfs_deque))) == NULL)
+        {
+            return -1;
+        }
+        for (int i = 0; i < dfs->pool->number_of_threads; i++)
+        {
+            pthread_mutex_init(&dfs->deques[i].lock, NULL);
+        }
+    }
+    for (int i = 0; i < dfs->pool->number_of_threads; i++)
+    {
+        struct dfs_deque *deque = &dfs->deques[i];
+        deque->top = deque->bottom = 0;
+        deque->number_of_leaves = 0;
+        deque->expanded = deque->steals = 0;
+    }
+    dfs->pending = 0;
+    dfs->failed = 0;
+    dfs->rounds = dfs->parallel_rounds = 0;
+    if (start >= graph->number_of_nodes)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t number_of_nodes = graph->number_of_nodes;
+    if (number_of_nodes > dfs->capacity)
+    {
+        uint64_t capacity = number_of_nodes > 2 * dfs->capacity ? number_of_nodes : 2 * dfs->capacity;
+        free(dfs->visited);
+        if ((dfs->visited = (uint64_t *)malloc(bfs_words(capacity) * sizeof(uint64_t))) == NULL)
+        {
+            dfs->capacity = 0;
+            errno = ENOMEM;
+            return -1;
+        }
+        dfs->capacity = capacity;
+    }
+    memset(dfs->visited, 0, bfs_words(number_of_nodes) * sizeof(uint64_t));
+    dfs->graph = graph;
+    dfs->dense = dense;
+    bfs_claim(dfs->visited, start);
+    dfs->pending = 1;
+    return dfs_push(&dfs->deques[0], start);
+}
+
+/**
+ * @brief Runs the traversal started by dfs_begin to the end, the leaves are then in the
+ * 'leaves' of the deques
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int dfs_run(struct dfs *dfs)
+{
+    while (__atomic_load_n(&dfs->pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        // No round is running, so the deques can be read without their locks
+        uint64_t waiting = 0;
+        for (int i = 0; i < dfs->pool->number_of_threads; i++)
+        {
+            waiting += dfs->deques[i].bottom - dfs->deques[i].top;
+        }
+        if (waiting >= DFS_PARALLEL_TASKS && dfs->pool->number_of_threads > 1)
+        {
+            dfs->budget = DFS_ROUND;
+            traversal_pool_run(dfs->pool, dfs_round_job, dfs);
+            dfs->parallel_rounds++;
+        }
+        else
+        {
+            dfs->budget = DFS_SEQUENTIAL_STEP;
+            dfs_round_job(dfs, 0);
+        }
+        dfs->rounds++;
+        if (dfs->failed)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#endif
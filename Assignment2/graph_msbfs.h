@@ -0,0 +1,302 @@
+/**
+ * @file graph_msbfs.h
+ * @brief Multi-source BFS, up to 64 traversals of the same graph in one pass
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * Every vertex has a 64-bit mask per array, one bit per source (Then et al., "The More the
+ * Merrier"): seen says which traversals have reached the vertex, frontier which of them have
+ * it in their current level, and next which of them reach it in the next level. A level is
+ * expanded by OR-ing the frontier mask of every active vertex into the next mask of each
+ * neighbor, so the edges of a vertex are read once for all the traversals that have it in their
+ * frontier instead of once per traversal.
+ *
+ * The vertices whose next mask changes from empty are collected while a level is expanded,
+ * then sorted. Each new bit is then appended to the BFS order of its source, so each order
+ * lists its levels one after the other with the vertices of a level in increasing order.
+ * Large levels are expanded on the threads of a traversal_pool with atomic ORs, each thread
+ * collecting the vertices it touches first in a buffer of its own.
+ *
+ * struct msbfs keeps its arrays between batches, it only grows them for larger graphs.
+ */
+
+#ifndef GRAPH_MSBFS_H
+#define GRAPH_MSBFS_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "graph_bfs.h"
+#include "graph_dense.h"
+#include "graph_store.h"
+#include "traversal_pool.h"
+
+#define MSBFS_MAX_SOURCES 64
+#define MSBFS_CHUNK 256
+// Smaller graphs are traversed faster than a batch can be put together
+#define MSBFS_MIN_VERTICES 4096
+
+struct msbfs
+{
+    struct traversal_pool *pool;
+    const struct graph *graph;
+    const struct dense_graph *dense;
+    uint64_t *seen;
+    uint64_t *frontier;
+    uint64_t *next;
+    uint64_t capacity; // vertices that the masks have room for
+    struct bfs_buffer active;  // vertices with a non-empty frontier mask
+    struct bfs_buffer *touched; // one per thread of the pool
+    struct bfs_buffer orders[MSBFS_MAX_SOURCES];
+    int number_of_sources;
+    uint64_t next_chunk;
+    uint64_t levels;
+    uint64_t parallel_levels;
+};
+
+static inline void msbfs_init(struct msbfs *msbfs, struct traversal_pool *pool)
+{
+    memset(msbfs, 0, sizeof(*msbfs));
+    msbfs->pool = pool;
+}
+
+static inline void msbfs_free(struct msbfs *msbfs)
+{
+    free(msbfs->seen);
+    free(msbfs->frontier);
+    free(msbfs->next);
+    free(msbfs->active.vertices);
+    if (msbfs->touched != NULL)
+    {
+        for (int i = 0; i < msbfs->pool->number_of_threads; i++)
+        {
+            free(msbfs->touched[i].vertices);
+        }
+        free(msbfs->touched);
+    }
+    for (int i = 0; i < MSBFS_MAX_SOURCES; i++)
+    {
+        free(msbfs->orders[i].vertices);
+    }
+    memset(msbfs, 0, sizeof(*msbfs));
+}
+
+static inline int msbfs_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Starts one traversal per source, the order of sources[i] is then orders[i]. A source
+ * that is not a vertex of the graph gets an empty order.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int msbfs_begin(struct msbfs *msbfs, const struct graph *graph, const struct dense_graph *dense, const uint32_t *sources, int number_of_sources)
+{
+    uint64_t number_of_nodes = graph->number_of_nodes;
+    if (number_of_sources > MSBFS_MAX_SOURCES)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (number_of_nodes > msbfs->capacity)
+    {
+        uint64_t capacity = number_of_nodes > 2 * msbfs->capacity ? number_of_nodes : 2 * msbfs->capacity;
+        free(msbfs->seen);
+        free(msbfs->frontier);
+        free(msbfs->next);
+        msbfs->seen = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+        msbfs->frontier = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+        msbfs->next = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+        if (msbfs->seen == NULL || msbfs->frontier == NULL || msbfs->next == NULL)
+        {
+            free(msbfs->seen);
+            free(msbfs->frontier);
+            free(msbfs->next);
+            msbfs->seen = msbfs->frontier = msbfs->next = NULL;
+            msbfs->capacity = 0;
+            errno = ENOMEM;
+            return -1;
+        }
+        msbfs->capacity = capacity;
+    }
+    if (msbfs->touched == NULL &&
+        (msbfs->touched = (struct bfs_buffer *)calloc(msbfs->pool->number_of_threads, sizeof(struct bfs_buffer))) == NULL)
+    {
+        return -1;
+    }
+
+    memset(msbfs->seen, 0, number_of_nodes * sizeof(uint64_t));
+    memset(msbfs->frontier, 0, number_of_nodes * sizeof(uint64_t));
+    memset(msbfs->next, 0, number_of_nodes * sizeof(uint64_t));
+    msbfs->graph = graph;
+    msbfs->dense = dense;
+    msbfs->number_of_sources = number_of_sources;
+    msbfs->active.length = 0;
+    msbfs->levels = msbfs->parallel_levels = 0;
+    for (int i = 0; i < number_of_sources; i++)
+    {
+        msbfs->orders[i].length = 0;
+        msbfs->orders[i].failed = 0;
+        if (sources[i] >= number_of_nodes)
+        {
+            continue;
+        }
+        // Several requests may start from the same vertex, it is only active once
+        if (msbfs->frontier[sources[i]] == 0 && bfs_buffer_push(&msbfs->active, sources[i]) == -1)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        msbfs->seen[sources[i]] |= 1ULL << i;
+        msbfs->frontier[sources[i]] |= 1ULL << i;
+        if (bfs_buffer_push(&msbfs->orders[i], sources[i]) == -1)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief ORs the frontier masks of the active vertices [begin, end) into the next masks of
+ * their neighbors, collecting the neighbors whose next mask was empty
+ */
+static inline int msbfs_expand(struct msbfs *msbfs, struct bfs_buffer *touched, uint64_t begin, uint64_t end, int shared)
+{
+    for (uint64_t i = begin; i < end; i++)
+    {
+        uint32_t vertex = msbfs->active.vertices[i];
+        uint64_t frontier = msbfs->frontier[vertex];
+        struct neighbor_iterator neighbors;
+        uint32_t neighbor;
+        neighbors_begin(&neighbors, msbfs->graph, msbfs->dense, vertex);
+        while (neighbors_next(&neighbors, &neighbor))
+        {
+            // Seen masks only change between levels, so they are read without atomics
+            uint64_t bits = frontier & ~msbfs->seen[neighbor];
+            if (bits == 0)
+            {
+                continue;
+            }
+            uint64_t old;
+            if (shared)
+            {
+                if ((__atomic_load_n(&msbfs->next[neighbor], __ATOMIC_RELAXED) & bits) == bits)
+                {
+                    continue;
+                }
+                old = __atomic_fetch_or(&msbfs->next[neighbor], bits, __ATOMIC_RELAXED);
+            }
+            else
+            {
+                old = msbfs->next[neighbor];
+                msbfs->next[neighbor] |= bits;
+            }
+            if (old == 0 && bfs_buffer_push(touched, neighbor) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static inline void msbfs_expand_job(void *arg, int thread)
+{
+    struct msbfs *msbfs = (struct msbfs *)arg;
+    struct bfs_buffer *touched = &msbfs->touched[thread];
+    while (1)
+    {
+        uint64_t begin = __atomic_fetch_add(&msbfs->next_chunk, MSBFS_CHUNK, __ATOMIC_RELAXED);
+        if (begin >= msbfs->active.length)
+        {
+            return;
+        }
+        uint64_t end = begin + MSBFS_CHUNK < msbfs->active.length ? begin + MSBFS_CHUNK : msbfs->active.length;
+        if (msbfs_expand(msbfs, touched, begin, end, 1) == -1)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Expands the current level of every traversal and appends the next one to the orders
+ *
+ * @return number of active vertices in the new level, 0 when every traversal is over, -1 on failure with errno set
+ */
+static inline long msbfs_next_level(struct msbfs *msbfs)
+{
+    int threads = msbfs->pool->number_of_threads;
+    for (int i = 0; i < threads; i++)
+    {
+        msbfs->touched[i].length = 0;
+        msbfs->touched[i].failed = 0;
+    }
+    if (msbfs->active.length < BFS_PARALLEL_FRONTIER || threads == 1)
+    {
+        msbfs_expand(msbfs, &msbfs->touched[0], 0, msbfs->active.length, 0);
+    }
+    else
+    {
+        msbfs->next_chunk = 0;
+        traversal_pool_run(msbfs->pool, msbfs_expand_job, msbfs);
+        msbfs->parallel_levels++;
+    }
+
+    // The old frontier is done with, the touched vertices make the new one
+    for (uint64_t i = 0; i < msbfs->active.length; i++)
+    {
+        msbfs->frontier[msbfs->active.vertices[i]] = 0;
+    }
+    msbfs->active.length = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        if (msbfs->touched[i].failed)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        for (uint64_t j = 0; j < msbfs->touched[i].length; j++)
+        {
+            if (bfs_buffer_push(&msbfs->active, msbfs->touched[i].vertices[j]) == -1)
+            {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+    }
+    qsort(msbfs->active.vertices, msbfs->active.length, sizeof(uint32_t), msbfs_compare);
+
+    for (uint64_t i = 0; i < msbfs->active.length; i++)
+    {
+        uint32_t vertex = msbfs->active.vertices[i];
+        uint64_t bits = msbfs->next[vertex];
+        msbfs->next[vertex] = 0;
+        msbfs->seen[vertex] |= bits;
+        msbfs->frontier[vertex] = bits;
+        while (bits != 0)
+        {
+            int source = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (bfs_buffer_push(&msbfs->orders[source], vertex) == -1)
+            {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+    }
+    msbfs->levels++;
+    return (long)msbfs->active.length;
+}
+
+#endif
@@ -0,0 +1,506 @@
+/**
+ * @file graph_store.h
+ * @brief On-disk storage format for the graphs of the database
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * Graphs are stored in a versioned binary compressed-sparse-row (CSR) file:
+ *
+ *   struct graph_file_header             (64 bytes)
+ *   uint64_t offsets[number_of_nodes + 1]
+ *   uint32_t neighbors[number_of_edges]
+ *   zero padding up to a multiple of 8 bytes
+ *   uint64_t checksum                     (FNV-1a over everything before it)
+ *
+ * The neighbors of vertex v are neighbors[offsets[v]] ... neighbors[offsets[v + 1] - 1],
+ * in increasing order, so loading a graph costs O(V + E) instead of O(V^2) text tokens.
+ * Vertices are 0-indexed on disk; the client and the replies keep using 1-indexed vertices.
+ *
+ * All arrays are 8 byte aligned in the file, so the secondary servers mmap the file read-only
+ * and traverse the mapped pages directly. Files are always replaced with a rename, never
+ * rewritten in place, so a mapping keeps seeing the version it was created from.
+ *
+ * Everything in here is header-only so that each program can still be built on its own
+ * with 'make <program>'.
+ */
+
+#ifndef GRAPH_STORE_H
+#define GRAPH_STORE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define GRAPH_FILE_MAGIC "GRAPHCSR"
+#define GRAPH_FORMAT_VERSION 1
+#define GRAPH_FILE_EXTENSION ".csr"
+#define GRAPH_PATH_LENGTH 256
+
+/**
+ * @brief Fixed size header at the start of every graph file.
+ * Generation is incremented by the primary server every time the graph is rewritten.
+ */
+struct graph_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t number_of_nodes;
+    uint64_t number_of_edges;
+    uint64_t generation;
+    uint64_t reserved[3];
+};
+
+/**
+ * @brief In-memory view of a CSR graph.
+ * If mapping is set, offsets and neighbors point into a read-only mmap of the graph file,
+ * otherwise they are heap allocated.
+ */
+struct graph
+{
+    uint32_t number_of_nodes;
+    uint64_t number_of_edges;
+    uint64_t generation;
+    uint64_t *offsets;
+    uint32_t *neighbors;
+    void *mapping;
+    size_t mapping_size;
+};
+
+/**
+ * @brief Number of zero bytes written after the neighbor array so that the checksum is 8 byte aligned
+ */
+static inline size_t graph_padding(uint64_t number_of_edges)
+{
+    return (size_t)((8 - (number_of_edges * sizeof(uint32_t)) % 8) % 8);
+}
+
+/**
+ * @brief Total size in bytes of a graph file with the given dimensions
+ */
+static inline size_t graph_file_size(uint64_t number_of_nodes, uint64_t number_of_edges)
+{
+    return sizeof(struct graph_file_header) + (number_of_nodes + 1) * sizeof(uint64_t) + number_of_edges * sizeof(uint32_t) + graph_padding(number_of_edges) + sizeof(uint64_t);
+}
+
+/**
+ * @brief 64 bit FNV-1a hash, continued from 'hash' so that it can be computed over several buffers
+ */
+static inline uint64_t graph_checksum(uint64_t hash, const void *buffer, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *)buffer;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#define GRAPH_CHECKSUM_SEED 14695981039346656037ULL
+
+/**
+ * @brief Maps a graph name used by the clients (e.g. G1.txt) to the file the graph is stored in (G1.csr)
+ */
+static inline void graph_storage_path(const char *graph_name, char *path, size_t size)
+{
+    size_t length = strlen(graph_name);
+    if (length > 4 && strcmp(graph_name + length - 4, ".txt") == 0)
+    {
+        length -= 4;
+    }
+    snprintf(path, size, "%.*s%s", (int)length, graph_name, GRAPH_FILE_EXTENSION);
+}
+
+/**
+ * @brief Releases a graph, unmapping it if it was mapped with graph_map
+ */
+static inline void graph_free(struct graph *graph)
+{
+    if (graph->mapping != NULL)
+    {
+        munmap(graph->mapping, graph->mapping_size);
+    }
+    else
+    {
+        free(graph->offsets);
+        free(graph->neighbors);
+    }
+    graph->mapping = NULL;
+    graph->offsets = NULL;
+    graph->neighbors = NULL;
+}
+
+/**
+ * @brief Builds a CSR graph from a row-major number_of_nodes x number_of_nodes adjacency matrix.
+ * An entry equal to 1 is an edge, every other value is treated as no edge.
+ *
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+static inline int graph_from_matrix(int number_of_nodes, const int *adjacency_matrix, struct graph *graph)
+{
+    uint64_t number_of_edges = 0;
+    for (long i = 0; i < (long)number_of_nodes * number_of_nodes; i++)
+    {
+        if (adjacency_matrix[i] == 1)
+        {
+            number_of_edges++;
+        }
+    }
+
+    graph->number_of_nodes = number_of_nodes;
+    graph->number_of_edges = number_of_edges;
+    graph->generation = 0;
+    graph->mapping = NULL;
+    graph->offsets = (uint64_t *)malloc((number_of_nodes + 1) * sizeof(uint64_t));
+    graph->neighbors = (uint32_t *)malloc((number_of_edges > 0 ? number_of_edges : 1) * sizeof(uint32_t));
+    if (graph->offsets == NULL || graph->neighbors == NULL)
+    {
+        graph_free(graph);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint64_t edge = 0;
+    for (int i = 0; i < number_of_nodes; i++)
+    {
+        graph->offsets[i] = edge;
+        for (int j = 0; j < number_of_nodes; j++)
+        {
+            if (adjacency_matrix[(long)i * number_of_nodes + j] == 1)
+            {
+                graph->neighbors[edge++] = j;
+            }
+        }
+    }
+    graph->offsets[number_of_nodes] = edge;
+    return 0;
+}
+
+/**
+ * @brief Writes the graph to exactly 'path' in the binary CSR format, replacing the file.
+ * If 'durable' is set the file is synced to disk before returning.
+ *
+ * @return 0 on success, -1 on failure with errno set (the file is removed)
+ */
+static inline int graph_write_file(const char *path, const struct graph *graph, int durable)
+{
+    struct graph_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GRAPH_FILE_MAGIC, sizeof(header.magic));
+    header.version = GRAPH_FORMAT_VERSION;
+    header.number_of_nodes = graph->number_of_nodes;
+    header.number_of_edges = graph->number_of_edges;
+    header.generation = graph->generation;
+
+    size_t offsets_size = ((size_t)graph->number_of_nodes + 1) * sizeof(uint64_t);
+    size_t neighbors_size = graph->number_of_edges * sizeof(uint32_t);
+    uint64_t padding = 0;
+
+    uint64_t checksum = GRAPH_CHECKSUM_SEED;
+    checksum = graph_checksum(checksum, &header, sizeof(header));
+    checksum = graph_checksum(checksum, graph->offsets, offsets_size);
+    checksum = graph_checksum(checksum, graph->neighbors, neighbors_size);
+    checksum = graph_checksum(checksum, &padding, graph_padding(graph->number_of_edges));
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(graph->offsets, 1, offsets_size, fp) != offsets_size ||
+        fwrite(graph->neighbors, 1, neighbors_size, fp) != neighbors_size ||
+        fwrite(&padding, 1, graph_padding(graph->number_of_edges), fp) != graph_padding(graph->number_of_edges) ||
+        fwrite(&checksum, sizeof(checksum), 1, fp) != 1 ||
+        (durable && (fflush(fp) == EOF || fsync(fileno(fp)) == -1)))
+    {
+        int saved_errno = errno;
+        fclose(fp);
+        unlink(path);
+        errno = saved_errno;
+        return -1;
+    }
+    if (fclose(fp) == -1)
+    {
+        int saved_errno = errno;
+        unlink(path);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the graph to 'path' in the binary CSR format.
+ * The graph is written to 'path.tmp' and renamed over 'path', so readers that have the old
+ * file mapped are never affected and a failed write never leaves a half written graph behind.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int graph_write(const char *path, const struct graph *graph)
+{
+    char temporary_path[GRAPH_PATH_LENGTH + 4];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+
+    if (graph_write_file(temporary_path, graph, 0) == -1)
+    {
+        return -1;
+    }
+    if (rename(temporary_path, path) == -1)
+    {
+        int saved_errno = errno;
+        unlink(temporary_path);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads only the header of a graph file, used to look at the current generation
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int graph_read_header(const char *path, struct graph_file_header *header)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    size_t read = fread(header, sizeof(*header), 1, fp);
+    fclose(fp);
+    if (read != 1 || memcmp(header->magic, GRAPH_FILE_MAGIC, sizeof(header->magic)) != 0 || header->version != GRAPH_FORMAT_VERSION)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads a graph file into memory and verifies its structure and checksum
+ *
+ * @return 0 on success, -1 on failure with errno set (EINVAL for a corrupt file)
+ */
+static inline int graph_read(const char *path, struct graph *graph)
+{
+    struct graph_file_header header;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, GRAPH_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != GRAPH_FORMAT_VERSION || header.number_of_nodes > UINT32_MAX)
+    {
+        fclose(fp);
+        errno = EINVAL;
+        return -1;
+    }
+
+    graph->number_of_nodes = (uint32_t)header.number_of_nodes;
+    graph->number_of_edges = header.number_of_edges;
+    graph->generation = header.generation;
+    graph->mapping = NULL;
+    size_t offsets_size = ((size_t)graph->number_of_nodes + 1) * sizeof(uint64_t);
+    size_t neighbors_size = graph->number_of_edges * sizeof(uint32_t);
+    graph->offsets = (uint64_t *)malloc(offsets_size);
+    graph->neighbors = (uint32_t *)malloc(neighbors_size > 0 ? neighbors_size : 1);
+    if (graph->offsets == NULL || graph->neighbors == NULL)
+    {
+        fclose(fp);
+        graph_free(graph);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint64_t padding = 0;
+    uint64_t stored_checksum = 0;
+    int ok = fread(graph->offsets, 1, offsets_size, fp) == offsets_size &&
+             fread(graph->neighbors, 1, neighbors_size, fp) == neighbors_size &&
+             fread(&padding, 1, graph_padding(graph->number_of_edges), fp) == graph_padding(graph->number_of_edges) &&
+             fread(&stored_checksum, sizeof(stored_checksum), 1, fp) == 1;
+    fclose(fp);
+
+    if (ok)
+    {
+        uint64_t checksum = GRAPH_CHECKSUM_SEED;
+        checksum = graph_checksum(checksum, &header, sizeof(header));
+        checksum = graph_checksum(checksum, graph->offsets, offsets_size);
+        checksum = graph_checksum(checksum, graph->neighbors, neighbors_size);
+        checksum = graph_checksum(checksum, &padding, graph_padding(graph->number_of_edges));
+        ok = checksum == stored_checksum && graph->offsets[graph->number_of_nodes] == graph->number_of_edges;
+    }
+    if (!ok)
+    {
+        graph_free(graph);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Maps a graph file read-only and points the graph at the mapped arrays, nothing is
+ * copied or parsed. Only the header and the file size are validated here, so that mapping
+ * stays O(1): call graph_verify before traversing a graph mapped from a file that may be
+ * truncated or corrupt. Release the graph with graph_free.
+ *
+ * @return 0 on success, -1 on failure with errno set (EINVAL for a corrupt file)
+ */
+static inline int graph_map(const char *path, struct graph *graph)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    if ((size_t)file_stat.st_size < sizeof(struct graph_file_header))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    const struct graph_file_header *header = (const struct graph_file_header *)mapping;
+    if (memcmp(header->magic, GRAPH_FILE_MAGIC, sizeof(header->magic)) != 0 || header->version != GRAPH_FORMAT_VERSION ||
+        header->number_of_nodes > UINT32_MAX || graph_file_size(header->number_of_nodes, header->number_of_edges) != (size_t)file_stat.st_size)
+    {
+        munmap(mapping, file_stat.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    graph->number_of_nodes = (uint32_t)header->number_of_nodes;
+    graph->number_of_edges = header->number_of_edges;
+    graph->generation = header->generation;
+    graph->offsets = (uint64_t *)((char *)mapping + sizeof(struct graph_file_header));
+    graph->neighbors = (uint32_t *)(graph->offsets + graph->number_of_nodes + 1);
+    graph->mapping = mapping;
+    graph->mapping_size = file_stat.st_size;
+
+    if (graph->offsets[graph->number_of_nodes] != graph->number_of_edges)
+    {
+        graph_free(graph);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Verifies a mapped graph before it is traversed: the checksum at the end of the file,
+ * and that the offsets never decrease and every neighbor is a vertex of the graph. A graph
+ * that passes can be traversed without reading out of bounds. O(size of the file).
+ *
+ * @return 0 if the graph is sound, -1 with errno set to EINVAL otherwise
+ */
+static inline int graph_verify(const struct graph *graph)
+{
+    if (graph->mapping != NULL)
+    {
+        size_t checked = graph->mapping_size - sizeof(uint64_t);
+        uint64_t stored_checksum;
+        memcpy(&stored_checksum, (const char *)graph->mapping + checked, sizeof(stored_checksum));
+        if (graph_checksum(GRAPH_CHECKSUM_SEED, graph->mapping, checked) != stored_checksum)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (graph->offsets[0] != 0 || graph->offsets[graph->number_of_nodes] != graph->number_of_edges)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    for (uint32_t i = 0; i < graph->number_of_nodes; i++)
+    {
+        if (graph->offsets[i] > graph->offsets[i + 1])
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    for (uint64_t i = 0; i < graph->number_of_edges; i++)
+    {
+        if (graph->neighbors[i] >= graph->number_of_nodes)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a graph stored in the old text format (number of nodes followed by the
+ * adjacency matrix) into a CSR graph. Only used to convert old Gn.txt files.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int graph_read_text(const char *path, struct graph *graph)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    int number_of_nodes;
+    if (fscanf(fp, "%d", &number_of_nodes) != 1 || number_of_nodes < 0)
+    {
+        fclose(fp);
+        errno = EINVAL;
+        return -1;
+    }
+
+    int *adjacency_matrix = (int *)malloc(((size_t)number_of_nodes * number_of_nodes + 1) * sizeof(int));
+    if (adjacency_matrix == NULL)
+    {
+        fclose(fp);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (long i = 0; i < (long)number_of_nodes * number_of_nodes; i++)
+    {
+        if (fscanf(fp, "%d", &adjacency_matrix[i]) != 1)
+        {
+            free(adjacency_matrix);
+            fclose(fp);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    int result = graph_from_matrix(number_of_nodes, adjacency_matrix, graph);
+    free(adjacency_matrix);
+    return result;
+}
+
+#endif
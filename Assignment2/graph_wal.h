@@ -0,0 +1,408 @@
+/**
+ * @file graph_wal.h
+ * @brief Write-ahead log of the primary server
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * Every write of the primary server is appended to the log (graphs.wal) before it is applied
+ * to the graph files, and the client only gets its reply once the log record is on disk.
+ * Concurrent writers share fsyncs (group commit): the first writer that needs its record to be
+ * durable syncs everything appended so far, and the writers that append while it is syncing
+ * wait for the next sync, which covers all of them with a single fdatasync.
+ *
+ * Every record is a struct wal_record followed by 'length' bytes of payload, padded to 8 bytes:
+ *
+ *   WAL_GRAPH  a new graph (operation 1), 'generation' is the generation of the new CSR file.
+ *              uint64 number_of_nodes, uint64 number_of_edges, offsets[n + 1], neighbors[E]
+ *   WAL_DELTA  changes to a graph (operation 2), 'generation' is the generation of the CSR file
+ *              they apply to. struct graph_delta_record[]
+ *
+ * After a crash the records are replayed in order. A record that is not newer than the graph
+ * files is skipped, so replaying is idempotent, and a torn record at the end of the log is
+ * discarded. The log is emptied (checkpointed) once it grows past a size limit, after the graph
+ * and delta files written since the last checkpoint and their directory have been synced, so
+ * that none of its records are needed anymore. Only those files are synced, not the whole page
+ * cache of the machine.
+ */
+
+#ifndef GRAPH_WAL_H
+#define GRAPH_WAL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "graph_store.h"
+
+#define WAL_PATH "graphs.wal"
+#define WAL_RECORD_MAGIC 0x4c415747 // "GWAL"
+#define WAL_GRAPH 1
+#define WAL_DELTA 2
+#define WAL_NAME_LENGTH 100
+#define WAL_MAX_PARTS 8
+
+struct wal_record
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t length;
+    uint64_t checksum; // graph_checksum of the record with checksum set to 0, and the payload
+    uint64_t generation;
+    char graph_name[WAL_NAME_LENGTH];
+};
+
+struct wal
+{
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+    // Held shared by writers from appending a record until it has been applied to the graph
+    // files, and exclusively by a checkpoint
+    pthread_rwlock_t checkpoint;
+    // Log sequence numbers count the bytes appended since the log was opened
+    uint64_t written_lsn;
+    uint64_t durable_lsn;
+    uint64_t size;
+    int syncing;
+    useconds_t commit_delay;
+    uint64_t records;
+    uint64_t syncs;
+    uint64_t checkpoints;
+    // Graph and delta files written since the last checkpoint, the next checkpoint syncs them
+    char (*written_files)[GRAPH_PATH_LENGTH];
+    int number_of_written_files;
+    int written_files_capacity;
+};
+
+static inline size_t wal_padding(uint64_t length)
+{
+    return (size_t)((8 - length % 8) % 8);
+}
+
+/**
+ * @brief Opens (or creates) the log. commit_delay is how long the writer that syncs the log
+ * waits for more records to join its group commit, 0 to sync immediately.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int wal_open(struct wal *wal, const char *path, useconds_t commit_delay)
+{
+    memset(wal, 0, sizeof(*wal));
+    wal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (wal->fd == -1)
+    {
+        return -1;
+    }
+    struct stat status;
+    if (fstat(wal->fd, &status) == -1)
+    {
+        close(wal->fd);
+        return -1;
+    }
+    wal->size = status.st_size;
+    wal->commit_delay = commit_delay;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+    pthread_rwlock_init(&wal->checkpoint, NULL);
+    return 0;
+}
+
+/**
+ * @brief Calls 'apply' for every complete record in the log, in order, and cuts off a torn
+ * record at the end. The payload passed to 'apply' is 8 byte aligned.
+ *
+ * @return number of records replayed, or -1 on failure with errno set
+ */
+static inline long wal_replay(struct wal *wal, void (*apply)(const struct wal_record *, const void *, void *), void *arg)
+{
+    unsigned char *log = (unsigned char *)malloc(wal->size > 0 ? wal->size : 1);
+    if (log == NULL || pread(wal->fd, log, wal->size, 0) != (ssize_t)wal->size)
+    {
+        free(log);
+        return -1;
+    }
+
+    long count = 0;
+    uint64_t offset = 0;
+    while (offset + sizeof(struct wal_record) <= wal->size)
+    {
+        struct wal_record record;
+        memcpy(&record, log + offset, sizeof(record));
+        uint64_t end = offset + sizeof(record) + record.length + wal_padding(record.length);
+        if (record.magic != WAL_RECORD_MAGIC || record.length > wal->size || end > wal->size)
+        {
+            break;
+        }
+        uint64_t checksum = record.checksum;
+        record.checksum = 0;
+        uint64_t expected = graph_checksum(GRAPH_CHECKSUM_SEED, &record, sizeof(record));
+        expected = graph_checksum(expected, log + offset + sizeof(record), record.length);
+        if (checksum != expected)
+        {
+            break;
+        }
+        record.checksum = checksum;
+        apply(&record, log + offset + sizeof(record), arg);
+        count++;
+        offset = end;
+    }
+    free(log);
+
+    if (offset != wal->size)
+    {
+        if (ftruncate(wal->fd, offset) == -1)
+        {
+            return -1;
+        }
+        wal->size = offset;
+    }
+    return count;
+}
+
+/**
+ * @brief Called by a writer before it appends a record, it must call wal_end once the record
+ * has been applied to the graph files
+ */
+static inline void wal_begin(struct wal *wal)
+{
+    pthread_rwlock_rdlock(&wal->checkpoint);
+}
+
+static inline void wal_end(struct wal *wal)
+{
+    pthread_rwlock_unlock(&wal->checkpoint);
+}
+
+/**
+ * @brief Appends a record with the payload gathered from 'parts', with a single write.
+ * The record is not durable until wal_sync has been called with the returned sequence number.
+ *
+ * @return the log sequence number of the end of the record, 0 on failure with errno set
+ */
+static inline uint64_t wal_append(struct wal *wal, uint32_t type, const char *graph_name, uint64_t generation, const struct iovec *parts, int count)
+{
+    struct wal_record record;
+    memset(&record, 0, sizeof(record));
+    record.magic = WAL_RECORD_MAGIC;
+    record.type = type;
+    record.generation = generation;
+    snprintf(record.graph_name, sizeof(record.graph_name), "%s", graph_name);
+
+    struct iovec vector[WAL_MAX_PARTS + 2];
+    uint64_t padding = 0;
+    vector[0].iov_base = &record;
+    vector[0].iov_len = sizeof(record);
+    for (int i = 0; i < count; i++)
+    {
+        vector[i + 1] = parts[i];
+        record.length += parts[i].iov_len;
+    }
+    vector[count + 1].iov_base = &padding;
+    vector[count + 1].iov_len = wal_padding(record.length);
+
+    record.checksum = graph_checksum(GRAPH_CHECKSUM_SEED, &record, sizeof(record));
+    for (int i = 0; i < count; i++)
+    {
+        record.checksum = graph_checksum(record.checksum, parts[i].iov_base, parts[i].iov_len);
+    }
+
+    size_t bytes = sizeof(record) + record.length + vector[count + 1].iov_len;
+    pthread_mutex_lock(&wal->lock);
+    ssize_t written = writev(wal->fd, vector, count + 2);
+    if (written != (ssize_t)bytes)
+    {
+        int saved_errno = written == -1 ? errno : EIO;
+        // Do not leave a torn record in front of the next one
+        if (written > 0 && ftruncate(wal->fd, wal->size) == -1)
+        {
+            saved_errno = errno;
+        }
+        pthread_mutex_unlock(&wal->lock);
+        errno = saved_errno;
+        return 0;
+    }
+    wal->written_lsn += bytes;
+    wal->size += bytes;
+    wal->records++;
+    uint64_t lsn = wal->written_lsn;
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+/**
+ * @brief Waits until the log is durable up to 'lsn', syncing it if no other writer is
+ *
+ * @return 0 on success, -1 if the log could not be synced
+ */
+static inline int wal_sync(struct wal *wal, uint64_t lsn)
+{
+    int result = 0;
+    pthread_mutex_lock(&wal->lock);
+    while (wal->durable_lsn < lsn)
+    {
+        if (wal->syncing)
+        {
+            pthread_cond_wait(&wal->synced, &wal->lock);
+            continue;
+        }
+
+        // This writer leads the next group commit, everything written so far is synced with it
+        wal->syncing = 1;
+        pthread_mutex_unlock(&wal->lock);
+        if (wal->commit_delay > 0)
+        {
+            usleep(wal->commit_delay);
+        }
+        pthread_mutex_lock(&wal->lock);
+        uint64_t target = wal->written_lsn;
+        pthread_mutex_unlock(&wal->lock);
+
+        int synced = fdatasync(wal->fd);
+
+        pthread_mutex_lock(&wal->lock);
+        wal->syncing = 0;
+        if (synced == 0)
+        {
+            wal->syncs++;
+            if (wal->durable_lsn < target)
+            {
+                wal->durable_lsn = target;
+            }
+        }
+        else
+        {
+            result = -1;
+        }
+        pthread_cond_broadcast(&wal->synced);
+        if (result == -1)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return result;
+}
+
+/**
+ * @brief Records that a graph or delta file has been written or replaced, so that the next
+ * checkpoint syncs it before the records it holds are dropped from the log. Called between
+ * wal_begin and wal_end, or while replaying the log.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int wal_file_written(struct wal *wal, const char *path)
+{
+    int result = 0;
+    pthread_mutex_lock(&wal->lock);
+    int found = 0;
+    for (int i = 0; i < wal->number_of_written_files && !found; i++)
+    {
+        found = strcmp(wal->written_files[i], path) == 0;
+    }
+    if (!found && wal->number_of_written_files == wal->written_files_capacity)
+    {
+        int capacity = wal->written_files_capacity > 0 ? 2 * wal->written_files_capacity : 16;
+        char(*files)[GRAPH_PATH_LENGTH] = realloc(wal->written_files, capacity * sizeof(*files));
+        if (files == NULL)
+        {
+            result = -1;
+        }
+        else
+        {
+            wal->written_files = files;
+            wal->written_files_capacity = capacity;
+        }
+    }
+    if (!found && result == 0)
+    {
+        snprintf(wal->written_files[wal->number_of_written_files++], GRAPH_PATH_LENGTH, "%s", path);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return result;
+}
+
+/**
+ * @brief Syncs a file or directory to disk, a file that has been removed since is skipped
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int wal_sync_path(const char *path, int flags)
+{
+    int fd = open(path, flags);
+    if (fd == -1)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+    int result = fsync(fd);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return result;
+}
+
+/**
+ * @brief Empties the log once every record in it has been applied and the files written since
+ * the last checkpoint have been synced to disk. Waits for writers between wal_begin and wal_end.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int wal_checkpoint(struct wal *wal)
+{
+    pthread_rwlock_wrlock(&wal->checkpoint);
+    // No writer is between wal_begin and wal_end, so the list of files does not change meanwhile
+    int result = 0;
+    for (int i = 0; i < wal->number_of_written_files && result == 0; i++)
+    {
+        result = wal_sync_path(wal->written_files[i], O_RDONLY);
+    }
+    // The renames that installed the files are only durable once their directory is synced
+    if (result == 0)
+    {
+        result = wal_sync_path(".", O_RDONLY | O_DIRECTORY);
+    }
+    pthread_mutex_lock(&wal->lock);
+    if (result == 0)
+    {
+        result = ftruncate(wal->fd, 0);
+    }
+    if (result == 0)
+    {
+        wal->size = 0;
+        wal->number_of_written_files = 0;
+        // The graph files now hold every record, so all of them are durable
+        wal->durable_lsn = wal->written_lsn;
+        wal->checkpoints++;
+        pthread_cond_broadcast(&wal->synced);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    pthread_rwlock_unlock(&wal->checkpoint);
+    return result;
+}
+
+static inline uint64_t wal_size(struct wal *wal)
+{
+    pthread_mutex_lock(&wal->lock);
+    uint64_t size = wal->size;
+    pthread_mutex_unlock(&wal->lock);
+    return size;
+}
+
+static inline void wal_close(struct wal *wal)
+{
+    close(wal->fd);
+    free(wal->written_files);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->synced);
+    pthread_rwlock_destroy(&wal->checkpoint);
+}
+
+#endif
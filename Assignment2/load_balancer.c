@@ -10,6 +10,8 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -20,21 +22,47 @@
 #include <sys/shm.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+
+#include "graph_catalog.h"
+#include "message_queue.h"
+#include "result_ring.h"
+#include "server_load.h"
+#include "shm_arena.h"
 
 #define MESSAGE_LENGTH 100
 #define LOAD_BALANCER_CHANNEL 4000
 #define PRIMARY_SERVER_CHANNEL 4001
+// Channel of the secondary server in the first slot of the load table, the others follow
 #define SECONDARY_SERVER_CHANNEL_1 4002
-#define SECONDARY_SERVER_CHANNEL_2 4003
 #define MAX_THREADS 200
+// Replies to registrations go to REGISTRATION_REPLY_BASE + pid of the secondary server, clients
+// only use sequence numbers below it and the channels are far below it
+#define REGISTRATION_REPLY_BASE 1000000000L
+// Scheduling classes of reads, interactive reads go ahead of batch reads
+#define PRIORITY_AUTO 0
+#define PRIORITY_INTERACTIVE 1
+#define PRIORITY_BATCH 2
+// Status in the operation of a reply to a request the load balancer turned away
+#define BUSY -2
 
 struct data
 {
     long seq_num;
     long operation;
     char graph_name[MESSAGE_LENGTH];
+    // Arena handle of the parameters of the request, -1 if it has none
+    int request_handle;
+    // Arena handle and number of vertices of the result of a traversal, -1 and 0 otherwise
+    int result_handle;
+    int result_length;
+    // pid of the client, its replies go to its own queue when MESSAGE_QUEUE=posix
+    int client_id;
+    // Scheduling class of a read, PRIORITY_AUTO lets the load balancer choose it from the size of the graph
+    int priority;
 };
 
 struct msg_buffer
@@ -43,74 +71,654 @@ struct msg_buffer
     struct data data;
 };
 
+// Shared memory catalog of graph versions, created by the load balancer
+int catalog_id;
+struct catalog *catalog;
+
+// Shared memory arena for request parameters and traversal results, created by the load balancer
+int arena_id;
+struct arena *arena;
+
+// Transport to the servers, with MESSAGE_QUEUE=posix the load balancer creates the queues of
+// every server and receives on its own
+struct message_queue queue;
+const long channels[] = {LOAD_BALANCER_CHANNEL, PRIMARY_SERVER_CHANNEL};
+
+// Load of the secondary servers. Reads of a graph go to the same server by consistent hashing of
+// its name, until that server has READ_LOAD_BOUND times the average load. Set READ_ROUTING to
+// least-work to send each read to the server with the least work left, or to parity to take
+// turns by sequence number
+#define ROUTING_AFFINITY 0
+#define ROUTING_LEAST_WORK 1
+#define ROUTING_PARITY 2
+#define DEFAULT_READ_LOAD_BOUND 1.25
+int read_routing = ROUTING_AFFINITY;
+double read_load_bound = DEFAULT_READ_LOAD_BOUND;
+int loads_id;
+struct load_table *loads;
+struct load_ring ring;
+unsigned int routing_seed;
+// Reads that went past the first server of their graph on the ring
+unsigned long spilled_reads = 0;
+
+// Slots of the secondary servers that are registered, reads are only routed to these
+int live_servers[SERVER_LOAD_SLOTS];
+int number_of_live_servers = 0;
+// Slots whose POSIX queue has been created, the queue is kept for the next server of the slot
+int created_channels[SERVER_LOAD_SLOTS];
+
+// Reads that arrived while no secondary server was registered, sent once one registers
+struct parked_read
+{
+    struct parked_read *next;
+    struct msg_buffer msg;
+};
+struct parked_read *parked_head = NULL;
+struct parked_read *parked_tail = NULL;
+int number_of_parked_reads = 0;
+
+// Admission control. A request is answered as busy instead of being sent once its server has
+// MAX_SERVER_IN_FLIGHT requests it has not replied to, or its client has MAX_CLIENT_IN_FLIGHT.
+// Servers then never have more than a bounded backlog in the message queue.
+#define DEFAULT_MAX_SERVER_IN_FLIGHT 64
+#define DEFAULT_MAX_CLIENT_IN_FLIGHT 8
+uint64_t max_server_in_flight = DEFAULT_MAX_SERVER_IN_FLIGHT;
+uint64_t max_client_in_flight = DEFAULT_MAX_CLIENT_IN_FLIGHT;
+unsigned long busy_replies = 0;
+
+// Reads on graphs with more than INTERACTIVE_GRAPH_SIZE vertices plus edges are batch reads
+// unless their client chose. Batch reads are only admitted while their server has fewer than
+// three quarters of MAX_SERVER_IN_FLIGHT, the rest is kept for interactive reads.
+#define DEFAULT_INTERACTIVE_GRAPH_SIZE 100000
+uint64_t interactive_graph_size = DEFAULT_INTERACTIVE_GRAPH_SIZE;
+unsigned long batch_reads = 0;
+
+// Shutdown. On cleanup the load balancer stops admitting requests and waits until the servers
+// have replied to every request they were sent. It then sends the termination messages and waits
+// until every server has acknowledged its own (operation 8), all within SHUTDOWN_DEADLINE seconds.
+#define DEFAULT_SHUTDOWN_DEADLINE 10
+int shutdown_deadline = DEFAULT_SHUTDOWN_DEADLINE;
+// Servers that were sent a termination message and have not acknowledged it yet
+int primary_terminating = 0;
+int terminating_servers[SERVER_LOAD_SLOTS];
+
+/**
+ * @brief Answers a request as busy without sending it to a server. The status of the reply is
+ * in its operation, like the replies of the primary server.
+ *
+ * @param msg
+ * @param reason printed by the load balancer
+ */
+void reply_busy(struct msg_buffer *msg, const char *reason)
+{
+    // A streamed BFS reads its ring until the ring is finished, so finish it for the client
+    int *parameters;
+    if (msg->data.operation == 4 && msg->data.request_handle != -1 &&
+        (parameters = (int *)arena_resolve(arena, msg->data.request_handle)) != NULL)
+    {
+        struct result_ring *ring;
+        if (parameters[1] != -1 && (ring = (struct result_ring *)shmat(parameters[1], NULL, 0)) != (void *)-1)
+        {
+            result_ring_finish(ring);
+            shmdt(ring);
+        }
+        arena_unresolve(msg->data.request_handle, parameters);
+    }
+
+    printf("[Load Balancer] Request %ld is answered as busy, %s\n", msg->data.seq_num, reason);
+    msg->msg_type = msg->data.seq_num;
+    msg->data.operation = BUSY;
+    msg->data.result_handle = -1;
+    msg->data.result_length = 0;
+    snprintf(msg->data.graph_name, sizeof(msg->data.graph_name), "Busy, try again later");
+    if (message_queue_reply(&queue, msg->data.client_id, msg, sizeof(msg->data)) == -1)
+    {
+        perror("[Load Balancer] Error while answering a request as busy");
+    }
+    busy_replies++;
+}
+
+/**
+ * @brief Sends an admitted read to a secondary server
+ *
+ * @param msg
+ * @param server slot of the server
+ */
+void send_read(struct msg_buffer *msg, int server)
+{
+    msg->msg_type = SECONDARY_SERVER_CHANNEL_1 + server;
+    __atomic_add_fetch(&loads->servers[server].sent, 1, __ATOMIC_RELAXED);
+    if (message_queue_send(&queue, msg, sizeof(msg->data)) == -1)
+    {
+        __atomic_sub_fetch(&loads->servers[server].sent, 1, __ATOMIC_RELAXED);
+        load_client_done(loads, NULL, msg->data.client_id);
+        fprintf(stderr, "[Load Balancer] Error while sending message to Secondary Server %d: %s\n", server + 1, strerror(errno));
+    }
+    else
+    {
+        printf("[Load Balancer] Received a message from Client and Sent it to Secondary Server %d\n", server + 1);
+    }
+}
+
+/**
+ * @brief Picks the secondary server of a read with the routing of the load balancer
+ *
+ * @param msg
+ * @return the slot of the server
+ */
+int pick_secondary_server(struct msg_buffer *msg)
+{
+    if (read_routing == ROUTING_PARITY)
+    {
+        // Sequence number 1 goes to the first server, 2 to the second and so on
+        return live_servers[(msg->data.seq_num - 1) % number_of_live_servers];
+    }
+    if (read_routing == ROUTING_LEAST_WORK)
+    {
+        return load_pick(loads, live_servers, number_of_live_servers, &routing_seed);
+    }
+    int spilled;
+    int server = load_ring_pick(loads, &ring, msg->data.graph_name, read_load_bound, &spilled);
+    spilled_reads += spilled;
+    return server;
+}
+
+/**
+ * @brief Sends a read to one of the live secondary servers, or keeps it until one registers.
+ * The read is answered as busy if its server, or the load balancer, already holds as many
+ * reads as its class may have in flight.
+ *
+ * @param msg
+ */
+void route_read(struct msg_buffer *msg)
+{
+    if (msg->data.priority != PRIORITY_INTERACTIVE && msg->data.priority != PRIORITY_BATCH)
+    {
+        // Graphs no server has loaded yet count as small
+        msg->data.priority = catalog_size(catalog, msg->data.graph_name) > interactive_graph_size ? PRIORITY_BATCH : PRIORITY_INTERACTIVE;
+    }
+    uint64_t limit = max_server_in_flight;
+    if (msg->data.priority == PRIORITY_BATCH)
+    {
+        limit = max_server_in_flight * 3 / 4 > 0 ? max_server_in_flight * 3 / 4 : 1;
+        batch_reads++;
+    }
+
+    if (number_of_live_servers == 0)
+    {
+        if ((uint64_t)number_of_parked_reads >= limit)
+        {
+            reply_busy(msg, "no Secondary Server is registered");
+            return;
+        }
+        struct parked_read *parked = (struct parked_read *)malloc(sizeof(struct parked_read));
+        if (parked == NULL)
+        {
+            perror("[Load Balancer] Error while parking a read");
+            return;
+        }
+        parked->next = NULL;
+        parked->msg = *msg;
+        if (parked_tail != NULL)
+        {
+            parked_tail->next = parked;
+        }
+        else
+        {
+            parked_head = parked;
+        }
+        parked_tail = parked;
+        number_of_parked_reads++;
+        load_client_sent(loads, msg->data.client_id);
+        printf("[Load Balancer] No Secondary Server is registered, the read waits for one\n");
+        return;
+    }
+
+    int server = pick_secondary_server(msg);
+    if (load_outstanding(&loads->servers[server]) >= limit)
+    {
+        reply_busy(msg, msg->data.priority == PRIORITY_BATCH ? "its Secondary Server has no room for batch reads" : "its Secondary Server is full");
+        return;
+    }
+    load_client_sent(loads, msg->data.client_id);
+    send_read(msg, server);
+}
+
+/**
+ * @brief Whether the server of a slot of the load table has exited, or the slot was never taken
+ *
+ * @param load
+ * @return int
+ */
+int server_exited(const struct server_load *load)
+{
+    int pid = __atomic_load_n(&load->pid, __ATOMIC_ACQUIRE);
+    return pid == 0 || (kill(pid, 0) == -1 && errno == ESRCH);
+}
+
+/**
+ * @brief Gives the clients back the requests that servers which died had received and not
+ * replied to, so that those clients are not held at their limit for good
+ */
+void release_exited_servers(void)
+{
+    for (int i = -1; i < SERVER_LOAD_SLOTS; i++)
+    {
+        struct server_load *load = i == -1 ? &loads->primary : &loads->servers[i];
+        if (__atomic_load_n(&load->pid, __ATOMIC_ACQUIRE) != 0 && server_exited(load))
+        {
+            uint64_t released = load_client_release(loads, load);
+            if (released > 0)
+            {
+                printf("[Load Balancer] %lu requests were lost with an exited server\n", (unsigned long)released);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Whether a client already has as many requests in flight as it may have. Requests
+ * lost with a server that died are given back before the client is turned away.
+ *
+ * @param client pid of the client
+ * @return int
+ */
+int client_over_limit(int client)
+{
+    if (load_client_outstanding(loads, client) < max_client_in_flight)
+    {
+        return 0;
+    }
+    release_exited_servers();
+    return load_client_outstanding(loads, client) >= max_client_in_flight;
+}
+
+/**
+ * @brief Whether a client used a sequence number that its reply cannot be sent on: replies on it
+ * could be taken by a registering secondary server, or by nobody
+ */
+int seq_num_reserved(long seq_num)
+{
+    return seq_num < 1 || seq_num >= REGISTRATION_REPLY_BASE;
+}
+
+/**
+ * @brief Replies to the registration of a secondary server, on the message type only it waits for
+ *
+ * @param msg registration request, with the pid of the server in client_id
+ * @param channel assigned to the server, -1 if it is not registered
+ */
+void reply_registration(struct msg_buffer *msg, long channel)
+{
+    msg->msg_type = REGISTRATION_REPLY_BASE + msg->data.client_id;
+    msg->data.seq_num = channel;
+    if (message_queue_reply(&queue, msg->data.client_id, msg, sizeof(msg->data)) == -1)
+    {
+        perror("[Load Balancer] Error while replying to a Secondary Server");
+    }
+}
+
+/**
+ * @brief Gives a starting secondary server a free slot of the load table, and replies with the
+ * channel of the slot, or -1 if every slot is taken. The seq_num of the reply holds the channel.
+ *
+ * @param msg registration request, with the pid of the server in client_id
+ */
+void register_secondary_server(struct msg_buffer *msg)
+{
+    int pid = msg->data.client_id;
+    int server = -1;
+    for (int i = 0; i < SERVER_LOAD_SLOTS && server == -1; i++)
+    {
+        // The slot of a server that died without terminating is free again
+        if (server_exited(&loads->servers[i]))
+        {
+            server = i;
+        }
+    }
+    long channel = SECONDARY_SERVER_CHANNEL_1 + server;
+    if (server != -1 && queue.posix && !created_channels[server])
+    {
+        if (message_queue_create_channels(&channel, 1, sizeof(struct msg_buffer)) == -1)
+        {
+            perror("[Load Balancer] Error while creating the POSIX message queue of a Secondary Server");
+            server = -1;
+        }
+        else
+        {
+            created_channels[server] = 1;
+        }
+    }
+
+    if (server != -1)
+    {
+        // A slot freed by a server that died may still be in the list
+        int live = 0;
+        for (int i = 0; i < number_of_live_servers; i++)
+        {
+            live |= live_servers[i] == server;
+        }
+        if (!live)
+        {
+            live_servers[number_of_live_servers++] = server;
+            load_ring_build(&ring, live_servers, number_of_live_servers);
+        }
+        load_client_release(loads, &loads->servers[server]);
+        memset(&loads->servers[server], 0, sizeof(struct server_load));
+        terminating_servers[server] = 0;
+        __atomic_store_n(&loads->servers[server].pid, pid, __ATOMIC_RELEASE);
+        printf("[Load Balancer] Secondary Server %d registered on Channel %ld, %d Secondary Servers are live\n", server + 1, channel, number_of_live_servers);
+    }
+    else
+    {
+        fprintf(stderr, "[Load Balancer] No slot left for the Secondary Server with pid %d\n", pid);
+    }
+
+    reply_registration(msg, server != -1 ? channel : -1);
+
+    // The reads that waited for a server can go now
+    while (server != -1 && parked_head != NULL)
+    {
+        struct parked_read *parked = parked_head;
+        parked_head = parked->next;
+        number_of_parked_reads--;
+        send_read(&parked->msg, pick_secondary_server(&parked->msg));
+        free(parked);
+    }
+    if (parked_head == NULL)
+    {
+        parked_tail = NULL;
+    }
+}
+
+/**
+ * @brief Stops routing reads to a secondary server that is leaving, and tells it to terminate.
+ * The termination message is queued behind the reads it was sent, so it replies to those first.
+ *
+ * @param channel channel of the server
+ */
+void deregister_secondary_server(long channel)
+{
+    int server = (int)(channel - SECONDARY_SERVER_CHANNEL_1);
+    int live = -1;
+    for (int i = 0; i < number_of_live_servers; i++)
+    {
+        if (live_servers[i] == server)
+        {
+            live = i;
+        }
+    }
+    if (live == -1)
+    {
+        printf("[Load Balancer] Channel %ld has no registered Secondary Server\n", channel);
+        return;
+    }
+    if (terminating_servers[server])
+    {
+        // It was already sent its termination message on cleanup
+        return;
+    }
+    number_of_live_servers--;
+    memmove(&live_servers[live], &live_servers[live + 1], (number_of_live_servers - live) * sizeof(int));
+    load_ring_build(&ring, live_servers, number_of_live_servers);
+
+    struct msg_buffer terminationMessage;
+    memset(&terminationMessage, 0, sizeof(terminationMessage));
+    terminationMessage.msg_type = channel;
+    terminationMessage.data.operation = 5;
+    if (message_queue_send(&queue, &terminationMessage, sizeof(terminationMessage.data)) == -1)
+    {
+        perror("[Load Balancer] Error while sending cleanup message to a Secondary Server");
+    }
+    terminating_servers[server] = 1;
+    printf("[Load Balancer] Secondary Server %d deregistered after %lu reads, %d Secondary Servers are live\n", server + 1, (unsigned long)loads->servers[server].sent, number_of_live_servers);
+}
+
+/**
+ * @brief Records the acknowledgement of a server that has replied to every request it was sent
+ * and is terminating
+ *
+ * @param channel channel of the server
+ */
+void server_terminated(long channel)
+{
+    int server = (int)(channel - SECONDARY_SERVER_CHANNEL_1);
+    if (channel == PRIMARY_SERVER_CHANNEL)
+    {
+        primary_terminating = 0;
+        printf("[Load Balancer] Primary Server terminated\n");
+    }
+    else if (server >= 0 && server < SERVER_LOAD_SLOTS)
+    {
+        terminating_servers[server] = 0;
+        printf("[Load Balancer] Secondary Server %d terminated\n", server + 1);
+    }
+}
+
+/**
+ * @brief Whether the servers have replied to every request they were sent, or exited
+ *
+ * @return int
+ */
+int servers_drained(void)
+{
+    if (!server_exited(&loads->primary) && load_outstanding(&loads->primary) > 0)
+    {
+        return 0;
+    }
+    for (int i = 0; i < SERVER_LOAD_SLOTS; i++)
+    {
+        if (!server_exited(&loads->servers[i]) && load_outstanding(&loads->servers[i]) > 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Whether every server sent a termination message has acknowledged it, or exited
+ *
+ * @return int
+ */
+int servers_terminated(void)
+{
+    if (primary_terminating && !server_exited(&loads->primary))
+    {
+        return 0;
+    }
+    for (int i = 0; i < SERVER_LOAD_SLOTS; i++)
+    {
+        if (terminating_servers[i] && !server_exited(&loads->servers[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /**
- * @brief Cleanup
+ * @brief Keeps answering the messages that arrive during cleanup until the servers are done or
+ * the deadline of the shutdown has passed. Requests are answered as busy, and servers can no
+ * longer register.
+ *
+ * @param done servers_drained or servers_terminated
+ * @param start when the cleanup started
+ * @return whether the servers are done
+ */
+int wait_for_servers(int (*done)(void), const struct timespec *start)
+{
+    struct msg_buffer msg;
+    while (1)
+    {
+        // The messages already received are handled first, a server may have exited right
+        // after its acknowledgement. Counters change without a message, so they are checked
+        // again at least every 100 ms.
+        int remaining = message_queue_remaining(start, shutdown_deadline * 1000);
+        int finished = done();
+        if (remaining == 0)
+        {
+            return finished;
+        }
+        if (message_queue_receive_timed(&queue, &msg, sizeof(msg.data), LOAD_BALANCER_CHANNEL, finished ? 0 : (remaining < 100 ? remaining : 100)) == -1)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                perror("[Load Balancer] Error while receiving message during cleanup");
+                return 0;
+            }
+            if (finished)
+            {
+                return 1;
+            }
+        }
+        else if (msg.data.operation >= 1 && msg.data.operation <= 4 && seq_num_reserved(msg.data.seq_num))
+        {
+            fprintf(stderr, "[Load Balancer] Sequence number %ld is reserved, the request is dropped\n", msg.data.seq_num);
+        }
+        else if (msg.data.operation >= 1 && msg.data.operation <= 4)
+        {
+            reply_busy(&msg, "the database is terminating");
+        }
+        else if (msg.data.operation == 6)
+        {
+            reply_registration(&msg, -1);
+        }
+        else if (msg.data.operation == 7)
+        {
+            deregister_secondary_server(msg.data.seq_num);
+        }
+        else if (msg.data.operation == 8)
+        {
+            server_terminated(msg.data.seq_num);
+        }
+    }
+}
+
+/**
+ * @brief Cleanup. The load balancer stops admitting requests, waits until the servers have
+ * replied to the requests they were sent and acknowledged their termination, and then destroys
+ * the queues and the shared memory.
  *
  */
 void cleanup(int msg_queue_id)
 {
     printf("[Load Balancer] Initiating cleanup process...\n");
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // No server will take the reads that wait for one
+    while (parked_head != NULL)
+    {
+        struct parked_read *parked = parked_head;
+        parked_head = parked->next;
+        load_client_done(loads, NULL, parked->msg.data.client_id);
+        reply_busy(&parked->msg, "the database is terminating");
+        free(parked);
+    }
+
+    // Let the servers reply to the requests they were sent
+    if (!wait_for_servers(servers_drained, &start))
+    {
+        printf("[Load Balancer] Servers still had requests in flight after %d seconds\n", shutdown_deadline);
+    }
 
     // Inform servers about termination
     struct msg_buffer terminationMessage;
+    memset(&terminationMessage, 0, sizeof(terminationMessage));
     terminationMessage.msg_type = PRIMARY_SERVER_CHANNEL;
     terminationMessage.data.operation = 5; // Operation code for termination
 
     // Send termination message to all servers
-    if (msgsnd(msg_queue_id, &terminationMessage, sizeof(terminationMessage.data), 0) == -1)
+    if (message_queue_send(&queue, &terminationMessage, sizeof(terminationMessage.data)) == -1)
     {
         perror("[Load Balancer] Error while sending cleanup message to Primary Server");
     }
-
-    terminationMessage.msg_type = SECONDARY_SERVER_CHANNEL_1;
-    if (msgsnd(msg_queue_id, &terminationMessage, sizeof(terminationMessage.data), 0) == -1)
+    else
     {
-        perror("[Load Balancer] Error while sending cleanup message to Secondary Server 1");
+        primary_terminating = 1;
     }
 
-    terminationMessage.msg_type = SECONDARY_SERVER_CHANNEL_2;
-    if (msgsnd(msg_queue_id, &terminationMessage, sizeof(terminationMessage.data), 0) == -1)
+    for (int i = 0; i < number_of_live_servers; i++)
     {
-        perror("[Load Balancer] Error while sending cleanup message to Secondary Server 2");
+        terminationMessage.msg_type = SECONDARY_SERVER_CHANNEL_1 + live_servers[i];
+        if (message_queue_send(&queue, &terminationMessage, sizeof(terminationMessage.data)) == -1)
+        {
+            fprintf(stderr, "[Load Balancer] Error while sending cleanup message to Secondary Server %d: %s\n", live_servers[i] + 1, strerror(errno));
+        }
+        else
+        {
+            terminating_servers[live_servers[i]] = 1;
+        }
     }
 
+    if (message_queue_flush(&queue) == -1)
+    {
+        perror("[Load Balancer] Error while sending cleanup messages");
+    }
     printf("[Load Balancer] Cleanup message sent to all servers\n");
-    // Sleep for a while to allow servers to perform cleanup
-    sleep(5);
+
+    // Wait for every server to acknowledge its termination message
+    if (wait_for_servers(servers_terminated, &start))
+    {
+        printf("[Load Balancer] All servers terminated after %d ms\n", shutdown_deadline * 1000 - message_queue_remaining(&start, shutdown_deadline * 1000));
+    }
+    else
+    {
+        printf("[Load Balancer] Not every server terminated within %d seconds\n", shutdown_deadline);
+    }
 
     // Destroy the message queue
     if (msgctl(msg_queue_id, IPC_RMID, NULL) == -1)
     {
         perror("[Load Balancer] Error while destroying the message queue");
     }
+    if (queue.posix)
+    {
+        printf("[Load Balancer] %lu messages waited for room in a server queue\n", queue.deferred);
+        message_queue_close(&queue);
+        message_queue_destroy_channels(channels, sizeof(channels) / sizeof(channels[0]));
+        for (int i = 0; i < SERVER_LOAD_SLOTS; i++)
+        {
+            long channel = SECONDARY_SERVER_CHANNEL_1 + i;
+            if (created_channels[i])
+            {
+                message_queue_destroy_channels(&channel, 1);
+            }
+        }
+    }
     printf("[Load Balancer] Message queue destroyed\n");
 
-    // Destroy all mutexes
-    // Choose an appropriate size for your filename
-    char filename[250];
-    for (int i = 0; i <= 20; i++)
+    // Destroy the graph catalog
+    if (shmdt(catalog) == -1 || shmctl(catalog_id, IPC_RMID, NULL) == -1)
     {
-        // Make sure the filename is null-terminated, and copy it to the 'filename' array
-        snprintf(filename, sizeof(filename), "G%d.txt", i);
-
-        // SEMAPHORE PART
-        char sema_name_rw[256];
-        snprintf(sema_name_rw, sizeof(sema_name_rw), "rw_%s", filename);
-        char sema_name_read[256];
-        snprintf(sema_name_read, sizeof(sema_name_read), "read_%s", filename);
+        perror("[Load Balancer] Error while destroying the graph catalog");
+    }
+    printf("[Load Balancer] Graph catalog and graph locks destroyed\n");
 
-        // If O_CREAT is specified, and a semaphore with the given name already exists,
-        // then mode and value are ignored.
-        sem_t *rw_sem = sem_open(sema_name_rw, O_CREAT, 0644, 1);
-        sem_t *read_sem = sem_open(sema_name_read, O_CREAT, 0644, 1);
-        sem_t *read_count = sem_open("Assignment_Read_Count", O_CREAT, 0644, 200);
+    // Destroy the load table of the secondary servers
+    for (int i = 0; i < number_of_live_servers; i++)
+    {
+        printf("[Load Balancer] Secondary Server %d was sent %lu reads\n", live_servers[i] + 1, (unsigned long)loads->servers[live_servers[i]].sent);
+    }
+    if (read_routing == ROUTING_AFFINITY)
+    {
+        printf("[Load Balancer] %lu reads spilled past the Secondary Server of their graph\n", spilled_reads);
+    }
+    printf("[Load Balancer] %lu requests were answered as busy\n", busy_replies);
+    printf("[Load Balancer] %lu reads were batch reads\n", batch_reads);
+    if (shmdt(loads) == -1 || shmctl(loads_id, IPC_RMID, NULL) == -1)
+    {
+        perror("[Load Balancer] Error while destroying the load table");
+    }
+    printf("[Load Balancer] Load table destroyed\n");
 
-        // Destroy the semaphores
-        sem_close(rw_sem);
-        sem_close(read_sem);
-        sem_close(read_count);
+    // Destroy the shared memory arena
+    if (shmdt(arena) == -1 || shmctl(arena_id, IPC_RMID, NULL) == -1)
+    {
+        perror("[Load Balancer] Error while destroying the shared memory arena");
     }
-    printf("[Load Balancer] Semaphores destroyed\n");
+    printf("[Load Balancer] Shared memory arena destroyed\n");
 
     printf("[Load Balancer] Cleanup process completed. Exiting.\n");
     exit(EXIT_SUCCESS);
@@ -150,10 +758,87 @@ int main()
 
     printf("[Load Balancer] Successfully connected to the Message Queue with Key:%d ID:%d\n", key, msg_queue_id);
 
+    // With POSIX message queues every server gets a queue of its own
+    if (message_queue_posix())
+    {
+        if (message_queue_create_channels(channels, sizeof(channels) / sizeof(channels[0]), sizeof(struct msg_buffer)) == -1)
+        {
+            perror("[Load Balancer] Error while creating the POSIX message queues");
+            exit(EXIT_FAILURE);
+        }
+        printf("[Load Balancer] Successfully created the POSIX message queues\n");
+    }
+    if (message_queue_open(&queue, msg_queue_id, LOAD_BALANCER_CHANNEL, sizeof(struct msg_buffer)) == -1)
+    {
+        perror("[Load Balancer] Error while opening the POSIX message queue");
+        exit(EXIT_FAILURE);
+    }
+
+    // Create the catalog the servers use to track graph versions
+    if ((catalog = catalog_create(&catalog_id)) == NULL)
+    {
+        perror("[Load Balancer] Error while creating the graph catalog");
+        exit(EXIT_FAILURE);
+    }
+    printf("[Load Balancer] Successfully created the graph catalog with ID:%d\n", catalog_id);
+
+    // Create the arena the clients and servers lease shared memory from
+    if ((arena = arena_create(&arena_id)) == NULL)
+    {
+        perror("[Load Balancer] Error while creating the shared memory arena");
+        exit(EXIT_FAILURE);
+    }
+    printf("[Load Balancer] Successfully created the shared memory arena with ID:%d\n", arena_id);
+
+    // Create the table the secondary servers report their load in
+    if ((loads = load_table_create(&loads_id)) == NULL)
+    {
+        perror("[Load Balancer] Error while creating the load table");
+        exit(EXIT_FAILURE);
+    }
+    const char *routing_setting = getenv("READ_ROUTING");
+    if (routing_setting != NULL && strcmp(routing_setting, "parity") == 0)
+    {
+        read_routing = ROUTING_PARITY;
+    }
+    else if (routing_setting != NULL && strcmp(routing_setting, "least-work") == 0)
+    {
+        read_routing = ROUTING_LEAST_WORK;
+    }
+    const char *bound_setting = getenv("READ_LOAD_BOUND");
+    if (bound_setting != NULL && atof(bound_setting) >= 1)
+    {
+        read_load_bound = atof(bound_setting);
+    }
+    routing_seed = (unsigned int)getpid();
+    const char *server_limit = getenv("MAX_SERVER_IN_FLIGHT");
+    if (server_limit != NULL && atoi(server_limit) > 0)
+    {
+        max_server_in_flight = atoi(server_limit);
+    }
+    const char *size_setting = getenv("INTERACTIVE_GRAPH_SIZE");
+    if (size_setting != NULL && atoll(size_setting) > 0)
+    {
+        interactive_graph_size = atoll(size_setting);
+    }
+    const char *deadline_setting = getenv("SHUTDOWN_DEADLINE");
+    if (deadline_setting != NULL && atoi(deadline_setting) > 0)
+    {
+        shutdown_deadline = atoi(deadline_setting);
+    }
+    const char *client_limit = getenv("MAX_CLIENT_IN_FLIGHT");
+    if (client_limit != NULL && atoi(client_limit) > 0)
+    {
+        max_client_in_flight = atoi(client_limit);
+    }
+    const char *routing_names[] = {"graph affinity", "least work", "parity"};
+    printf("[Load Balancer] Successfully created the load table with ID:%d, routing reads by %s\n", loads_id, routing_names[read_routing]);
+    printf("[Load Balancer] Admitting up to %lu requests per server and %lu per client\n", (unsigned long)max_server_in_flight, (unsigned long)max_client_in_flight);
+
     // Listen to the message queue for new requests from the clients
     while (1)
     {
-        if (msgrcv(msg_queue_id, &msg, sizeof(msg.data), LOAD_BALANCER_CHANNEL, 0) == -1)
+        if (message_queue_receive(&queue, &msg, sizeof(msg.data), LOAD_BALANCER_CHANNEL) == -1)
         {
             perror("[Load Balancer] Error while receiving message from the client");
             exit(EXIT_FAILURE);
@@ -167,12 +852,29 @@ int main()
             {
                 cleanup(msg_queue_id);
             }
+            else if (msg.data.operation >= 1 && msg.data.operation <= 4 && seq_num_reserved(msg.data.seq_num))
+            {
+                fprintf(stderr, "[Load Balancer] Sequence number %ld is reserved, the request is dropped\n", msg.data.seq_num);
+            }
+            else if (msg.data.operation >= 1 && msg.data.operation <= 4 && client_over_limit(msg.data.client_id))
+            {
+                reply_busy(&msg, "its client has too many requests in flight");
+            }
+            else if ((msg.data.operation == 1 || msg.data.operation == 2) &&
+                     load_outstanding(&loads->primary) >= max_server_in_flight)
+            {
+                reply_busy(&msg, "the Primary Server is full");
+            }
             else if (msg.data.operation == 1 || msg.data.operation == 2)
             {
                 // Primary server
                 msg.msg_type = PRIMARY_SERVER_CHANNEL;
-                if (msgsnd(msg_queue_id, &msg, sizeof(msg.data), 0) == -1)
+                __atomic_add_fetch(&loads->primary.sent, 1, __ATOMIC_RELAXED);
+                load_client_sent(loads, msg.data.client_id);
+                if (message_queue_send(&queue, &msg, sizeof(msg.data)) == -1)
                 {
+                    __atomic_sub_fetch(&loads->primary.sent, 1, __ATOMIC_RELAXED);
+                    load_client_done(loads, NULL, msg.data.client_id);
                     perror("[Load Balancer] Error while sending message to Primary Server");
                 }
                 else
@@ -182,27 +884,22 @@ int main()
             }
             else if (msg.data.operation == 3 || msg.data.operation == 4)
             {
-                // Check for sequence number is odd or even
-                if (msg.data.seq_num % 2 == 0)
-                {
-                    // Secondary Server 2
-                    msg.msg_type = SECONDARY_SERVER_CHANNEL_2;
-                    if (msgsnd(msg_queue_id, &msg, sizeof(msg.data), 0) == -1)
-                    {
-                        perror("[Load Balancer] Error while sending message to Secondary Server 2");
-                    }
-                    else
-                        printf("[Load Balancer] Received a message from Client and Sent it to Secondary Server\n");
-                }
-                else
-                {
-                    // Secondary Server 1
-                    msg.msg_type = SECONDARY_SERVER_CHANNEL_1;
-                    if (msgsnd(msg_queue_id, &msg, sizeof(msg.data), 0) == -1)
-                    {
-                        perror("[Load Balancer] Error while sending message to Secondary Server 1");
-                    }
-                }
+                route_read(&msg);
+            }
+            else if (msg.data.operation == 6)
+            {
+                // A secondary server is starting
+                register_secondary_server(&msg);
+            }
+            else if (msg.data.operation == 7)
+            {
+                // A secondary server is leaving, its channel is in seq_num
+                deregister_secondary_server(msg.data.seq_num);
+            }
+            else if (msg.data.operation == 8)
+            {
+                // A server acknowledged its termination message, its channel is in seq_num
+                server_terminated(msg.data.seq_num);
             }
             else
             {
@@ -0,0 +1,553 @@
+/**
+ * @file message_queue.h
+ * @brief Message transport of the database, System V by default or POSIX message queues
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * By default every process shares the System V queue created by the load balancer, and picks
+ * its messages out of it by msg_type. Setting MESSAGE_QUEUE=posix in the environment of every
+ * process switches to POSIX message queues instead: the load balancer and each server have a
+ * queue of their own (/graph_database_<channel>), created by the load balancer, and each client
+ * creates one for its replies (/graph_database_client_<pid>). The
+ * queues of different processes no longer share a kernel limit, and a message is never read
+ * by a process only to be filtered out.
+ *
+ * POSIX queues are file descriptors, so a process waits for them in an epoll loop. The queue
+ * of the process is read without blocking, and only when it is empty does the process wait in
+ * epoll_wait. Messages to a server whose queue is full are kept in a backlog of the sender and
+ * sent once epoll reports the queue writable again, so one slow server never holds up the
+ * messages for the others. Replies are sent without blocking as well: a client waits for the
+ * reply of each request before it sends the next, so its queue only fills up once the client is
+ * gone, and its replies are then dropped.
+ *
+ * Messages keep the layout of the System V ones, a long msg_type followed by the data. The
+ * whole buffer is sent over a POSIX queue, so the receiver still sees the msg_type.
+ */
+
+#ifndef MESSAGE_QUEUE_H
+#define MESSAGE_QUEUE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/msg.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MESSAGE_QUEUE_PREFIX "/graph_database_"
+#define MESSAGE_QUEUE_NAME_LENGTH 64
+// Messages a POSIX queue holds, above fs.mqueue.msg_max it needs CAP_SYS_RESOURCE, so the
+// system default is used when it cannot be had
+#define MESSAGE_QUEUE_DEPTH 256
+// Queues a process sends to, the load balancer sends to the primary server and up to 16 secondary servers
+#define MESSAGE_QUEUE_DESTINATIONS 24
+// Intake argument of a client, whose queue is named after its pid
+#define MESSAGE_QUEUE_CLIENT -1
+// Intake argument of a process that only sends
+#define MESSAGE_QUEUE_NO_INTAKE 0
+
+struct message_backlog
+{
+    struct message_backlog *next;
+    size_t size;
+    char message[];
+};
+
+struct message_destination
+{
+    long channel;
+    mqd_t mqd;
+    struct message_backlog *head;
+    struct message_backlog *tail;
+};
+
+struct message_queue
+{
+    int posix;
+    int msg_queue_id;    // System V queue shared by every process
+    size_t message_size; // msg_type and data
+    mqd_t intake;        // POSIX queue the process receives on, -1 if it has none
+    int client;          // the intake is a client queue, removed when it is closed
+    int epoll_fd;
+    struct message_destination destinations[MESSAGE_QUEUE_DESTINATIONS];
+    int number_of_destinations;
+    unsigned long deferred; // messages that found their destination full
+    unsigned long dropped;  // replies to a client whose queue was gone or full
+};
+
+/**
+ * @brief Whether the processes use POSIX message queues, set with MESSAGE_QUEUE=posix
+ */
+static inline int message_queue_posix(void)
+{
+    const char *setting = getenv("MESSAGE_QUEUE");
+    return setting != NULL && strcmp(setting, "posix") == 0;
+}
+
+static inline void message_queue_channel_name(long channel, char *name, size_t size)
+{
+    snprintf(name, size, MESSAGE_QUEUE_PREFIX "%ld", channel);
+}
+
+static inline void message_queue_client_name(int client, char *name, size_t size)
+{
+    snprintf(name, size, MESSAGE_QUEUE_PREFIX "client_%d", client);
+}
+
+/**
+ * @brief Creates an empty POSIX queue, replacing one left over from an earlier run
+ *
+ * @return the queue opened with 'flags', or -1 on failure with errno set
+ */
+static inline mqd_t message_queue_create(const char *name, int flags, size_t message_size)
+{
+    mq_unlink(name);
+    struct mq_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.mq_maxmsg = MESSAGE_QUEUE_DEPTH;
+    attributes.mq_msgsize = message_size;
+    mqd_t mqd = mq_open(name, flags | O_CREAT | O_EXCL, 0644, &attributes);
+    if (mqd == (mqd_t)-1 && errno == EINVAL)
+    {
+        // Fall back to the default depth of the system, the size is within its limits
+        struct mq_attr defaults;
+        mqd_t probe = mq_open(name, O_RDONLY | O_CREAT | O_EXCL, 0644, NULL);
+        if (probe == (mqd_t)-1 || mq_getattr(probe, &defaults) == -1)
+        {
+            return (mqd_t)-1;
+        }
+        mq_close(probe);
+        mq_unlink(name);
+        attributes.mq_maxmsg = defaults.mq_maxmsg;
+        mqd = mq_open(name, flags | O_CREAT | O_EXCL, 0644, &attributes);
+    }
+    return mqd;
+}
+
+/**
+ * @brief Creates the POSIX queues of the load balancer and the servers, called once by the
+ * load balancer before the servers start
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int message_queue_create_channels(const long *channels, int number_of_channels, size_t message_size)
+{
+    for (int i = 0; i < number_of_channels; i++)
+    {
+        char name[MESSAGE_QUEUE_NAME_LENGTH];
+        message_queue_channel_name(channels[i], name, sizeof(name));
+        mqd_t mqd = message_queue_create(name, O_RDONLY, message_size);
+        if (mqd == (mqd_t)-1)
+        {
+            return -1;
+        }
+        mq_close(mqd);
+    }
+    return 0;
+}
+
+static inline void message_queue_destroy_channels(const long *channels, int number_of_channels)
+{
+    for (int i = 0; i < number_of_channels; i++)
+    {
+        char name[MESSAGE_QUEUE_NAME_LENGTH];
+        message_queue_channel_name(channels[i], name, sizeof(name));
+        mq_unlink(name);
+    }
+}
+
+/**
+ * @brief Sets up the transport of a process
+ *
+ * @param msg_queue_id System V queue, used unless MESSAGE_QUEUE=posix
+ * @param intake channel the process receives on, MESSAGE_QUEUE_CLIENT for a client or
+ * MESSAGE_QUEUE_NO_INTAKE for a process that only sends
+ * @param message_size size of a whole message, msg_type included
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int message_queue_open(struct message_queue *queue, int msg_queue_id, long intake, size_t message_size)
+{
+    memset(queue, 0, sizeof(*queue));
+    queue->posix = message_queue_posix();
+    queue->msg_queue_id = msg_queue_id;
+    queue->message_size = message_size;
+    queue->intake = (mqd_t)-1;
+    queue->epoll_fd = -1;
+    if (!queue->posix)
+    {
+        return 0;
+    }
+
+    if ((queue->epoll_fd = epoll_create1(0)) == -1)
+    {
+        return -1;
+    }
+    if (intake != MESSAGE_QUEUE_NO_INTAKE)
+    {
+        char name[MESSAGE_QUEUE_NAME_LENGTH];
+        if (intake == MESSAGE_QUEUE_CLIENT)
+        {
+            queue->client = 1;
+            message_queue_client_name(getpid(), name, sizeof(name));
+            queue->intake = message_queue_create(name, O_RDONLY | O_NONBLOCK, message_size);
+        }
+        else
+        {
+            message_queue_channel_name(intake, name, sizeof(name));
+            queue->intake = mq_open(name, O_RDONLY | O_NONBLOCK);
+        }
+        if (queue->intake == (mqd_t)-1)
+        {
+            return -1;
+        }
+        // The intake is registered with a negative index, destinations with their own
+        struct epoll_event event = {.events = EPOLLIN, .data.u32 = (uint32_t)-1};
+        if (epoll_ctl(queue->epoll_fd, EPOLL_CTL_ADD, queue->intake, &event) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline void message_queue_close(struct message_queue *queue)
+{
+    if (!queue->posix)
+    {
+        return;
+    }
+    for (int i = 0; i < queue->number_of_destinations; i++)
+    {
+        struct message_destination *destination = &queue->destinations[i];
+        while (destination->head != NULL)
+        {
+            struct message_backlog *next = destination->head->next;
+            free(destination->head);
+            destination->head = next;
+        }
+        mq_close(destination->mqd);
+    }
+    if (queue->intake != (mqd_t)-1)
+    {
+        mq_close(queue->intake);
+        if (queue->client)
+        {
+            char name[MESSAGE_QUEUE_NAME_LENGTH];
+            message_queue_client_name(getpid(), name, sizeof(name));
+            mq_unlink(name);
+        }
+    }
+    if (queue->epoll_fd != -1)
+    {
+        close(queue->epoll_fd);
+    }
+    queue->number_of_destinations = 0;
+    queue->intake = (mqd_t)-1;
+    queue->epoll_fd = -1;
+}
+
+/**
+ * @brief Finds the queue of a server channel, opening it on first use
+ *
+ * @return the index of the destination, or -1 on failure with errno set
+ */
+static inline int message_queue_destination(struct message_queue *queue, long channel)
+{
+    for (int i = 0; i < queue->number_of_destinations; i++)
+    {
+        if (queue->destinations[i].channel == channel)
+        {
+            return i;
+        }
+    }
+    if (queue->number_of_destinations == MESSAGE_QUEUE_DESTINATIONS)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+    char name[MESSAGE_QUEUE_NAME_LENGTH];
+    message_queue_channel_name(channel, name, sizeof(name));
+    mqd_t mqd = mq_open(name, O_WRONLY | O_NONBLOCK);
+    if (mqd == (mqd_t)-1)
+    {
+        return -1;
+    }
+    int index = queue->number_of_destinations++;
+    struct message_destination *destination = &queue->destinations[index];
+    destination->channel = channel;
+    destination->mqd = mqd;
+    destination->head = destination->tail = NULL;
+    return index;
+}
+
+/**
+ * @brief Sends the backlog of a destination until it is empty or the queue is full again.
+ * epoll only watches a destination for room while it has a backlog.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int message_queue_flush_destination(struct message_queue *queue, int index)
+{
+    struct message_destination *destination = &queue->destinations[index];
+    while (destination->head != NULL)
+    {
+        struct message_backlog *message = destination->head;
+        if (mq_send(destination->mqd, message->message, message->size, 0) == -1)
+        {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        destination->head = message->next;
+        free(message);
+    }
+    destination->tail = NULL;
+    return epoll_ctl(queue->epoll_fd, EPOLL_CTL_DEL, destination->mqd, NULL);
+}
+
+/**
+ * @brief Sends a message to the channel in its msg_type, like msgsnd. Over POSIX queues a
+ * message that does not fit is kept in a backlog and sent later without blocking the caller.
+ *
+ * @param size size of the data, without the msg_type
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int message_queue_send(struct message_queue *queue, const void *message, size_t size)
+{
+    if (!queue->posix)
+    {
+        return msgsnd(queue->msg_queue_id, message, size, 0);
+    }
+    long channel = *(const long *)message;
+    int index = message_queue_destination(queue, channel);
+    if (index == -1)
+    {
+        return -1;
+    }
+    struct message_destination *destination = &queue->destinations[index];
+    size += sizeof(long);
+    if (destination->head == NULL)
+    {
+        if (mq_send(destination->mqd, message, size, 0) == 0)
+        {
+            return 0;
+        }
+        if (errno != EAGAIN)
+        {
+            return -1;
+        }
+        struct epoll_event event = {.events = EPOLLOUT, .data.u32 = (uint32_t)index};
+        if (epoll_ctl(queue->epoll_fd, EPOLL_CTL_ADD, destination->mqd, &event) == -1)
+        {
+            return -1;
+        }
+    }
+
+    struct message_backlog *backlog = (struct message_backlog *)malloc(sizeof(struct message_backlog) + size);
+    if (backlog == NULL)
+    {
+        return -1;
+    }
+    backlog->next = NULL;
+    backlog->size = size;
+    memcpy(backlog->message, message, size);
+    if (destination->tail != NULL)
+    {
+        destination->tail->next = backlog;
+    }
+    else
+    {
+        destination->head = backlog;
+    }
+    destination->tail = backlog;
+    queue->deferred++;
+    return 0;
+}
+
+/**
+ * @brief Sends a reply to a client, like msgsnd with the seq_num of the request in msg_type.
+ * Replies can be sent from any thread. Over POSIX queues a reply to a client whose queue is
+ * gone or full is dropped and counted, the client has stopped reading it.
+ *
+ * @param client pid of the client, where its queue is found over POSIX queues
+ * @param size size of the data, without the msg_type
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int message_queue_reply(struct message_queue *queue, int client, const void *message, size_t size)
+{
+    if (!queue->posix)
+    {
+        return msgsnd(queue->msg_queue_id, message, size, 0);
+    }
+    char name[MESSAGE_QUEUE_NAME_LENGTH];
+    message_queue_client_name(client, name, sizeof(name));
+    mqd_t mqd = mq_open(name, O_WRONLY | O_NONBLOCK);
+    int result = mqd == (mqd_t)-1 ? -1 : mq_send(mqd, message, size + sizeof(long), 0);
+    int saved_errno = errno;
+    if (mqd != (mqd_t)-1)
+    {
+        mq_close(mqd);
+    }
+    if (result == -1 && (saved_errno == ENOENT || saved_errno == EAGAIN))
+    {
+        __atomic_fetch_add(&queue->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    errno = saved_errno;
+    return result;
+}
+
+/**
+ * @brief Waits for queue events: the intake has messages or a destination with a backlog has
+ * room. Backlogs are sent as soon as there is room for them.
+ *
+ * @param timeout in milliseconds, -1 to wait until there is an event
+ * @return whether the intake may have messages, or -1 on failure or on a signal with errno set
+ */
+static inline int message_queue_wait(struct message_queue *queue, int timeout)
+{
+    struct epoll_event events[MESSAGE_QUEUE_DESTINATIONS + 1];
+    int number_of_events = epoll_wait(queue->epoll_fd, events, MESSAGE_QUEUE_DESTINATIONS + 1, timeout);
+    if (number_of_events == -1)
+    {
+        return -1;
+    }
+    int readable = 0;
+    for (int i = 0; i < number_of_events; i++)
+    {
+        if (events[i].data.u32 == (uint32_t)-1)
+        {
+            readable = 1;
+        }
+        else if (message_queue_flush_destination(queue, (int)events[i].data.u32) == -1)
+        {
+            return -1;
+        }
+    }
+    return readable;
+}
+
+/**
+ * @brief Milliseconds left of a timeout that started at start, -1 if there is no timeout
+ */
+static inline int message_queue_remaining(const struct timespec *start, int timeout)
+{
+    if (timeout == -1)
+    {
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+    return elapsed < timeout ? (int)(timeout - elapsed) : 0;
+}
+
+/**
+ * @brief Like message_queue_receive, but gives up after timeout milliseconds and fails with
+ * EAGAIN. System V queues have no timed receive, so they are polled every millisecond.
+ *
+ * @param size size of the data, without the msg_type
+ * @param timeout in milliseconds, -1 to wait until a message arrives
+ * @return size of the data received, or -1 on failure with errno set
+ */
+static inline ssize_t message_queue_receive_timed(struct message_queue *queue, void *message, size_t size, long type, int timeout)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!queue->posix)
+    {
+        while (1)
+        {
+            ssize_t received = msgrcv(queue->msg_queue_id, message, size, type, timeout == -1 ? 0 : IPC_NOWAIT);
+            if (received != -1 || errno != ENOMSG)
+            {
+                return received;
+            }
+            if (message_queue_remaining(&start, timeout) == 0)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+            usleep(1000);
+        }
+    }
+    char buffer[queue->message_size];
+    while (1)
+    {
+        ssize_t received = mq_receive(queue->intake, buffer, sizeof(buffer), NULL);
+        if (received >= (ssize_t)sizeof(long))
+        {
+            if (*(long *)buffer != type)
+            {
+                continue;
+            }
+            size_t length = (size_t)received - sizeof(long) < size ? (size_t)received - sizeof(long) : size;
+            memcpy(message, buffer, sizeof(long) + length);
+            return (ssize_t)length;
+        }
+        if (received == -1 && errno != EAGAIN)
+        {
+            return -1;
+        }
+        // The intake is empty, wait in epoll while the backlogs are sent
+        int remaining = message_queue_remaining(&start, timeout);
+        if (remaining == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (message_queue_wait(queue, remaining) == -1)
+        {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Receives the next message with the given msg_type, like msgrcv. Over POSIX queues the
+ * intake of the process only holds its own messages: messages of another type are left over
+ * from an earlier request of a client and are dropped. Like msgrcv, it fails with EINTR when a
+ * signal handler interrupts the wait.
+ *
+ * @param size size of the data, without the msg_type
+ * @return size of the data received, or -1 on failure with errno set
+ */
+static inline ssize_t message_queue_receive(struct message_queue *queue, void *message, size_t size, long type)
+{
+    return message_queue_receive_timed(queue, message, size, type, -1);
+}
+
+/**
+ * @brief Waits until every backlog has been sent, before a process that sent messages exits
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int message_queue_flush(struct message_queue *queue)
+{
+    if (!queue->posix)
+    {
+        return 0;
+    }
+    while (1)
+    {
+        int pending = 0;
+        for (int i = 0; i < queue->number_of_destinations; i++)
+        {
+            pending |= queue->destinations[i].head != NULL;
+        }
+        if (!pending)
+        {
+            return 0;
+        }
+        if (message_queue_wait(queue, 100) == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+#endif
@@ -23,20 +23,42 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <glob.h>
+#include <time.h>
+
+#include "graph_catalog.h"
+#include "graph_delta.h"
+#include "graph_store.h"
+#include "graph_wal.h"
+#include "message_queue.h"
+#include "server_load.h"
+#include "shm_arena.h"
 
 #define MESSAGE_LENGTH 100
 #define LOAD_BALANCER_CHANNEL 4000
 #define PRIMARY_SERVER_CHANNEL 4001
 #define SECONDARY_SERVER_CHANNEL_1 4002
 #define SECONDARY_SERVER_CHANNEL_2 4003
-#define MAX_THREADS 200
+#define WAL_CHECKPOINT_DEFAULT_BYTES (64UL * 1024 * 1024)
+#define MAX_GRAPHS 256
+#define COMPACT_DEFAULT_CHANGES 1000
+#define COMPACT_DEFAULT_BYTES (1UL * 1024 * 1024)
+#define COMPACT_DEFAULT_IDLE_SECONDS 30
 
 struct data
 {
     long seq_num;
     long operation;
     char graph_name[MESSAGE_LENGTH];
+    // Arena handle of the parameters of the request, -1 if it has none
+    int request_handle;
+    // Arena handle and number of vertices of the result of a traversal, -1 and 0 otherwise
+    int result_handle;
+    int result_length;
+    // pid of the client, its replies go to its own queue when MESSAGE_QUEUE=posix
+    int client_id;
+    // Scheduling class of a read, PRIORITY_AUTO lets the load balancer choose it from the size of the graph
+    int priority;
 };
 
 struct msg_buffer
@@ -45,132 +67,948 @@ struct msg_buffer
     struct data data;
 };
 
-struct data_to_thread
+/**
+ * @brief A write received by the main thread, waiting in the queue of its graph
+ */
+struct write_request
 {
-    int msg_queue_id;
     struct msg_buffer msg;
+    int *parameters; // the parameters of the request in the arena
+    int fits;        // whether the count in the parameters fits in the block the client leased
+    struct write_request *next;
 };
 
+// Shared memory catalog, every write publishes the new version of the graph in it
+struct catalog *catalog;
+
+// Shared memory arena, the parameters of every request are in a block leased by the client
+struct arena *arena;
+
+// Transport the requests arrive on and the replies are sent with, the applier threads share it
+struct message_queue queue;
+
+// Load table of the load balancer, the primary server counts the writes it has replied to in it
+struct load_table *loads;
+
+// Write-ahead log, every write is logged before it is applied and made durable before the reply
+struct wal wal;
+uint64_t wal_checkpoint_bytes = WAL_CHECKPOINT_DEFAULT_BYTES;
+
 /**
- * @brief This function is executed by the thread which is responsible for writing to the new graph file
- *
- * @param arg
- * @return void*
+ * @brief Per graph state of the compaction thread. 'writer' is held by the threads that change
+ * the files of the graph, and by the compaction thread while it installs a snapshot. The
+ * secondary servers never wait for it.
+ */
+struct compaction_entry
+{
+    char graph_name[MESSAGE_LENGTH];
+    char storage_path[GRAPH_PATH_LENGTH];
+    pthread_mutex_t writer;
+    long pending_changes;
+    uint64_t pending_bytes;
+    time_t last_write;
+    // Writes waiting for the applier thread of the graph, in the order they were received
+    struct write_request *queue_head;
+    struct write_request *queue_tail;
+    int applier_running;
+};
+
+/**
+ * @brief The compaction thread folds the delta file of a graph into a new CSR file once it has
+ * max_changes changes, max_bytes bytes, or has not been written to for idle_seconds
  */
+struct compaction
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stopping;
+    int number_of_entries;
+    struct compaction_entry entries[MAX_GRAPHS];
+    long max_changes;
+    uint64_t max_bytes;
+    long idle_seconds;
+    // Statistics
+    uint64_t snapshots;
+    uint64_t retries;
+    uint64_t changes_folded;
+    double last_milliseconds;
+    double total_milliseconds;
+} compaction = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, {}, COMPACT_DEFAULT_CHANGES, COMPACT_DEFAULT_BYTES, COMPACT_DEFAULT_IDLE_SECONDS, 0, 0, 0, 0, 0};
 
-void *writeToNewGraphFile(void *arg)
+/**
+ * @brief Writes to a graph are applied by one applier thread per graph, which is started when a
+ * write arrives for a graph that has none and exits once the queue of the graph is empty. The
+ * applier takes every write queued so far as one batch. Guarded by compaction.lock.
+ */
+struct writes
 {
-    struct data_to_thread *dtt = (struct data_to_thread *)arg;
-    // On the server side for storing data, we just start with an integer
-    // NOTE: Here we can use this and get away with it because we are not storing data here but only reading
-    // Refer: https://man7.org/linux/man-pages/man3/shmget.3p.html
-    int number_of_nodes;
+    pthread_cond_t idle; // signalled when an applier thread exits
+    int appliers;
+    // Statistics
+    unsigned long requests;
+    unsigned long batches;
+    unsigned long superseded_uploads;
+    unsigned long superseded_changes;
+} writes = {PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0};
 
-    // Connect to shared memory
-    key_t shm_key;
-    int shm_id;
-    // Generate key for the shared memory
-    // Here, we are using the seq_name as the key because
-    // we want to ensure that each request has a unique shared memory
-    while ((shm_key = ftok(".", dtt->msg.data.seq_num)) == -1)
+/**
+ * @brief Looks up the current state of a graph: the header of its CSR file, its latest version
+ * and its number of vertices, including the changes in its delta file. Only the header of the
+ * CSR file and the last delta record are read. Must be called while holding the lock of the graph.
+ *
+ * @return 0 if the graph exists, -1 otherwise
+ */
+int currentGraphVersion(const char *graph_name, struct graph_file_header *base, uint64_t *version, uint32_t *number_of_nodes)
+{
+    char filename[GRAPH_PATH_LENGTH];
+    graph_storage_path(graph_name, filename, sizeof(filename));
+    if (graph_read_header(filename, base) == -1)
     {
-        perror("[Primary Server] Error while generating key for shared memory");
+        return -1;
+    }
+
+    char delta_filename[GRAPH_PATH_LENGTH];
+    graph_delta_path(graph_name, delta_filename, sizeof(delta_filename));
+    struct graph_delta_record last;
+    if (graph_delta_last(delta_filename, base->generation, &last))
+    {
+        *version = last.generation;
+        *number_of_nodes = last.number_of_nodes;
+    }
+    else
+    {
+        *version = base->generation;
+        *number_of_nodes = (uint32_t)base->number_of_nodes;
+    }
+    return 0;
+}
+
+/**
+ * @brief Waits until a logged write is on disk, sharing the fsync with the other writers that are
+ * waiting (group commit)
+ *
+ * @param lsn returned by wal_append for the write
+ * @param seq_num
+ */
+void makeDurable(uint64_t lsn, long seq_num)
+{
+    if (wal_sync(&wal, lsn) == -1)
+    {
+        perror("[Primary Server] Error while syncing the write-ahead log");
         exit(EXIT_FAILURE);
     }
-    printf("[Primary Server] Generated shared memory key %d\n", shm_key);
-    // Connect to the shared memory using the key
-    if ((shm_id = shmget(shm_key, sizeof(number_of_nodes), 0666)) == -1)
+    printf("[Primary Server] Write for seq %ld is durable (%lu records, %lu fsyncs)\n", seq_num, (unsigned long)wal.records, (unsigned long)wal.syncs);
+}
+
+/**
+ * @brief Empties the log once it has grown past WAL_CHECKPOINT_BYTES. Must not be called between
+ * wal_begin and wal_end.
+ */
+void checkpointWal(void)
+{
+    if (wal_size(&wal) > wal_checkpoint_bytes)
     {
-        perror("[Primary Server] Error occurred while connecting to shm\n");
+        if (wal_checkpoint(&wal) == -1)
+        {
+            perror("[Primary Server] Error while checkpointing the write-ahead log");
+            exit(EXIT_FAILURE);
+        }
+        printf("[Primary Server] Checkpointed the write-ahead log\n");
+    }
+}
+
+/**
+ * @brief Takes the write lock of a graph, the secondary servers cannot pin a snapshot of the
+ * graph until it is given back with catalog_unlock
+ *
+ * @param graph_name
+ * @return the entry to pass to catalog_unlock
+ */
+struct catalog_entry *lockGraph(const char *graph_name)
+{
+    struct catalog_entry *lock = catalog_write_lock(catalog, graph_name);
+    if (lock == NULL)
+    {
+        fprintf(stderr, "[Primary Server] Catalog is full, could not lock %s\n", graph_name);
         exit(EXIT_FAILURE);
     }
-    // Attach to the shared memory
-    int *shmptr = (int *)shmat(shm_id, NULL, 0);
-    if (shmptr == (void *)-1)
+    return lock;
+}
+
+/**
+ * @brief Applies a record of the write-ahead log again after a restart, unless the graph files
+ * already contain it
+ *
+ * @param record
+ * @param payload
+ * @param arg unused
+ */
+void replayWalRecord(const struct wal_record *record, const void *payload, void *arg)
+{
+    (void)arg;
+    struct graph_file_header base;
+    uint64_t version;
+    uint32_t number_of_nodes;
+    int exists = currentGraphVersion(record->graph_name, &base, &version, &number_of_nodes) == 0;
+
+    char filename[GRAPH_PATH_LENGTH];
+    graph_storage_path(record->graph_name, filename, sizeof(filename));
+    char delta_filename[GRAPH_PATH_LENGTH];
+    graph_delta_path(record->graph_name, delta_filename, sizeof(delta_filename));
+    // Even a record the files already hold may only be in the page cache, the checkpoint after
+    // the replay syncs the files before the log is emptied
+    if (wal_file_written(&wal, filename) == -1 || wal_file_written(&wal, delta_filename) == -1)
     {
-        perror("[Primary Server] Error in shmat \n");
+        perror("[Primary Server] Error while recording the files of the write-ahead log");
         exit(EXIT_FAILURE);
     }
 
-    int shmptr_index = 0;
-    number_of_nodes = shmptr[shmptr_index++];
-    int adjacency_matrix[number_of_nodes][number_of_nodes];
-    for (int i = 0; i < number_of_nodes; i++)
+    struct catalog_entry *lock;
+    if (record->type == WAL_GRAPH)
+    {
+        if (exists && version >= record->generation)
+        {
+            return;
+        }
+        const uint64_t *dimensions = (const uint64_t *)payload;
+        struct graph graph;
+        memset(&graph, 0, sizeof(graph));
+        graph.number_of_nodes = (uint32_t)dimensions[0];
+        graph.number_of_edges = dimensions[1];
+        graph.generation = record->generation;
+        graph.offsets = (uint64_t *)(dimensions + 2);
+        graph.neighbors = (uint32_t *)(graph.offsets + graph.number_of_nodes + 1);
+
+        char temporary_filename[GRAPH_PATH_LENGTH + 4];
+        snprintf(temporary_filename, sizeof(temporary_filename), "%s.tmp", filename);
+        if (graph_write_file(temporary_filename, &graph, 0) == -1)
+        {
+            perror("[Primary Server] Error while writing the file");
+            exit(EXIT_FAILURE);
+        }
+        // The files are replaced under the write lock of the graph, like a write replaces them
+        lock = lockGraph(record->graph_name);
+        if (rename(temporary_filename, filename) == -1 || (unlink(delta_filename) == -1 && errno != ENOENT))
+        {
+            perror("[Primary Server] Error while installing the file");
+            exit(EXIT_FAILURE);
+        }
+        version = record->generation;
+    }
+    else if (record->type == WAL_DELTA)
     {
-        for (int j = 0; j < number_of_nodes; j++)
+        // Changes to a graph that has been replaced since are not needed anymore
+        if (!exists || base.generation != record->generation)
+        {
+            return;
+        }
+        const struct graph_delta_record *records = (const struct graph_delta_record *)payload;
+        long count = record->length / sizeof(struct graph_delta_record);
+        long first = 0;
+        while (first < count && records[first].generation <= version)
+        {
+            first++;
+        }
+        if (first == count)
+        {
+            return;
+        }
+        char temporary_delta_filename[GRAPH_PATH_LENGTH + 4];
+        snprintf(temporary_delta_filename, sizeof(temporary_delta_filename), "%s.tmp", delta_filename);
+        int appended = graph_delta_append(delta_filename, temporary_delta_filename, base.generation, records + first, count - first);
+        if (appended == -1)
         {
-            adjacency_matrix[i][j] = shmptr[shmptr_index++];
+            perror("[Primary Server] Error while writing the delta file");
+            exit(EXIT_FAILURE);
         }
+        lock = lockGraph(record->graph_name);
+        if (appended == 1 && rename(temporary_delta_filename, delta_filename) == -1)
+        {
+            perror("[Primary Server] Error while installing the delta file");
+            exit(EXIT_FAILURE);
+        }
+        version = records[count - 1].generation;
+    }
+    else
+    {
+        return;
     }
 
-    // Choose an appropriate size for your filename
-    char filename[250];
-    // Make sure the filename is null-terminated, and copy it to the 'filename' array
-    snprintf(filename, sizeof(filename), "%s", dtt->msg.data.graph_name);
-    // SEMAPHORE PART
-    char sema_name_rw[256];
-    snprintf(sema_name_rw, sizeof(sema_name_rw), "rw_%s", filename);
-    // If O_CREAT is specified, and a semaphore with the given name already exists,
-    // then mode and value are ignored.
-    sem_t *rw_sem = sem_open(sema_name_rw, O_CREAT, 0644, 1);
+    printf("[Primary Server] Recovered %s (version %lu) from the write-ahead log\n", record->graph_name, (unsigned long)version);
+    catalog_publish(catalog, record->graph_name, version);
+    catalog_unlock(lock);
+}
 
-    // It's time to open the file and write the data to it
-    // Wait for the semaphore to be available
-    printf("[Primary Server] Waiting for the semaphore to be available\n");
-    sem_wait(rw_sem);
+/**
+ * @brief Finds the compaction entry of a graph, adding it if needed. Graphs are identified by their
+ * CSR file, so G1 and G1.txt share an entry.
+ *
+ * @param graph_name
+ * @return struct compaction_entry*
+ */
+struct compaction_entry *compactionEntry(const char *graph_name)
+{
+    char storage_path[GRAPH_PATH_LENGTH];
+    graph_storage_path(graph_name, storage_path, sizeof(storage_path));
 
-    FILE *fp = fopen(filename, "w");
-    if (fp == NULL)
+    pthread_mutex_lock(&compaction.lock);
+    struct compaction_entry *entry = NULL;
+    for (int i = 0; i < compaction.number_of_entries; i++)
     {
-        perror("[Primary Server] Error while opening the file");
-        exit(EXIT_FAILURE);
+        if (strcmp(compaction.entries[i].storage_path, storage_path) == 0)
+        {
+            entry = &compaction.entries[i];
+            break;
+        }
+    }
+    if (entry == NULL)
+    {
+        if (compaction.number_of_entries == MAX_GRAPHS)
+        {
+            fprintf(stderr, "[Primary Server] Too many graphs, at most %d are supported\n", MAX_GRAPHS);
+            exit(EXIT_FAILURE);
+        }
+        entry = &compaction.entries[compaction.number_of_entries++];
+        memset(entry, 0, sizeof(*entry));
+        snprintf(entry->graph_name, sizeof(entry->graph_name), "%s", graph_name);
+        snprintf(entry->storage_path, sizeof(entry->storage_path), "%s", storage_path);
+        pthread_mutex_init(&entry->writer, NULL);
+        entry->last_write = time(NULL);
+    }
+    pthread_mutex_unlock(&compaction.lock);
+    return entry;
+}
+
+/**
+ * @brief Records changes appended to the delta file of a graph, and wakes up the compaction
+ * thread if the delta file has grown large enough. Called while holding entry->writer.
+ *
+ * @param entry
+ * @param number_of_changes 0 if the delta file has been removed
+ */
+void deltaWritten(struct compaction_entry *entry, long number_of_changes)
+{
+    pthread_mutex_lock(&compaction.lock);
+    if (number_of_changes == 0)
+    {
+        entry->pending_changes = 0;
+        entry->pending_bytes = 0;
     }
     else
     {
-        printf("[Primary Server] Successfully opened the file %s\n", filename);
-        // Write the data to the file
-        fprintf(fp, "%d\n", number_of_nodes);
-        for (int i = 0; i < number_of_nodes; i++)
+        entry->pending_changes += number_of_changes;
+        entry->pending_bytes += number_of_changes * sizeof(struct graph_delta_record);
+    }
+    entry->last_write = time(NULL);
+    if (entry->pending_changes >= compaction.max_changes || entry->pending_bytes >= compaction.max_bytes)
+    {
+        pthread_cond_signal(&compaction.wake);
+    }
+    pthread_mutex_unlock(&compaction.lock);
+}
+
+/**
+ * @brief Folds the delta file of a graph into a new CSR file with the latest version of the graph.
+ * The snapshot is built and synced without any lock, so the secondary servers keep reading the old
+ * CSR file and delta file meanwhile. It is renamed into place while holding entry->writer and the
+ * write lock of the graph, so a reader never pins the new CSR file with the old delta file.
+ * The old delta file does not match the generation of the new CSR file and is ignored from then on.
+ *
+ * @param entry
+ * @param exclusive hold entry->writer during the whole compaction, so that writes to the graph
+ * cannot make it fail
+ * @return 0 on success or if there was nothing to do, -1 if the graph changed in the meantime
+ */
+int compactGraph(struct compaction_entry *entry, int exclusive)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (exclusive)
+    {
+        pthread_mutex_lock(&entry->writer);
+    }
+
+    struct graph base;
+    struct graph merged;
+    struct graph_delta_record *records = NULL;
+    long number_of_changes = 0;
+    memset(&merged, 0, sizeof(merged));
+    if (graph_map(entry->storage_path, &base) == 0)
+    {
+        char delta_filename[GRAPH_PATH_LENGTH];
+        graph_delta_path(entry->graph_name, delta_filename, sizeof(delta_filename));
+        number_of_changes = graph_delta_read(delta_filename, base.generation, &records);
+        if (number_of_changes > 0 && graph_apply_delta(&base, records, number_of_changes, &merged) == -1)
+        {
+            perror("[Primary Server] Error while applying the delta file");
+            exit(EXIT_FAILURE);
+        }
+        free(records);
+    }
+    else
+    {
+        base.generation = 0;
+    }
+
+    int result = 0;
+    if (number_of_changes > 0)
+    {
+        char snapshot_filename[GRAPH_PATH_LENGTH + 8];
+        snprintf(snapshot_filename, sizeof(snapshot_filename), "%s.compact", entry->storage_path);
+        // The snapshot must be on disk before it replaces the files that the write-ahead log relies on
+        if (graph_write_file(snapshot_filename, &merged, 1) == -1)
         {
-            for (int j = 0; j < number_of_nodes; j++)
+            perror("[Primary Server] Error while writing the snapshot");
+            exit(EXIT_FAILURE);
+        }
+
+        if (!exclusive)
+        {
+            pthread_mutex_lock(&entry->writer);
+        }
+        // Only install the snapshot if the graph has not been written since it was read
+        struct graph_file_header current;
+        uint64_t version;
+        uint32_t number_of_nodes;
+        if (currentGraphVersion(entry->graph_name, &current, &version, &number_of_nodes) == 0 &&
+            current.generation == base.generation && version == merged.generation)
+        {
+            struct catalog_entry *lock = lockGraph(entry->graph_name);
+            if (rename(snapshot_filename, entry->storage_path) == -1)
             {
-                fprintf(fp, "%d ", adjacency_matrix[i][j]);
+                perror("[Primary Server] Error while installing the snapshot");
+                exit(EXIT_FAILURE);
             }
-            fprintf(fp, "\n");
+            catalog_unlock(lock);
         }
-        fclose(fp);
-        printf("[Primary Server] Successfully written to the file %s for seq: %ld\n", filename, dtt->msg.data.seq_num);
+        else
+        {
+            unlink(snapshot_filename);
+            result = -1;
+        }
+        graph_free(&merged);
+    }
+    if (result == 0)
+    {
+        deltaWritten(entry, 0);
+    }
+    pthread_mutex_unlock(&entry->writer);
+    if (base.generation != 0)
+    {
+        graph_free(&base);
     }
-    // Release the semaphore
-    printf("[Primary Server] Released the semaphore\n");
-    sem_post(rw_sem);
 
-    // Send reply to the client
-    dtt->msg.msg_type = dtt->msg.data.seq_num;
-    dtt->msg.data.operation = 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double milliseconds = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    pthread_mutex_lock(&compaction.lock);
+    if (result == -1)
+    {
+        compaction.retries++;
+    }
+    else if (number_of_changes > 0)
+    {
+        compaction.snapshots++;
+        compaction.changes_folded += number_of_changes;
+        compaction.last_milliseconds = milliseconds;
+        compaction.total_milliseconds += milliseconds;
+        printf("[Primary Server] Compacted %ld changes of %s into %s (version %lu) in %.2f ms, %lu snapshots in %.2f ms\n",
+               number_of_changes, entry->graph_name, entry->storage_path, (unsigned long)merged.generation, milliseconds,
+               (unsigned long)compaction.snapshots, compaction.total_milliseconds);
+    }
+    pthread_mutex_unlock(&compaction.lock);
+    return result;
+}
 
-    printf("[Primary Server] Sending reply to the client %ld @ %d\n", dtt->msg.msg_type, dtt->msg_queue_id);
-    printf("[Primary Server] Message: %ld %ld %s\n", dtt->msg.data.seq_num, dtt->msg.data.operation, dtt->msg.data.graph_name);
-    if (msgsnd(dtt->msg_queue_id, &(dtt->msg), sizeof(dtt->msg.data), 0) == -1)
+/**
+ * @brief This function is executed by the compaction thread. It compacts the graphs whose delta
+ * files are due, one at a time, and otherwise sleeps until a writer wakes it up or a second passes.
+ *
+ * @param arg unused
+ * @return void*
+ */
+void *compactGraphs(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&compaction.lock);
+    while (!compaction.stopping)
     {
-        perror("[Primary Server] Message could not be sent, please try again");
-        exit(EXIT_FAILURE);
+        struct compaction_entry *due = NULL;
+        time_t now = time(NULL);
+        for (int i = 0; i < compaction.number_of_entries && due == NULL; i++)
+        {
+            struct compaction_entry *entry = &compaction.entries[i];
+            if (entry->pending_changes > 0 &&
+                (entry->pending_changes >= compaction.max_changes || entry->pending_bytes >= compaction.max_bytes ||
+                 now - entry->last_write >= compaction.idle_seconds))
+            {
+                due = entry;
+            }
+        }
+        if (due == NULL)
+        {
+            struct timespec timeout;
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_sec += 1;
+            pthread_cond_timedwait(&compaction.wake, &compaction.lock, &timeout);
+            continue;
+        }
+
+        pthread_mutex_unlock(&compaction.lock);
+        // If a write got in the way, compact again while keeping the writers of this graph out
+        if (compactGraph(due, 0) == -1)
+        {
+            compactGraph(due, 1);
+        }
+        pthread_mutex_lock(&compaction.lock);
+    }
+    pthread_mutex_unlock(&compaction.lock);
+    pthread_exit(NULL);
+}
+
+/**
+ * @brief Checks the count the client stored first in the parameters of a write against the block
+ * it leased, so that a negative or too large count is never used to read past the block. An upload
+ * holds the number of nodes followed by the adjacency matrix, a modify request the number of
+ * changes followed by (operation, u, v) for every change.
+ *
+ * @param request
+ * @return 1 if the parameters fit in the block, 0 otherwise
+ */
+int parametersFit(const struct write_request *request)
+{
+    uint64_t block_size = arena_block_size(arena, request->msg.data.request_handle);
+    if (block_size < sizeof(int) || request->parameters[0] < 0)
+    {
+        return 0;
+    }
+    uint64_t count = (uint64_t)request->parameters[0];
+    uint64_t number_of_ints = 1 + (request->msg.data.operation == 1 ? count * count : 3 * count);
+    return number_of_ints <= block_size / sizeof(int);
+}
+
+/**
+ * @brief Checks the changes of a modify request against the current state of the graph and gives
+ * each of them the next version. The shared memory holds the number of changes followed by
+ * (operation, u, v) for every change, see graph_delta.h for the operations.
+ *
+ * @param parameters
+ * @param exists whether the graph exists
+ * @param number_of_nodes of the graph, updated by the changes
+ * @param version of the graph, updated by the changes
+ * @param records where the changes are stored
+ * @param reply the reason when the changes are rejected
+ * @return 1 if all the changes are valid, 0 otherwise
+ */
+int validateChanges(const int *parameters, int exists, uint32_t *number_of_nodes, uint64_t *version, struct graph_delta_record *records, char *reply)
+{
+    if (!exists)
+    {
+        snprintf(reply, MESSAGE_LENGTH, "Graph does not exist");
+        return 0;
+    }
+    // Nothing changes unless every change is valid
+    uint32_t nodes = *number_of_nodes;
+    uint64_t next_version = *version;
+    int number_of_changes = parameters[0];
+    for (int i = 0; i < number_of_changes; i++)
+    {
+        uint32_t operation = parameters[1 + 3 * i];
+        int u = parameters[2 + 3 * i];
+        int v = parameters[3 + 3 * i];
+
+        if (operation == DELTA_ADD_VERTEX)
+        {
+            nodes++;
+            u = v = 0;
+        }
+        else if ((operation != DELTA_ADD_EDGE && operation != DELTA_REMOVE_EDGE && operation != DELTA_REMOVE_VERTEX) ||
+                 u < 0 || u >= (int)nodes || (operation != DELTA_REMOVE_VERTEX && (v < 0 || v >= (int)nodes)))
+        {
+            snprintf(reply, MESSAGE_LENGTH, "Invalid change %d: %u %d %d", i + 1, operation, u + 1, v + 1);
+            return 0;
+        }
+        if (operation == DELTA_REMOVE_VERTEX)
+        {
+            v = 0;
+        }
+
+        records[i].generation = ++next_version;
+        records[i].operation = operation;
+        records[i].u = u;
+        records[i].v = v;
+        records[i].number_of_nodes = nodes;
+    }
+    *number_of_nodes = nodes;
+    *version = next_version;
+    return 1;
+}
+
+/**
+ * @brief Applies a batch of writes to one graph with a single physical write. Only the last
+ * upload of a whole graph (operation 1) is written, the uploads and changes before it would be
+ * overwritten by it right away. The changes (operation 2) after it are validated one request
+ * after the other, as if they had been applied one by one, and the valid ones are appended to
+ * the delta file in one record. The lock is taken and the write-ahead log synced once for
+ * the whole batch, and every request of the batch is then acknowledged in order.
+ *
+ * @param entry
+ * @param batch
+ */
+void applyWriteBatch(struct compaction_entry *entry, struct write_request *batch)
+{
+    const char *graph_name = batch->msg.data.graph_name;
+    int number_of_requests = 0;
+    struct write_request *upload = NULL;
+    long total_changes = 0;
+    for (struct write_request *request = batch; request != NULL; request = request->next)
+    {
+        if ((request->parameters = (int *)arena_resolve(arena, request->msg.data.request_handle)) == NULL)
+        {
+            perror("[Primary Server] Error while resolving the request parameters \n");
+            exit(EXIT_FAILURE);
+        }
+        number_of_requests++;
+        if (!(request->fits = parametersFit(request)))
+        {
+            continue;
+        }
+        if (request->msg.data.operation == 1)
+        {
+            upload = request;
+            total_changes = 0;
+        }
+        else
+        {
+            total_changes += request->parameters[0];
+        }
     }
+    load_begin(&loads->primary, number_of_requests, 0);
 
-    // Detach from the shared memory
-    if (shmdt(shmptr) == -1)
+    // Convert the adjacency matrix of the surviving upload into the CSR format before taking
+    // the lock, so that the writer holds the lock only while the file is written
+    struct graph graph;
+    memset(&graph, 0, sizeof(graph));
+    if (upload != NULL && graph_from_matrix(upload->parameters[0], &upload->parameters[1], &graph) == -1)
     {
-        perror("[Primary Server] Could not detach from shared memory\n");
+        perror("[Primary Server] Error while building the graph");
         exit(EXIT_FAILURE);
     }
-    printf("[Primary Server] Successfully Completed Operation 1\n");
+    struct graph_delta_record *records = (struct graph_delta_record *)malloc((total_changes > 0 ? total_changes : 1) * sizeof(struct graph_delta_record));
+    // Changes superseded by the upload are only validated, they are stored in scratch
+    long scratch_size = 1;
+    for (struct write_request *request = batch; request != upload && upload != NULL; request = request->next)
+    {
+        if (request->msg.data.operation == 2 && request->fits && request->parameters[0] > scratch_size)
+        {
+            scratch_size = request->parameters[0];
+        }
+    }
+    struct graph_delta_record *scratch = (struct graph_delta_record *)malloc(scratch_size * sizeof(struct graph_delta_record));
+    int *valid = (int *)malloc(number_of_requests * sizeof(int));
+    char(*replies)[MESSAGE_LENGTH] = malloc(number_of_requests * MESSAGE_LENGTH);
+    if (records == NULL || scratch == NULL || valid == NULL || replies == NULL)
+    {
+        perror("[Primary Server] Error while allocating the batch");
+        exit(EXIT_FAILURE);
+    }
+
+    // Keep the compaction thread from replacing the files while they are written
+    pthread_mutex_lock(&entry->writer);
+
+    // Go through the batch in order, every write gets the next version numbers
+    struct graph_file_header base;
+    uint64_t version = 0;
+    uint32_t number_of_nodes = 0;
+    int exists = currentGraphVersion(graph_name, &base, &version, &number_of_nodes) == 0;
+    uint64_t delta_generation = exists ? base.generation : 0;
+    long number_of_changes = 0;
+    int past_upload = upload == NULL;
+    int superseded_uploads = 0;
+    long superseded_changes = 0;
+    int index = 0;
+    for (struct write_request *request = batch; request != NULL; request = request->next, index++)
+    {
+        if (!request->fits)
+        {
+            valid[index] = 0;
+            snprintf(replies[index], MESSAGE_LENGTH, "Invalid request: the count does not fit in the shared memory");
+            continue;
+        }
+        if (request->msg.data.operation == 1)
+        {
+            exists = 1;
+            number_of_nodes = request->parameters[0];
+            version++;
+            valid[index] = 1;
+            if (request == upload)
+            {
+                graph.generation = version;
+                delta_generation = version;
+                past_upload = 1;
+            }
+            else
+            {
+                superseded_uploads++;
+            }
+            continue;
+        }
+        struct graph_delta_record *target = past_upload ? records + number_of_changes : scratch;
+        valid[index] = validateChanges(request->parameters, exists, &number_of_nodes, &version, target, replies[index]);
+        if (valid[index])
+        {
+            if (past_upload)
+            {
+                number_of_changes += request->parameters[0];
+            }
+            else
+            {
+                superseded_changes += request->parameters[0];
+            }
+            snprintf(replies[index], MESSAGE_LENGTH, "File successfully modified");
+        }
+    }
+
+    // The new version is written next to the files the secondary servers are reading, and is
+    // only installed once it is complete
+    char filename[GRAPH_PATH_LENGTH];
+    graph_storage_path(graph_name, filename, sizeof(filename));
+    char delta_filename[GRAPH_PATH_LENGTH];
+    graph_delta_path(graph_name, delta_filename, sizeof(delta_filename));
+    char temporary_filename[GRAPH_PATH_LENGTH + 4];
+    snprintf(temporary_filename, sizeof(temporary_filename), "%s.tmp", filename);
+    char temporary_delta_filename[GRAPH_PATH_LENGTH + 4];
+    snprintf(temporary_delta_filename, sizeof(temporary_delta_filename), "%s.tmp", delta_filename);
+    uint64_t lsn = 0;
+    uint64_t size = 0;
+    int delta_replaced = 0;
+    wal_begin(&wal);
+    if (upload != NULL)
+    {
+        size = (uint64_t)graph.number_of_nodes + graph.number_of_edges;
+        // Log the new graph before the file is replaced, so that it can be recovered after a crash
+        uint64_t dimensions[2] = {graph.number_of_nodes, graph.number_of_edges};
+        struct iovec payload[3] = {
+            {dimensions, sizeof(dimensions)},
+            {graph.offsets, ((size_t)graph.number_of_nodes + 1) * sizeof(uint64_t)},
+            {graph.neighbors, graph.number_of_edges * sizeof(uint32_t)}};
+        if ((lsn = wal_append(&wal, WAL_GRAPH, graph_name, graph.generation, payload, 3)) == 0)
+        {
+            perror("[Primary Server] Error while writing to the write-ahead log");
+            exit(EXIT_FAILURE);
+        }
+        if (graph_write_file(temporary_filename, &graph, 0) == -1)
+        {
+            perror("[Primary Server] Error while writing the file");
+            exit(EXIT_FAILURE);
+        }
+        graph_free(&graph);
+    }
+    if (number_of_changes > 0)
+    {
+        // Log the changes before they are applied, so that they can be recovered after a crash
+        struct iovec payload = {records, number_of_changes * sizeof(struct graph_delta_record)};
+        if ((lsn = wal_append(&wal, WAL_DELTA, graph_name, delta_generation, &payload, 1)) == 0)
+        {
+            perror("[Primary Server] Error while writing to the write-ahead log");
+            exit(EXIT_FAILURE);
+        }
+        // Changes to the current graph file are appended in place, readers only see them once
+        // the new version is published. Changes to a new graph file start a new delta file,
+        // which is only renamed into place below.
+        if (upload != NULL)
+        {
+            delta_replaced = graph_delta_write(temporary_delta_filename, delta_generation, records, number_of_changes) == -1 ? -1 : 1;
+        }
+        else
+        {
+            delta_replaced = graph_delta_append(delta_filename, temporary_delta_filename, delta_generation, records, number_of_changes);
+        }
+        if (delta_replaced == -1)
+        {
+            perror("[Primary Server] Error while writing the delta file");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The secondary servers can serve the new version as soon as it is published, so the batch
+    // must not be lost by a crash from then on
+    struct write_request *last = batch;
+    while (last->next != NULL)
+    {
+        last = last->next;
+    }
+    if (lsn != 0)
+    {
+        makeDurable(lsn, last->msg.data.seq_num);
+    }
+
+    // Install the new version: the read lock of the graph is only held off while the files
+    // are renamed and the version is published, never while they are written
+    if (lsn != 0)
+    {
+        struct catalog_entry *lock = lockGraph(graph_name);
+        if (upload != NULL && rename(temporary_filename, filename) == -1)
+        {
+            perror("[Primary Server] Error while installing the new version");
+            exit(EXIT_FAILURE);
+        }
+        // The changes made to an older graph file do not apply to the current one
+        if (delta_replaced ? rename(temporary_delta_filename, delta_filename) == -1
+                           : upload != NULL && unlink(delta_filename) == -1 && errno != ENOENT)
+        {
+            perror("[Primary Server] Error while installing the new version");
+            exit(EXIT_FAILURE);
+        }
+        // Publish the new version so that the secondary servers stop serving their cached
+        // copy of the old version
+        catalog_publish(catalog, graph_name, version);
+        if (upload != NULL)
+        {
+            catalog_set_size(catalog, graph_name, size);
+        }
+        catalog_unlock(lock);
+
+        // The next checkpoint syncs the files before it drops the records of this batch
+        if ((upload != NULL && wal_file_written(&wal, filename) == -1) ||
+            (number_of_changes > 0 && wal_file_written(&wal, delta_filename) == -1))
+        {
+            perror("[Primary Server] Error while recording the files of the write-ahead log");
+            exit(EXIT_FAILURE);
+        }
+    }
+    wal_end(&wal);
+    if (upload != NULL)
+    {
+        printf("[Primary Server] Successfully written to the file %s (generation %lu) for seq: %ld\n", filename, (unsigned long)delta_generation, upload->msg.data.seq_num);
+        deltaWritten(entry, 0);
+    }
+    if (number_of_changes > 0)
+    {
+        deltaWritten(entry, number_of_changes);
+        printf("[Primary Server] Appended %ld changes to %s (version %lu)\n", number_of_changes, delta_filename, (unsigned long)version);
+    }
+    pthread_mutex_unlock(&entry->writer);
+    free(records);
+    free(scratch);
+
+    pthread_mutex_lock(&compaction.lock);
+    writes.requests += number_of_requests;
+    writes.batches++;
+    writes.superseded_uploads += superseded_uploads;
+    writes.superseded_changes += superseded_changes;
+    pthread_mutex_unlock(&compaction.lock);
+    printf("[Primary Server] Applied %d writes to %s (version %lu), %d uploads and %ld changes superseded\n", number_of_requests, graph_name,
+           (unsigned long)version, superseded_uploads, superseded_changes);
+
+    checkpointWal();
+
+    // Send every client its reply, in the order the writes were received
+    index = 0;
+    while (batch != NULL)
+    {
+        struct write_request *request = batch;
+        batch = batch->next;
+        long operation = request->msg.data.operation;
+        request->msg.msg_type = request->msg.data.seq_num;
+        request->msg.data.operation = valid[index] ? 0 : -1;
+        if (operation == 2 || !request->fits)
+        {
+            snprintf(request->msg.data.graph_name, sizeof(request->msg.data.graph_name), "%s", replies[index]);
+        }
+
+        printf("[Primary Server] Sending reply to the client %ld\n", request->msg.msg_type);
+        load_client_done(loads, &loads->primary, request->msg.data.client_id);
+        if (message_queue_reply(&queue, request->msg.data.client_id, &request->msg, sizeof(request->msg.data)) == -1)
+        {
+            perror("[Primary Server] Message could not be sent, please try again");
+            exit(EXIT_FAILURE);
+        }
+        load_end(&loads->primary, 1, 0, 0);
+
+        // Stop using the parameters, the client gives the block back to the arena
+        if (arena_unresolve(request->msg.data.request_handle, request->parameters) == -1)
+        {
+            perror("[Primary Server] Could not detach from shared memory\n");
+            exit(EXIT_FAILURE);
+        }
+        printf("[Primary Server] Successfully Completed Operation %ld\n", operation);
+        free(request);
+        index++;
+    }
+    free(valid);
+    free(replies);
+}
 
-    // Free dtt
-    printf("[Primary Server] Freeing dtt\n");
-    free(dtt);
+/**
+ * @brief This function is executed by the applier thread of a graph. It applies the writes
+ * queued for the graph in batches until the queue is empty, and then exits.
+ *
+ * @param arg the compaction entry of the graph
+ * @return void*
+ */
+void *applyWrites(void *arg)
+{
+    struct compaction_entry *entry = (struct compaction_entry *)arg;
+    pthread_mutex_lock(&compaction.lock);
+    while (entry->queue_head != NULL)
+    {
+        struct write_request *batch = entry->queue_head;
+        entry->queue_head = entry->queue_tail = NULL;
+        pthread_mutex_unlock(&compaction.lock);
+        applyWriteBatch(entry, batch);
+        pthread_mutex_lock(&compaction.lock);
+    }
+    entry->applier_running = 0;
+    writes.appliers--;
+    pthread_cond_broadcast(&writes.idle);
+    pthread_mutex_unlock(&compaction.lock);
     pthread_exit(NULL);
 }
 
+/**
+ * @brief Queues a write for its graph, starting the applier thread of the graph if it has none
+ *
+ * @param msg
+ */
+void queueWrite(const struct msg_buffer *msg)
+{
+    struct write_request *request = (struct write_request *)malloc(sizeof(struct write_request));
+    if (request == NULL)
+    {
+        perror("[Primary Server] Error while allocating the write");
+        exit(EXIT_FAILURE);
+    }
+    request->msg = *msg;
+    request->parameters = NULL;
+    request->fits = 0;
+    request->next = NULL;
+
+    struct compaction_entry *entry = compactionEntry(msg->data.graph_name);
+    pthread_mutex_lock(&compaction.lock);
+    if (entry->queue_tail != NULL)
+    {
+        entry->queue_tail->next = request;
+    }
+    else
+    {
+        entry->queue_head = request;
+    }
+    entry->queue_tail = request;
+    if (!entry->applier_running)
+    {
+        pthread_t applier;
+        if (pthread_create(&applier, NULL, applyWrites, (void *)entry) != 0)
+        {
+            perror("[Primary Server] Error in applier thread creation");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(applier);
+        entry->applier_running = 1;
+        writes.appliers++;
+    }
+    pthread_mutex_unlock(&compaction.lock);
+}
+
 /**
  * @brief The Primary Server is responsible all the write operations
  * and this has nothing to do with creating the message queue
@@ -202,16 +1040,121 @@ int main()
         exit(EXIT_FAILURE);
     }
     printf("[Primary Server] Successfully connected to the Message Queue with Key:%d ID:%d\n", key, msg_queue_id);
+    if (message_queue_open(&queue, msg_queue_id, PRIMARY_SERVER_CHANNEL, sizeof(struct msg_buffer)) == -1)
+    {
+        perror("[Primary Server] Error while opening the POSIX message queue");
+        exit(EXIT_FAILURE);
+    }
 
-    // Store the thread_ids
-    pthread_t thread_ids[MAX_THREADS];
-    int threads[200];
-    int threadIndex = 0;
+    // Attach to the graph catalog created by the load balancer
+    if ((catalog = catalog_attach()) == NULL)
+    {
+        perror("[Primary Server] Error while attaching to the graph catalog");
+        exit(EXIT_FAILURE);
+    }
+
+    // Attach to the shared memory arena created by the load balancer
+    if ((arena = arena_attach()) == NULL)
+    {
+        perror("[Primary Server] Error while attaching to the shared memory arena");
+        exit(EXIT_FAILURE);
+    }
+
+    // Attach to the load table created by the load balancer
+    if ((loads = load_table_attach()) == NULL)
+    {
+        perror("[Primary Server] Error while attaching to the load table");
+        exit(EXIT_FAILURE);
+    }
+    // Writes an earlier primary server received and never replied to are not in flight anymore
+    load_client_release(loads, &loads->primary);
+    // Lets the load balancer tell on cleanup whether the server is still running
+    __atomic_store_n(&loads->primary.pid, getpid(), __ATOMIC_RELEASE);
+
+    // Open the write-ahead log and recover the writes that may not have reached the graph files
+    // before the last run stopped. The log is emptied once they have been flushed to disk.
+    char *wal_setting = getenv("WAL_CHECKPOINT_BYTES");
+    if (wal_setting != NULL && atoll(wal_setting) > 0)
+    {
+        wal_checkpoint_bytes = (uint64_t)atoll(wal_setting);
+    }
+    wal_setting = getenv("WAL_COMMIT_DELAY_US");
+    if (wal_open(&wal, WAL_PATH, wal_setting != NULL ? (useconds_t)atoi(wal_setting) : 0) == -1)
+    {
+        perror("[Primary Server] Error while opening the write-ahead log");
+        exit(EXIT_FAILURE);
+    }
+    long recovered = wal_replay(&wal, replayWalRecord, NULL);
+    if (recovered == -1 || wal_checkpoint(&wal) == -1)
+    {
+        perror("[Primary Server] Error while recovering from the write-ahead log");
+        exit(EXIT_FAILURE);
+    }
+    printf("[Primary Server] Replayed %ld records from the write-ahead log\n", recovered);
+
+    // Publish the version of every graph on disk before any write is applied. Changes are appended
+    // to a delta file before their version is published, so the secondary servers bound what they
+    // read from it by the published version, and must never find a graph without one.
+    glob_t graph_files;
+    if (glob("*" GRAPH_FILE_EXTENSION, 0, NULL, &graph_files) == 0)
+    {
+        for (size_t i = 0; i < graph_files.gl_pathc; i++)
+        {
+            char graph_name[MESSAGE_LENGTH];
+            snprintf(graph_name, sizeof(graph_name), "%.*s", (int)(strlen(graph_files.gl_pathv[i]) - strlen(GRAPH_FILE_EXTENSION)), graph_files.gl_pathv[i]);
+            struct graph_file_header base;
+            uint64_t version;
+            uint32_t number_of_nodes;
+            struct catalog_entry *lock = lockGraph(graph_name);
+            if (currentGraphVersion(graph_name, &base, &version, &number_of_nodes) == 0)
+            {
+                catalog_publish(catalog, graph_name, version);
+            }
+            catalog_unlock(lock);
+        }
+        globfree(&graph_files);
+    }
+
+    // Start the compaction thread, with the delta files left over from the last run
+    char *compaction_setting;
+    if ((compaction_setting = getenv("COMPACT_MAX_CHANGES")) != NULL && atol(compaction_setting) > 0)
+    {
+        compaction.max_changes = atol(compaction_setting);
+    }
+    if ((compaction_setting = getenv("COMPACT_MAX_BYTES")) != NULL && atoll(compaction_setting) > 0)
+    {
+        compaction.max_bytes = (uint64_t)atoll(compaction_setting);
+    }
+    if ((compaction_setting = getenv("COMPACT_IDLE_SECONDS")) != NULL && atol(compaction_setting) >= 0)
+    {
+        compaction.idle_seconds = atol(compaction_setting);
+    }
+    glob_t delta_files;
+    if (glob("*" GRAPH_DELTA_EXTENSION, 0, NULL, &delta_files) == 0)
+    {
+        for (size_t i = 0; i < delta_files.gl_pathc; i++)
+        {
+            char graph_name[MESSAGE_LENGTH];
+            snprintf(graph_name, sizeof(graph_name), "%.*s", (int)(strlen(delta_files.gl_pathv[i]) - strlen(GRAPH_DELTA_EXTENSION)), delta_files.gl_pathv[i]);
+            struct stat status;
+            if (stat(delta_files.gl_pathv[i], &status) == 0 && status.st_size > (off_t)sizeof(struct graph_delta_header))
+            {
+                deltaWritten(compactionEntry(graph_name), (status.st_size - sizeof(struct graph_delta_header)) / sizeof(struct graph_delta_record));
+            }
+        }
+        globfree(&delta_files);
+    }
+    pthread_t compaction_thread;
+    if (pthread_create(&compaction_thread, NULL, compactGraphs, NULL) != 0)
+    {
+        perror("[Primary Server] Error in compaction thread creation");
+        exit(EXIT_FAILURE);
+    }
 
     // Listen to the message queue for new requests from the clients
     while (1)
     {
-        if (msgrcv(msg_queue_id, &msg, sizeof(msg.data), PRIMARY_SERVER_CHANNEL, 0) == -1)
+        if (message_queue_receive(&queue, &msg, sizeof(msg.data), PRIMARY_SERVER_CHANNEL) == -1)
         {
             perror("[Primary Server] Error while receiving message from the client");
             exit(EXIT_FAILURE);
@@ -222,29 +1165,47 @@ int main()
 
             if (msg.data.operation == 1 || msg.data.operation == 2)
             {
-                // Write to a new file
-                struct data_to_thread *dtt = (struct data_to_thread *)malloc(sizeof(struct data_to_thread));
-                dtt->msg_queue_id = msg_queue_id;
-                dtt->msg = msg;
-                // thread_exists[msg.data.seq_num] = 1;
-                pthread_create(&thread_ids[msg.data.seq_num], NULL, writeToNewGraphFile, (void *)dtt);
-                threads[threadIndex++] = msg.data.seq_num;
+                // Operation 1 writes a new graph file, operation 2 appends changes to an existing graph.
+                // Both wait in the queue of the graph for its applier thread.
+                load_client_taken(&loads->primary, msg.data.client_id);
+                queueWrite(&msg);
             }
             else if (msg.data.operation == 5)
             {
-                // Operation code for cleanup
-                for (int i = 0; i < threadIndex; i++)
+                // Operation code for cleanup, let the applier threads finish the queued writes
+                pthread_mutex_lock(&compaction.lock);
+                while (writes.appliers > 0)
                 {
-                    // printf("Attempting to Clean: %d %lu\n", i, thread_ids[i]);
-                    if (thread_ids[threads[i]] != 0)
-                    {
-                        if (pthread_join(thread_ids[threads[i]], NULL) != 0)
-                        {
-                            perror("[Primary Server] Error joining thread");
-                        }
-                    }
+                    pthread_cond_wait(&writes.idle, &compaction.lock);
                 }
-
+                printf("[Primary Server] Writes: %lu requests in %lu batches, %lu uploads and %lu changes superseded\n", writes.requests, writes.batches,
+                       writes.superseded_uploads, writes.superseded_changes);
+                compaction.stopping = 1;
+                pthread_cond_signal(&compaction.wake);
+                pthread_mutex_unlock(&compaction.lock);
+                pthread_join(compaction_thread, NULL);
+                printf("[Primary Server] Compaction: %lu snapshots, %lu changes folded, %lu retries, last %.2f ms, total %.2f ms\n",
+                       (unsigned long)compaction.snapshots, (unsigned long)compaction.changes_folded, (unsigned long)compaction.retries,
+                       compaction.last_milliseconds, compaction.total_milliseconds);
+                printf("[Primary Server] WAL: %lu records, %lu fsyncs, %lu checkpoints\n", (unsigned long)wal.records, (unsigned long)wal.syncs, (unsigned long)wal.checkpoints);
+                wal_close(&wal);
+                if (queue.posix)
+                {
+                    printf("[Primary Server] %lu replies dropped, their client was gone\n", queue.dropped);
+                }
+                // Every request has been replied to, acknowledge the termination message
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_type = LOAD_BALANCER_CHANNEL;
+                msg.data.seq_num = PRIMARY_SERVER_CHANNEL;
+                msg.data.operation = 8;
+                msg.data.client_id = getpid();
+                strcpy(msg.data.graph_name, "-");
+                if (message_queue_send(&queue, &msg, sizeof(msg.data)) == -1 || message_queue_flush(&queue) == -1)
+                {
+                    perror("[Primary Server] Error while acknowledging the termination message");
+                }
+                message_queue_close(&queue);
+                __atomic_store_n(&loads->primary.pid, 0, __ATOMIC_RELEASE);
                 printf("[Primary Server] Terminating...\n");
                 exit(EXIT_SUCCESS);
             }
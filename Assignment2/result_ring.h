@@ -0,0 +1,141 @@
+/**
+ * @file result_ring.h
+ * @brief Single-producer/single-consumer ring buffer in shared memory, used to stream traversal results
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * The client creates the ring and passes its shared memory id to the secondary server with the
+ * request. The server pushes vertices into it as the traversal finds them and sets 'done' at the
+ * end, while the client pops them concurrently, so the client sees the first vertices long before
+ * the traversal has finished.
+ *
+ * 'head' is only written by the producer and 'tail' only by the consumer, each on its own cache
+ * line. A slot is published with a release store of 'head' and freed with a release store of
+ * 'tail', so no locks are needed.
+ */
+
+#ifndef RESULT_RING_H
+#define RESULT_RING_H
+
+#include <stdint.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+
+#define RESULT_RING_CAPACITY 4096 // Power of two
+#define RESULT_RING_LINE 64
+
+struct result_ring
+{
+    uint64_t head;
+    char head_padding[RESULT_RING_LINE - sizeof(uint64_t)];
+    uint64_t tail;
+    char tail_padding[RESULT_RING_LINE - sizeof(uint64_t)];
+    uint32_t done;
+    uint32_t capacity;
+    char padding[RESULT_RING_LINE - 2 * sizeof(uint32_t)];
+    uint32_t slots[RESULT_RING_CAPACITY];
+};
+
+/**
+ * @brief Creates an empty ring, called by the consumer
+ *
+ * @param ring_id set to the shared memory id of the ring
+ * @return struct result_ring* or NULL on failure with errno set
+ */
+static inline struct result_ring *result_ring_create(int *ring_id)
+{
+    if ((*ring_id = shmget(IPC_PRIVATE, sizeof(struct result_ring), 0666 | IPC_CREAT)) == -1)
+    {
+        return NULL;
+    }
+    struct result_ring *ring = (struct result_ring *)shmat(*ring_id, NULL, 0);
+    if (ring == (void *)-1)
+    {
+        shmctl(*ring_id, IPC_RMID, 0);
+        return NULL;
+    }
+    ring->head = 0;
+    ring->tail = 0;
+    ring->done = 0;
+    ring->capacity = RESULT_RING_CAPACITY;
+    return ring;
+}
+
+/**
+ * @brief Number of processes attached to the ring, used to notice that the other side is gone
+ */
+static inline int result_ring_attached(int ring_id)
+{
+    struct shmid_ds status;
+    return shmctl(ring_id, IPC_STAT, &status) == -1 ? 0 : (int)status.shm_nattch;
+}
+
+/**
+ * @brief Pushes 'count' vertices, waiting for the consumer to make room when the ring is full
+ *
+ * @return 0 on success, -1 if the consumer has detached from the ring
+ */
+static inline int result_ring_push(struct result_ring *ring, int ring_id, const uint32_t *vertices, uint64_t count)
+{
+    uint64_t head = ring->head;
+    useconds_t backoff = 1;
+    for (uint64_t i = 0; i < count;)
+    {
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint64_t room = ring->capacity - (head - tail);
+        if (room == 0)
+        {
+            if (result_ring_attached(ring_id) < 2)
+            {
+                return -1;
+            }
+            usleep(backoff);
+            backoff = backoff < 1000 ? backoff * 2 : backoff;
+            continue;
+        }
+        backoff = 1;
+        for (; room > 0 && i < count; room--, i++, head++)
+        {
+            ring->slots[head & (ring->capacity - 1)] = vertices[i];
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+ * @brief Tells the consumer that no more vertices will be pushed
+ */
+static inline void result_ring_finish(struct result_ring *ring)
+{
+    __atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Pops up to 'count' vertices without waiting
+ *
+ * @return number of vertices popped, 0 if the ring is empty, -1 if it is empty and finished
+ */
+static inline long result_ring_pop(struct result_ring *ring, uint32_t *vertices, uint64_t count)
+{
+    // Read 'done' before 'head', so that every vertex pushed before the ring was finished is seen
+    uint32_t done = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    if (head == tail)
+    {
+        return done ? -1 : 0;
+    }
+    long popped = 0;
+    for (; tail != head && (uint64_t)popped < count; tail++)
+    {
+        vertices[popped++] = ring->slots[tail & (ring->capacity - 1)];
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return popped;
+}
+
+#endif
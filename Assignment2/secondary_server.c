@@ -8,6 +8,9 @@
  * @copyright Copyright (c) 2023
  *
  */
+
+#define _GNU_SOURCE
+
 #include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -19,25 +22,55 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <signal.h>
+
+#include "graph_bfs.h"
+#include "graph_catalog.h"
+#include "graph_delta.h"
+#include "graph_dfs.h"
+#include "graph_msbfs.h"
+#include "graph_dense.h"
+#include "graph_store.h"
+#include "message_queue.h"
+#include "result_ring.h"
+#include "server_load.h"
+#include "shm_arena.h"
 
 #define MESSAGE_LENGTH 100
 #define LOAD_BALANCER_CHANNEL 4000
 #define PRIMARY_SERVER_CHANNEL 4001
+// Channel of the secondary server in the first slot of the load table, the others follow
 #define SECONDARY_SERVER_CHANNEL_1 4002
-#define SECONDARY_SERVER_CHANNEL_2 4003
 #define MAX_THREADS 200
+// Replies to registrations go to REGISTRATION_REPLY_BASE + pid of the secondary server, clients
+// only use sequence numbers below it and the channels are far below it
+#define REGISTRATION_REPLY_BASE 1000000000L
+// Scheduling classes of reads, interactive reads go ahead of batch reads
+#define PRIORITY_AUTO 0
+#define PRIORITY_INTERACTIVE 1
+#define PRIORITY_BATCH 2
 #define MAX_VERTICES 100
-#define MAX_QUEUE_SIZE 100
+#define GRAPH_CACHE_DEFAULT_BUDGET (64UL * 1024 * 1024)
+#define DEFAULT_WORKERS 4
+#define DEFAULT_REQUEST_QUEUE_SIZE 64
 
 /**
- * This structure, struct data, is used to store message data. It includes sequence numbers, operation codes, a graph name, and arrays for storing BFS sequence and its length.
+ * This structure, struct data, is used to store message data. It includes sequence numbers, operation codes, a graph name, the arena handle of the request parameters, and the arena handle and length of the result of a traversal.
  */
 struct data
 {
     long seq_num;
     long operation;
     char graph_name[MESSAGE_LENGTH];
+    // Arena handle of the parameters of the request, -1 if it has none
+    int request_handle;
+    // Arena handle and number of vertices of the result of a traversal, -1 and 0 otherwise
+    int result_handle;
+    int result_length;
+    // pid of the client, its replies go to its own queue when MESSAGE_QUEUE=posix
+    int client_id;
+    // Scheduling class of a read, PRIORITY_AUTO lets the load balancer choose it from the size of the graph
+    int priority;
 };
 
 /**
@@ -49,615 +82,1258 @@ struct msg_buffer
     struct data data;
 };
 
-/*
- * Implementation of Queue
+/**
+ * Vertices found by a traversal, numbered from 1 like the client does.
+ * Every vertex is visited at most once, so there is room for all vertices of the graph.
  */
-struct Queue
+struct traversal_result
 {
-    int items[MAX_QUEUE_SIZE];
-    int front;
-    int rear;
+    uint32_t *vertices;
+    int length;
 };
 
-// Function to create an empty queue
-struct Queue *createQueue()
+/**
+ * Used to pass data to threads for BFS and dfs processing.
+ * It includes a message buffer.
+ * Result holds the vertices found so far, they are returned to the client in shared memory
+ * Number of nodes is the number of nodes in the graph.
+ * Graph is the graph in CSR form, the neighbors of v are graph->neighbors[graph->offsets[v] ... graph->offsets[v + 1] - 1]
+ * Dense is the bit matrix of the graph if it is dense, NULL otherwise. Neighbors are visited with neighbors_begin/neighbors_next
+ * Current Vertex is the starting vertex of the traversal
+ */
+struct data_to_thread
 {
-    struct Queue *queue = (struct Queue *)malloc(sizeof(struct Queue));
-    if (queue == NULL)
-    {
-        fprintf(stderr, "Memory allocation failed. Exiting program.\n");
-        exit(EXIT_FAILURE);
-    }
-    queue->front = -1;
-    queue->rear = -1;
-    return queue;
-}
+    struct msg_buffer *msg;
+    struct traversal_result *result;
+    int *number_of_nodes;
+    struct graph *graph;
+    struct dense_graph *dense;
+    int current_vertex;
+};
 
-int isEmpty(struct Queue *q)
+/**
+ * A worker thread of the secondary server, which handles one request at a time.
+ * The buffers of a traversal (result, BFS, DFS and batched BFS state) belong to the worker and are
+ * reused by every request it handles. They are only reallocated when a request is for a graph
+ * with more than capacity vertices.
+ */
+struct worker
 {
-    return q->front == -1;
-}
+    pthread_t thread;
+    int id;
+    int number_of_nodes;
+    int capacity;
+    struct traversal_result *result;
+    struct bfs bfs;
+    struct dfs dfs;
+    struct msbfs msbfs;
+    unsigned long requests;
+};
+
+// Levels of the request queue, interactive requests and batch requests
+#define REQUEST_LEVELS 2
+// Interactive requests taken in a row while a batch request waits, before the batch request goes
+#define INTERACTIVE_BURST 8
+
+struct request_level
+{
+    struct msg_buffer *items;
+    int head;
+    int count;
+};
+
+/**
+ * Bounded queue of the requests received by the main thread, taken by the workers in order.
+ * The main thread stops receiving messages while it is full, so a burst of requests waits in
+ * the message queue instead of creating threads.
+ * Interactive and batch requests wait in separate levels, and workers take interactive requests
+ * first. A batch request goes ahead after INTERACTIVE_BURST interactive ones, so it is never
+ * held off for good. All workers but one at most traverse batch requests, so an interactive
+ * request never waits for a heavy traversal to finish.
+ */
+struct request_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct request_level levels[REQUEST_LEVELS];
+    int capacity; // of each level
+    int stopping;
+    int batch_running;     // workers traversing a batch request
+    int max_batch_running; // workers that may traverse a batch request at once
+    int passed_over;       // interactive requests taken in a row while a batch request waited
+    unsigned long full;    // number of requests that had to wait for room
+    unsigned long taken[REQUEST_LEVELS];
+};
 
-int isFull(struct Queue *q)
+struct request_queue requests = {.lock = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER, .not_full = PTHREAD_COND_INITIALIZER};
+
+/**
+ * Entry of the graph cache, one per graph file: graph_name is the catalog_key of the graph, so
+ * G1 and G1.txt share an entry like they share the file.
+ * Dense graphs keep a bit matrix of the graph instead of its CSR arrays (dense.rows is NULL
+ * otherwise), bytes is the size of the mapping or of the bit matrix.
+ * Symmetric tells whether every edge has its reverse edge, which bottom-up BFS steps need. It
+ * is only checked the first time a direction-optimizing BFS runs on the entry, -1 until then.
+ * References is the number of requests currently traversing the graph. An entry that is
+ * evicted or replaced by a newer version while it is in use is unlinked from the cache
+ * and unmapped when the last of those requests releases it.
+ */
+struct cache_entry
 {
-    return q->rear == MAX_QUEUE_SIZE - 1;
+    char graph_name[CATALOG_NAME_LENGTH];
+    struct graph graph;
+    struct dense_graph dense;
+    size_t bytes;
+    int symmetric;
+    int references;
+    int linked;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+};
+
+/**
+ * The graph cache of this secondary server.
+ * Entries are kept in LRU order (head is the most recently used) and the total size of the
+ * mapped graphs is kept under budget bytes, which can be set with GRAPH_CACHE_BYTES.
+ */
+struct graph_cache
+{
+    pthread_mutex_t lock;
+    struct cache_entry *head;
+    struct cache_entry *tail;
+    size_t bytes;
+    size_t budget;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations;
+    unsigned long evictions;
+};
+
+struct graph_cache cache = {.lock = PTHREAD_MUTEX_INITIALIZER, .budget = GRAPH_CACHE_DEFAULT_BUDGET};
+
+// Which graphs get a bit matrix: DENSE_AUTO (only the dense ones), DENSE_ALWAYS or DENSE_NEVER.
+// Set with the DENSE_GRAPHS environment variable
+#define DENSE_AUTO 0
+#define DENSE_ALWAYS 1
+#define DENSE_NEVER 2
+int dense_mode = DENSE_AUTO;
+
+// Shared memory catalog with the latest version of every graph
+struct catalog *catalog;
+
+// Shared memory arena which holds the parameters of requests and the results of traversals
+struct arena *arena;
+
+// Transport the requests arrive on, the workers send their replies with it
+struct message_queue queue;
+
+// Load table of the load balancer, and the slot of this server in it where it reports the work it has left
+struct load_table *loads;
+struct server_load *load;
+
+// Set by SIGINT or SIGTERM, the server then deregisters and terminates once the load balancer tells it to
+volatile sig_atomic_t leaving = 0;
+
+void leave(int signal)
+{
+    (void)signal;
+    leaving = 1;
 }
 
-void enqueue(struct Queue *q, int value)
+/**
+ * @brief Registers the server with the load balancer, which assigns it a channel. The reply
+ * comes back on a queue of the server named after its pid, like the replies to a client, with
+ * the type REGISTRATION_REPLY_BASE + pid so that no client reply or channel can be mistaken for it.
+ *
+ * @param msg_queue_id
+ * @return the channel of the server, -1 if the load balancer has no slot left
+ */
+long register_with_load_balancer(int msg_queue_id)
 {
-    if (isFull(q))
+    struct message_queue registration;
+    if (message_queue_open(&registration, msg_queue_id, MESSAGE_QUEUE_CLIENT, sizeof(struct msg_buffer)) == -1)
     {
-        printf("Queue is full. Cannot enqueue.\n");
-        return;
+        perror("[Secondary Server] Error while opening the POSIX message queue");
+        exit(EXIT_FAILURE);
     }
 
-    if (isEmpty(q))
+    struct msg_buffer msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_type = LOAD_BALANCER_CHANNEL;
+    msg.data.operation = 6;
+    msg.data.client_id = getpid();
+    strcpy(msg.data.graph_name, "-");
+    if (message_queue_send(&registration, &msg, sizeof(msg.data)) == -1 || message_queue_flush(&registration) == -1)
     {
-        q->front = 0;
+        perror("[Secondary Server] Error while registering with the load balancer");
+        exit(EXIT_FAILURE);
     }
-
-    q->rear++;
-    q->items[q->rear] = value;
-    printf("Enqueued: %d\n", value);
+    while (message_queue_receive(&registration, &msg, sizeof(msg.data), REGISTRATION_REPLY_BASE + getpid()) == -1)
+    {
+        if (errno != EINTR)
+        {
+            perror("[Secondary Server] Error while waiting for the load balancer to register the server");
+            exit(EXIT_FAILURE);
+        }
+    }
+    message_queue_close(&registration);
+    return msg.data.seq_num;
 }
 
-int dequeue(struct Queue *q)
+// Threads that expand large BFS levels in parallel, shared by all workers
+struct traversal_pool pool;
+
+// Direction of the BFS requests that do not choose one, set with the BFS_DIRECTION environment variable
+int bfs_direction = BFS_DIRECTION_OPTIMIZING;
+
+// Most BFS requests on the same graph traversed in one pass, set with BFS_BATCH (1 turns batching off)
+int bfs_batch_size = MSBFS_MAX_SOURCES;
+
+/**
+ * @brief Maps a snapshot of the latest version of a graph. The version, the graph file and its
+ * delta file are pinned together while holding the read lock of the graph, which a writer only
+ * holds while it installs a new version. The files are then read without the lock: the graph
+ * file is never modified once written, and only the changes up to the pinned version are read
+ * from the delta file. If the graph has been modified since the file was written, the changes
+ * are merged into a copy of the graph. The mapped file is verified once the lock is given
+ * back, a truncated or corrupt file is rejected instead of being traversed.
+ *
+ * @param graph_name
+ * @param graph
+ * @return 0 on success, -1 if the graph file is corrupt
+ */
+int map_graph(const char *graph_name, struct graph *graph)
 {
-    int value;
+    // Choose an appropriate size for your filename
+    char filename[GRAPH_PATH_LENGTH];
+    // Graphs are stored in binary CSR files, G1.txt is stored as G1.csr
+    graph_storage_path(graph_name, filename, sizeof(filename));
+    char delta_filename[GRAPH_PATH_LENGTH];
+    graph_delta_path(graph_name, delta_filename, sizeof(delta_filename));
+
+    struct catalog_entry *lock = catalog_read_lock(catalog, graph_name);
+    if (lock == NULL)
+    {
+        fprintf(stderr, "[Secondary Server] Catalog is full, could not lock %s\n", graph_name);
+        exit(EXIT_FAILURE);
+    }
+    // The primary server publishes the version of every graph when it starts, so a graph only
+    // has no version before then, while nothing is being appended to its delta file. Every
+    // change in the file is then part of the snapshot.
+    uint64_t version = __atomic_load_n(&lock->version, __ATOMIC_ACQUIRE);
+    uint64_t max_generation = version != 0 ? version : UINT64_MAX;
+
+    // Map the graph file, the traversals run directly on the mapped pages. The mapping stays
+    // valid after a newer version is renamed over the file, the old file is only reclaimed
+    // once its last mapping is gone
+    int mapped = graph_map(filename, graph);
+    if (mapped == -1 && errno != EINVAL)
+    {
+        perror("[Seconday Server] Error while mapping the graph file");
+        exit(EXIT_FAILURE);
+    }
+    off_t delta_size = 0;
+    int delta_fd = mapped == 0 ? graph_delta_open(delta_filename, graph->generation, &delta_size) : -1;
+    catalog_unlock(lock);
 
-    if (isEmpty(q))
+    // The graph file never changes once it has been renamed into place, so it is verified without
+    // holding off the writers of the graph
+    if (mapped == -1 || graph_verify(graph) == -1)
     {
-        printf("Queue is empty. Cannot dequeue.\n");
+        if (mapped == 0)
+        {
+            graph_free(graph);
+        }
+        if (delta_fd != -1)
+        {
+            close(delta_fd);
+        }
+        fprintf(stderr, "[Secondary Server] %s is truncated or corrupt, it is not traversed\n", filename);
         return -1;
     }
+    printf("[Secondary Server] Successfully mapped the file %s (generation %lu)\n", filename, (unsigned long)graph->generation);
 
-    value = q->items[q->front];
-
-    if (q->front == q->rear)
+    struct graph_delta_record *records = NULL;
+    long number_of_changes = delta_fd == -1 ? 0 : graph_delta_read_open(delta_fd, delta_size, max_generation, &records);
+    if (number_of_changes == -1)
     {
-        q->front = q->rear = -1;
+        perror("[Secondary Server] Error while reading the delta file");
+        exit(EXIT_FAILURE);
+    }
+    if (number_of_changes > 0)
+    {
+        struct graph merged;
+        if (graph_apply_delta(graph, records, number_of_changes, &merged) == -1)
+        {
+            perror("[Secondary Server] Error while applying the delta file");
+            exit(EXIT_FAILURE);
+        }
+        graph_free(graph);
+        *graph = merged;
+        printf("[Secondary Server] Applied %ld changes from %s (version %lu)\n", number_of_changes, delta_filename, (unsigned long)graph->generation);
     }
+    free(records);
+    catalog_set_size(catalog, graph_name, (uint64_t)graph->number_of_nodes + graph->number_of_edges);
+    return 0;
+}
+
+/**
+ * @brief Unmaps the graph of an entry and frees it
+ */
+void cache_entry_free(struct cache_entry *entry)
+{
+    graph_free(&entry->graph);
+    dense_free(&entry->dense);
+    free(entry);
+}
+
+/**
+ * @brief Takes an entry out of the LRU list
+ */
+void cache_detach(struct cache_entry *entry)
+{
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        cache.head = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        cache.tail = entry->prev;
+}
+
+/**
+ * @brief Puts an entry at the head of the LRU list
+ */
+void cache_attach(struct cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache.head;
+    if (cache.head != NULL)
+        cache.head->prev = entry;
     else
+        cache.tail = entry;
+    cache.head = entry;
+}
+
+/**
+ * @brief Removes an entry from the cache. Must be called with the cache lock held.
+ * The entry is freed right away if no request is using it.
+ */
+void cache_unlink(struct cache_entry *entry)
+{
+    cache_detach(entry);
+    entry->linked = 0;
+    cache.bytes -= entry->bytes;
+    if (entry->references == 0)
     {
-        q->front++;
+        cache_entry_free(entry);
     }
+}
 
-    printf("Dequeued: %d\n", value);
-    return value;
+/**
+ * @brief Adds an entry at the head of the cache list. Must be called with the cache lock held.
+ */
+void cache_link(struct cache_entry *entry)
+{
+    cache_attach(entry);
+    entry->linked = 1;
+    cache.bytes += entry->bytes;
 }
 
-void display(struct Queue *q)
+/**
+ * @brief Evicts the least recently used graphs that are not in use until the cache is within
+ * its budget. Graphs that are in use are skipped, so the cache can be over budget until they
+ * are released. Must be called with the cache lock held.
+ */
+void cache_evict()
 {
-    if (isEmpty(q))
+    struct cache_entry *victim = cache.tail;
+    while (cache.bytes > cache.budget && victim != NULL)
     {
-        printf("Queue is empty.\n");
-        return;
+        struct cache_entry *prev = victim->prev;
+        if (victim->references == 0)
+        {
+            printf("[Secondary Server] Graph cache: evicting %s\n", victim->graph_name);
+            cache.evictions++;
+            cache_unlink(victim);
+        }
+        victim = prev;
     }
+}
 
-    printf("Queue elements: ");
-    for (int i = q->front; i <= q->rear; i++)
+/**
+ * @brief Finds a cached graph that is at least the given version. Stale entries found on the
+ * way are dropped. Must be called with the cache lock held.
+ *
+ * @param key catalog_key of the graph
+ * @param version
+ */
+struct cache_entry *cache_lookup(const char *key, uint64_t version)
+{
+    for (struct cache_entry *entry = cache.head; entry != NULL; entry = entry->next)
     {
-        printf("%d ", q->items[i]);
+        if (strcmp(entry->graph_name, key) == 0)
+        {
+            if (entry->graph.generation >= version)
+            {
+                return entry;
+            }
+            printf("[Secondary Server] Graph cache: %s generation %lu is stale, latest is %lu\n", key, (unsigned long)entry->graph.generation, (unsigned long)version);
+            cache.invalidations++;
+            cache_unlink(entry);
+            return NULL;
+        }
     }
-    printf("\n");
+    return NULL;
 }
 
-int queueSize(struct Queue *q)
+void cache_print_stats()
 {
-    if (isEmpty(q))
+    printf("[Secondary Server] Graph cache: %lu hits, %lu misses, %lu invalidations, %lu evictions, %zu/%zu bytes\n",
+           cache.hits, cache.misses, cache.invalidations, cache.evictions, cache.bytes, cache.budget);
+}
+
+/**
+ * @brief Returns the latest version of a graph from the cache, mapping it on a miss.
+ * The entry stays pinned until it is given back with cache_release.
+ *
+ * @param graph_name
+ * @return struct cache_entry*, NULL if the graph file is corrupt
+ */
+struct cache_entry *cache_acquire(const char *graph_name)
+{
+    // The version is read before the graph is mapped, so a write that lands in between
+    // can only make the new entry look older than it is, never newer
+    uint64_t version = catalog_version(catalog, graph_name);
+    char key[CATALOG_NAME_LENGTH];
+    catalog_key(graph_name, key, sizeof(key));
+
+    pthread_mutex_lock(&cache.lock);
+    struct cache_entry *entry = cache_lookup(key, version);
+    if (entry != NULL)
+    {
+        // Cache hit, move the entry to the head of the LRU list
+        cache.hits++;
+        entry->references++;
+        if (entry != cache.head)
+        {
+            cache_detach(entry);
+            cache_attach(entry);
+        }
+        cache_print_stats();
+        pthread_mutex_unlock(&cache.lock);
+        return entry;
+    }
+    cache.misses++;
+    pthread_mutex_unlock(&cache.lock);
+
+    // Cache miss, map the graph without holding the cache lock
+    entry = (struct cache_entry *)malloc(sizeof(struct cache_entry));
+    snprintf(entry->graph_name, sizeof(entry->graph_name), "%s", key);
+    entry->references = 1;
+    entry->symmetric = -1;
+    if (map_graph(graph_name, &entry->graph) == -1)
+    {
+        free(entry);
+        return NULL;
+    }
+    entry->bytes = entry->graph.mapping != NULL ? entry->graph.mapping_size
+                                                : (entry->graph.number_of_nodes + 1) * sizeof(uint64_t) + entry->graph.number_of_edges * sizeof(uint32_t);
+
+    // Dense graphs are traversed on a bit matrix instead of the CSR arrays
+    entry->dense.rows = NULL;
+    if (dense_mode == DENSE_ALWAYS || (dense_mode == DENSE_AUTO && dense_is_worthwhile(&entry->graph)))
     {
-        return 0;
+        if (dense_from_graph(&entry->graph, &entry->dense) == -1)
+        {
+            perror("[Secondary Server] Error while building the bit matrix");
+            exit(EXIT_FAILURE);
+        }
+        // The traversals only read the bit matrix now, the CSR arrays are released so the graph
+        // is not kept twice. The graph keeps its size and generation.
+        graph_free(&entry->graph);
+        entry->bytes = dense_bytes(entry->graph.number_of_nodes);
+        printf("[Secondary Server] Graph cache: %s is dense, using a %zu byte bit matrix (%s)\n", graph_name, dense_bytes(entry->graph.number_of_nodes), dense_isa);
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    // Another request may have mapped the same graph in the meantime
+    struct cache_entry *existing = cache_lookup(key, entry->graph.generation);
+    if (existing != NULL)
+    {
+        existing->references++;
+        cache_entry_free(entry);
+        entry = existing;
     }
     else
     {
-        return q->rear - q->front + 1;
+        cache_link(entry);
+        cache_evict();
     }
+    cache_print_stats();
+    pthread_mutex_unlock(&cache.lock);
+    return entry;
 }
 
 /**
- * Used to pass data to threads for BFS and dfs processing.
- * It includes a message queue ID and a message buffer.
- * Index is the index at which the next vertex number should be entered into graph_name[]
- * Number of nodes is the number of nodes in the graph.
- * Adjacency matrix is the adjacency matrix of the graph
- * Visited is an array to keep track of visited nodes.
- * Mutexlock to keep track of when we are editing the output i.e. graph_name[]
- * QueueLock to keep track of when BFS threads are editing the queue
- * Current Vertex to keep track of current vertex
- * BFS Queue is the queue used in BFS
+ * @brief Gives back an entry returned by cache_acquire
+ *
+ * @param entry
  */
-struct data_to_thread
+void cache_release(struct cache_entry *entry)
 {
-    int *msg_queue_id;
-    struct msg_buffer *msg;
-    int *index;
-    int *number_of_nodes;
-    int **adjacency_matrix;
-    int *visited;
-    pthread_mutex_t *mutexLock;
-    pthread_mutex_t *queueLock;
-    int current_vertex;
-    struct Queue *bfs_queue;
-};
+    pthread_mutex_lock(&cache.lock);
+    entry->references--;
+    if (!entry->linked && entry->references == 0)
+    {
+        cache_entry_free(entry);
+    }
+    else
+    {
+        cache_evict();
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
 
 /**
- * @brief Called by the thread on creation. Every child spawns the thread and calls this function for DFA task.
+ * @brief Cost of a traversal of a graph reported to the load balancer: its number of vertices
+ * plus its number of edges if it is in the cache, the average cost of a request otherwise
  *
- * @param arg
- * @return void*
+ * @param graph_name
+ * @return uint64_t
  */
-void *dfs_subthread(void *arg)
+uint64_t traversal_cost(const char *graph_name)
 {
-    struct data_to_thread *dtt = (struct data_to_thread *)arg;
+    char key[CATALOG_NAME_LENGTH];
+    catalog_key(graph_name, key, sizeof(key));
+    uint64_t cost = 0;
+    pthread_mutex_lock(&cache.lock);
+    for (struct cache_entry *entry = cache.head; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->graph_name, key) == 0)
+        {
+            cost = (uint64_t)entry->graph.number_of_nodes + entry->graph.number_of_edges;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return cost > 0 ? cost : load_average_cost(load);
+}
 
-    int currentVertex = dtt->current_vertex + 1;
-    printf("[Secondary Server] DFS Sub Thread: Current vertex: %d\n", currentVertex);
+/**
+ * @brief Allocates an empty result with room for every vertex of the graph
+ *
+ * @param number_of_nodes
+ * @return struct traversal_result*
+ */
+struct traversal_result *create_result(int number_of_nodes)
+{
+    struct traversal_result *result = (struct traversal_result *)malloc(sizeof(struct traversal_result));
+    if (result == NULL || (result->vertices = (uint32_t *)malloc((number_of_nodes > 0 ? number_of_nodes : 1) * sizeof(uint32_t))) == NULL)
+    {
+        perror("[Secondary Server] Error while allocating the result");
+        exit(EXIT_FAILURE);
+    }
+    result->length = 0;
+    return result;
+}
 
-    int flag = 0;
-    pthread_t dfs_thread_id[*dtt->number_of_nodes];
-    int threads[*dtt->number_of_nodes];
-    int threadIndex = 0;
+void free_result(struct traversal_result *result)
+{
+    free(result->vertices);
+    free(result);
+}
 
-    for (int i = 0; i < *dtt->number_of_nodes; i++)
+/**
+ * @brief Prepares the buffers of a worker for a traversal of a graph with number_of_nodes
+ * vertices, growing them if they are too small, and points the request at them
+ *
+ * @param worker
+ * @param dtt
+ * @param number_of_nodes
+ */
+void worker_reserve(struct worker *worker, struct data_to_thread *dtt, int number_of_nodes)
+{
+    if (number_of_nodes > worker->capacity)
     {
-        if ((dtt->adjacency_matrix[dtt->current_vertex][i] == 1) && (dtt->visited[i] == 0))
+        // Grow at least twice as large, so a worker serving growing graphs reallocates rarely
+        int capacity = number_of_nodes > 2 * worker->capacity ? number_of_nodes : 2 * worker->capacity;
+        if (worker->capacity > 0)
         {
-            flag = 1;
-            dtt->visited[i] = 1;
+            free_result(worker->result);
+        }
+        worker->result = create_result(capacity);
+        worker->capacity = capacity;
+        printf("[Secondary Server] Worker %d: buffers grown to %d vertices\n", worker->id, capacity);
+    }
 
-            struct data_to_thread *newdtt = malloc(sizeof(struct data_to_thread));
-            *newdtt = *dtt;
-            newdtt->current_vertex = i;
+    worker->result->length = 0;
+    worker->number_of_nodes = number_of_nodes;
 
-            pthread_create(&dfs_thread_id[i], NULL, dfs_subthread, (void *)newdtt);
-            threads[threadIndex++] = i;
-        }
-        else if ((i == (*dtt->number_of_nodes - 1)) && (flag == 0))
-        {
-            int leaf = dtt->current_vertex + 1;
-            printf("[Secondary Server] DFS Sub Thread: New Leaf: %d\n", leaf);
-            printf("[Secondary Server] DFS Sub Thread: Storing %d at Index: %d\n", leaf, *dtt->index);
+    dtt->result = worker->result;
+}
+
+/**
+ * @brief Level of the request queue a request waits in
+ */
+int request_level(const struct msg_buffer *msg)
+{
+    return msg->data.priority == PRIORITY_BATCH ? 1 : 0;
+}
 
-            pthread_mutex_lock(dtt->mutexLock);
-            dtt->msg->data.graph_name[*dtt->index] = (char)(leaf);
-            *dtt->index = *dtt->index + 1;
-            dtt->msg->data.graph_name[*dtt->index] = '*';
-            pthread_mutex_unlock(dtt->mutexLock);
+/**
+ * @brief Takes the BFS requests for graph_name out of the request queue, at most max of them,
+ * keeping the other requests in their order. They are traversed with a request that was already
+ * taken, so they are taken from both levels.
+ *
+ * @param queue
+ * @param graph_name
+ * @param batch
+ * @param max
+ * @return number of requests taken
+ */
+int request_queue_take_batch(struct request_queue *queue, const char *graph_name, struct msg_buffer *batch, int max)
+{
+    pthread_mutex_lock(&queue->lock);
+    int taken = 0;
+    for (int l = 0; l < REQUEST_LEVELS; l++)
+    {
+        struct request_level *level = &queue->levels[l];
+        int kept = 0;
+        for (int i = 0; i < level->count; i++)
+        {
+            struct msg_buffer *item = &level->items[(level->head + i) % queue->capacity];
+            if (taken < max && item->data.operation == 4 && strcmp(item->data.graph_name, graph_name) == 0)
+            {
+                batch[taken++] = *item;
+            }
+            else
+            {
+                level->items[(level->head + kept++) % queue->capacity] = *item;
+            }
         }
+        level->count = kept;
     }
-
-    // Join all the subthreads
-    for (int i = 0; i < threadIndex; i++)
+    if (taken > 0)
     {
-        pthread_join(dfs_thread_id[threads[i]], NULL);
+        pthread_cond_broadcast(&queue->not_full);
     }
+    pthread_mutex_unlock(&queue->lock);
+    return taken;
+}
 
-    // Exit the DFS thread
-    printf("[Secondary Server] DFS Sub Thread: Exiting DFS Thread\n");
-    pthread_exit(NULL);
+/**
+ * @brief Adds a request to its level of the request queue, waiting while the level is full
+ *
+ * @param queue
+ * @param msg
+ */
+void request_queue_push(struct request_queue *queue, const struct msg_buffer *msg)
+{
+    struct request_level *level = &queue->levels[request_level(msg)];
+    pthread_mutex_lock(&queue->lock);
+    if (level->count == queue->capacity)
+    {
+        queue->full++;
+    }
+    while (level->count == queue->capacity)
+    {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    level->items[(level->head + level->count) % queue->capacity] = *msg;
+    level->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
 }
 
 /**
- * @brief Will be called by the main thread of the secondary server to perform DFS
- * It will find the starting vertex from the shared memory and then perform DFS
+ * @brief Takes the next request from the request queue, waiting while there is none the worker
+ * may take. Batch requests must be given back with request_queue_finish.
  *
+ * @param queue
+ * @param msg
+ * @return 0 on success, -1 if the queue is empty and the server is terminating
+ */
+int request_queue_pop(struct request_queue *queue, struct msg_buffer *msg)
+{
+    struct request_level *interactive = &queue->levels[0];
+    struct request_level *batch = &queue->levels[1];
+    pthread_mutex_lock(&queue->lock);
+    while (1)
+    {
+        int batch_ready = batch->count > 0 && queue->batch_running < queue->max_batch_running;
+        struct request_level *level = NULL;
+        if (batch_ready && (interactive->count == 0 || queue->passed_over >= INTERACTIVE_BURST))
+        {
+            level = batch;
+            queue->batch_running++;
+            queue->passed_over = 0;
+            queue->taken[1]++;
+        }
+        else if (interactive->count > 0)
+        {
+            level = interactive;
+            queue->passed_over += batch->count > 0;
+            queue->taken[0]++;
+        }
+        if (level != NULL)
+        {
+            *msg = level->items[level->head];
+            level->head = (level->head + 1) % queue->capacity;
+            level->count--;
+            pthread_cond_signal(&queue->not_full);
+            pthread_mutex_unlock(&queue->lock);
+            return 0;
+        }
+        if (queue->stopping && interactive->count == 0 && batch->count == 0)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+}
+
+/**
+ * @brief Called by a worker once it has replied to a request taken with request_queue_pop
  *
- * @param arg
- * @return void*
+ * @param queue
+ * @param msg
  */
-void *dfs_mainthread(void *arg)
+void request_queue_finish(struct request_queue *queue, const struct msg_buffer *msg)
 {
-    struct data_to_thread *dtt = (struct data_to_thread *)arg;
+    if (request_level(msg) == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&queue->lock);
+    queue->batch_running--;
+    // A worker may be waiting for a batch request it could not take
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    // Connect to shared memory
-    key_t shm_key;
-    int shm_id;
-    int *shmptr;
+/**
+ * @brief Lets the workers exit once they have handled the requests left in the queue
+ *
+ * @param queue
+ */
+void request_queue_stop(struct request_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    // Generate key for the shared memory
-    // Here, we are using the seq_num as the key because
-    // we want to ensure that each request has a unique shared memory
-    while ((shm_key = ftok(".", dtt->msg->data.seq_num)) == -1)
+/**
+ * @brief Copies the result of a traversal into a block of the arena of its size and stores the
+ * handle and length of the block in the reply, so the size of the result does not depend on the
+ * size of the message. The client gives the block back once it has read it.
+ *
+ * @param dtt
+ */
+void store_result(struct data_to_thread *dtt)
+{
+    size_t bytes = dtt->result->length * sizeof(uint32_t);
+    int result_handle;
+    uint32_t *vertices = (uint32_t *)arena_lease(arena, bytes, &result_handle);
+    if (vertices == NULL)
+    {
+        perror("[Secondary Server] Error while leasing the result shared memory");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(vertices, dtt->result->vertices, bytes);
+    if (arena_unresolve(result_handle, vertices) == -1)
     {
-        perror("[Secondary Server] DFS Main Thread: Error while generating key for shared memory");
+        perror("[Secondary Server] Could not detach from the result shared memory");
         exit(EXIT_FAILURE);
     }
-    printf("[Secondary Server] Generated shared memory key %d\n", shm_key);
 
-    // Connect to the shared memory using the key
-    if ((shm_id = shmget(shm_key, sizeof(int), 0666)) < 0)
+    dtt->msg->data.result_handle = result_handle;
+    dtt->msg->data.result_length = dtt->result->length;
+}
+
+/**
+ * @brief Answers a traversal whose graph file is corrupt. The reply has the status -1 in its
+ * operation, like an invalid request answered by the primary server, and carries no result.
+ *
+ * @param msg
+ * @param thread name of the caller in the logs
+ */
+void reply_unreadable(struct msg_buffer *msg, const char *thread)
+{
+    msg->msg_type = msg->data.seq_num;
+    msg->data.operation = -1;
+    msg->data.result_handle = -1;
+    msg->data.result_length = 0;
+
+    printf("[Secondary Server] %s: %s could not be read, sending an error to the client %ld\n", thread, msg->data.graph_name, msg->msg_type);
+
+    load_client_done(loads, load, msg->data.client_id);
+    if (message_queue_reply(&queue, msg->data.client_id, msg, sizeof(struct data)) == -1)
     {
-        perror("[Secondary Server] DFS Main Thread: Error occurred while connecting to shm\n");
+        fprintf(stderr, "[Secondary Server] %s: Message could not be sent, please try again: %s\n", thread, strerror(errno));
         exit(EXIT_FAILURE);
     }
+}
+
+/**
+ * @brief Will be called by a worker thread of the secondary server to perform DFS
+ * It will find the starting vertex from the shared memory and then perform DFS
+ *
+ *
+ * @param worker
+ * @param msg
+ */
+void dfs_mainthread(struct worker *worker, struct msg_buffer *msg)
+{
+    struct data_to_thread request = {.msg = msg, .number_of_nodes = &worker->number_of_nodes};
+    struct data_to_thread *dtt = &request;
 
-    // Attach to the shared memory
-    if ((shmptr = (int *)shmat(shm_id, NULL, 0)) == (void *)-1)
+    // Find the parameters of the request in the arena
+    int *shmptr = (int *)arena_resolve(arena, dtt->msg->data.request_handle);
+    if (shmptr == NULL)
     {
-        perror("[Secondary Server] DFS Main Thread: Error in shmat \n");
+        perror("[Secondary Server] DFS Main Thread: Error while resolving the request parameters \n");
         exit(EXIT_FAILURE);
     }
 
     // Take input of vertex from shared memory
     dtt->current_vertex = *shmptr;
 
-    // Choose an appropriate size for your filename
-    char filename[250];
-    // Make sure the filename is null-terminated, and copy it to the 'filename' array
-    snprintf(filename, sizeof(filename), "%s", dtt->msg->data.graph_name);
-
-    // SEMAPHORE PART
-    char sema_name_rw[256];
-    snprintf(sema_name_rw, sizeof(sema_name_rw), "rw_%s", filename);
-    char sema_name_read[256];
-    snprintf(sema_name_read, sizeof(sema_name_read), "read_%s", filename);
-
-    // If O_CREAT is specified, and a semaphore with the given name already exists,
-    // then mode and value are ignored.
-    sem_t *rw_sem = sem_open(sema_name_rw, O_CREAT, 0644, 1);
-    sem_t *read_sem = sem_open(sema_name_read, O_CREAT, 0644, 1);
-    sem_t *read_count = sem_open("Assignment_Read_Count", O_CREAT, 0644, 0);
-
-    printf("[Secondary Server] Waiting for the semaphore to be available\n");
-    sem_wait(read_sem);
-    sem_post(read_count);
-    int current_readers = 0;
-    sem_getvalue(read_count, &current_readers);
-    if (current_readers == 1)
-        sem_wait(rw_sem);
-    sem_post(read_sem);
-
-    FILE *fptr = fopen(filename, "r");
-    if (fptr == NULL)
-    {
-        printf("[Seconday Server] DFS Main Thread: Error opening file");
-        exit(EXIT_FAILURE);
-    }
-    else
+    // Get the graph from the cache, it is only mapped again if a newer version was written
+    struct cache_entry *entry = cache_acquire(dtt->msg->data.graph_name);
+    if (entry == NULL)
     {
-        printf("[Secondary Server] Successfully opened the file %s\n", filename);
-        fscanf(fptr, "%d", dtt->number_of_nodes);
-
-        // Allocate space for adjacency matrix
-        dtt->adjacency_matrix = (int **)malloc((*dtt->number_of_nodes) * sizeof(int *));
-        for (int i = 0; i < (*dtt->number_of_nodes); i++)
-        {
-            dtt->adjacency_matrix[i] = (int *)malloc((*dtt->number_of_nodes) * sizeof(int));
-        }
-        for (int i = 0; i < (*dtt->number_of_nodes); i++)
+        reply_unreadable(dtt->msg, "DFS Main Thread");
+        if (arena_unresolve(dtt->msg->data.request_handle, shmptr) == -1)
         {
-            for (int j = 0; j < (*dtt->number_of_nodes); j++)
-            {
-                fscanf(fptr, "%d", &(dtt->adjacency_matrix[i][j]));
-            }
+            perror("[Secondary Server] DFS Main Thread: Could not detach from shared memory\n");
+            exit(EXIT_FAILURE);
         }
-        fclose(fptr);
-    }
-
-    printf("[Secondary Server] Releasing the semaphore\n");
-    sem_wait(read_sem);
-    sem_wait(read_count);
-    sem_getvalue(read_count, &current_readers);
-    if (current_readers == 0)
-        sem_post(rw_sem);
-    sem_post(read_sem);
-
-    // Allocate space for visited array
-    dtt->visited = (int *)malloc((*dtt->number_of_nodes) * sizeof(int));
-    for (int i = 0; i < *dtt->number_of_nodes; i++)
-    {
-        dtt->visited[i] = 0;
+        return;
     }
-    dtt->visited[dtt->current_vertex] = 1;
+    dtt->graph = &entry->graph;
+    dtt->dense = entry->dense.rows != NULL ? &entry->dense : NULL;
+    // The result is a buffer of the worker, its DFS state keeps the deques and the visited bitmap
+    worker_reserve(worker, dtt, dtt->graph->number_of_nodes);
+    struct dfs *dfs = &worker->dfs;
     int startingNode = dtt->current_vertex + 1;
 
     // Debug logs
-    printf("[Secondary Server] DFS Main Thread: Adjacency Matrix Read Successfully\n");
+    printf("[Secondary Server] DFS Main Thread: Graph Read Successfully\n");
     printf("[Secondary Server] DFS Main Thread: Number of nodes: %d\n", *dtt->number_of_nodes);
     printf("[Secondary Server] DFS Main Thread: Starting vertex: %d\n", startingNode);
 
-    // All the subthreads
-    pthread_t dfs_thread_id[*dtt->number_of_nodes];
-    int threads[*dtt->number_of_nodes];
-    int threadIndex = 0;
-    int currentVertex = dtt->current_vertex;
-
-    // flag variable to check if it's leaf or not
-    int flag = 0;
-    for (int i = 0; i < (*dtt->number_of_nodes); i++)
+    // Expand the DFS tree on the traversal threads, which steal subtrees from each other
+    if (dfs_begin(dfs, dtt->graph, dtt->dense, dtt->current_vertex) == -1)
     {
-        if ((dtt->adjacency_matrix[currentVertex][i] == 1) && (dtt->visited[i] == 0))
-        {
-            flag = 1;
-            dtt->visited[i] = 1;
-
-            struct data_to_thread *newdtt = malloc(sizeof(struct data_to_thread));
-            *newdtt = *dtt;
-            newdtt->current_vertex = i;
-
-            pthread_create(&dfs_thread_id[i], NULL, dfs_subthread, (void *)newdtt);
-            threads[threadIndex++] = i;
-        }
-        else if ((i == ((*dtt->number_of_nodes) - 1)) && (flag == 0))
+        if (errno != EINVAL)
         {
-            int leaf = dtt->current_vertex + 1;
-            printf("[Secondary Server] DFS Main Thread: New Leaf: %d\n", leaf);
-            printf("[Secondary Server] DFS Main Thread: Storing %d at Index: %d\n", leaf, *dtt->index);
-
-            pthread_mutex_lock(dtt->mutexLock);
-            dtt->msg->data.graph_name[*dtt->index] = (char)(leaf);
-            *dtt->index = *dtt->index + 1;
-            dtt->msg->data.graph_name[*dtt->index] = '*';
-            pthread_mutex_unlock(dtt->mutexLock);
+            perror("[Secondary Server] DFS Main Thread: Error while starting the DFS");
+            exit(EXIT_FAILURE);
         }
+        printf("[Secondary Server] DFS Main Thread: %d is not a vertex of the graph\n", startingNode);
     }
-
-    // Join all subthreads
-    for (int i = 0; i < threadIndex; i++)
+    else if (dfs_run(dfs) == -1)
     {
-        pthread_join(dfs_thread_id[threads[i]], NULL);
+        perror("[Secondary Server] DFS Main Thread: Error while expanding the DFS tree");
+        exit(EXIT_FAILURE);
     }
 
-    dtt->msg->data.graph_name[++(*dtt->index)] = '\0';
+    // Collect the leaves found by every thread, numbered from 1 like the client does
+    unsigned long expanded = 0;
+    unsigned long steals = 0;
+    for (int i = 0; i < pool.number_of_threads; i++)
+    {
+        struct dfs_deque *deque = &dfs->deques[i];
+        for (uint64_t j = 0; j < deque->number_of_leaves; j++)
+        {
+            dtt->result->vertices[dtt->result->length++] = deque->leaves[j] + 1;
+        }
+        expanded += deque->expanded;
+        steals += deque->steals;
+    }
+    printf("[Secondary Server] DFS Main Thread: %d leaves of %lu vertices in %lu rounds, %lu of them in parallel, %lu steals\n", dtt->result->length, expanded,
+           dfs->rounds, dfs->parallel_rounds, steals);
 
-    // Send the list of Leaf Nodes to the client via message queue
+    // Send the list of Leaf Nodes to the client, the message only says where to find it
+    store_result(dtt);
     dtt->msg->msg_type = dtt->msg->data.seq_num;
     dtt->msg->data.operation = 0;
 
-    printf("[Secondary Server] DFS Main Thread: Sending reply to the client %ld @ %d\n", dtt->msg->msg_type, *dtt->msg_queue_id);
+    printf("[Secondary Server] DFS Main Thread: Sending reply to the client %ld\n", dtt->msg->msg_type);
 
-    if (msgsnd(*dtt->msg_queue_id, dtt->msg, sizeof(struct data), 0) == -1)
+    load_client_done(loads, load, dtt->msg->data.client_id);
+    if (message_queue_reply(&queue, dtt->msg->data.client_id, dtt->msg, sizeof(struct data)) == -1)
     {
         perror("[Secondary Server] DFS Main Thread: Message could not be sent, please try again");
         exit(EXIT_FAILURE);
     }
 
-    // Detach from the shared memory
-    if (shmdt(shmptr) == -1)
+    // Stop using the parameters, the client gives the block back to the arena
+    if (arena_unresolve(dtt->msg->data.request_handle, shmptr) == -1)
     {
         perror("[Secondary Server] DFS Main Thread: Could not detach from shared memory\n");
         exit(EXIT_FAILURE);
     }
 
-    printf("[Secondary Server] DFS Main Thread: Freeing dtt\n");
-    free(dtt);
-
-    // Destroy mutexLock
-    if (pthread_mutex_destroy(dtt->mutexLock) != 0)
-    {
-        printf("[Secondary Server] BFS Main Thread: Error destroying mutexLock");
-    }
+    // Unmap the graph, the buffers are kept by the worker for its next request
+    cache_release(entry);
 
-    // Exit the DFS thread
     printf("[Secondary Server] DFS Main Thread: Exiting DFS Request\n");
     printf("[Secondary Server] Successfully Completed Operation 3\n");
-    pthread_exit(NULL);
-}
-
-/**
- * @brief Called by the thread on creation. Every child spawns the thread and calls this function for BFS task.
- *
- * @param arg
- * @return void*
- */
-void *bfs_subthread(void *arg)
-{
-    struct data_to_thread *dtt = (struct data_to_thread *)arg;
-
-    //  Lock
-    pthread_mutex_lock(dtt->mutexLock);
-    int node = dtt->current_vertex + 1;
-    dtt->msg->data.graph_name[*dtt->index] = (char)node;
-    *dtt->index = *dtt->index + 1;
-    dtt->msg->data.graph_name[*dtt->index] = '*';
-
-    // Unlock
-    pthread_mutex_unlock(dtt->mutexLock);
-    dtt->visited[dtt->current_vertex] = 1;
-
-    // Loop
-    for (int i = 0; i < *dtt->number_of_nodes; i++)
-    {
-        if ((dtt->adjacency_matrix[dtt->current_vertex][i] == 1) && (dtt->visited[i] == 0))
-        {
-            pthread_mutex_lock(dtt->queueLock);
-            enqueue((dtt->bfs_queue), i);
-            pthread_mutex_unlock(dtt->queueLock);
-        }
-    }
-
-    // Exit
-    printf("[Secondary Server] BFS Sub Thread: Exiting...");
-    pthread_exit(NULL);
 }
 
 /**
- * @brief Called by the main thread of secondary server for BFS task. Uses the starting vertex from the shared memory and performs dfs.
+ * @brief Called by a worker thread of secondary server for BFS task. Uses the starting vertex from the shared memory and performs dfs.
  *
- * @param arg
- * @return void*
+ * @param worker
+ * @param msg
  */
-void *bfs_mainthread(void *arg)
+void bfs_mainthread(struct worker *worker, struct msg_buffer *msg)
 {
-    struct data_to_thread *dtt = (struct data_to_thread *)arg;
+    struct data_to_thread request = {.msg = msg, .number_of_nodes = &worker->number_of_nodes};
+    struct data_to_thread *dtt = &request;
 
-    // Connect to shared memory
-    key_t shm_key;
-    int shm_id;
-    int *shmptr;
-
-    // Generate key for the shared memory
-    // Here, we are using the seq_num as the key because
-    // we want to ensure that each request has a unique shared memory
-    while ((shm_key = ftok(".", dtt->msg->data.seq_num)) == -1)
+    // Find the parameters of the request in the arena
+    int *shmptr = (int *)arena_resolve(arena, dtt->msg->data.request_handle);
+    if (shmptr == NULL)
     {
-        perror("[Secondary Server] BFS Main Thread: Error while generating key for shared memory");
+        perror("[Secondary Server] BFS Main Thread: Error while resolving the request parameters \n");
         exit(EXIT_FAILURE);
     }
-    printf("[Secondary Server] BFS Main Thread: Generated shared memory key %d\n", shm_key);
+    dtt->current_vertex = shmptr[0];
 
-    // Connect to the shared memory using the key
-    if ((shm_id = shmget(shm_key, sizeof(int), 0666)) < 0)
-    {
-        perror("[Secondary Server] BFS Main Thread: Error occurred while connecting to shm\n");
-        exit(EXIT_FAILURE);
-    }
-    // Attach to the shared memory
-    if ((shmptr = (int *)shmat(shm_id, NULL, 0)) == (void *)-1)
+    // The client may ask for the result to be streamed through a ring buffer as it is found
+    int ring_id = shmptr[1];
+    struct result_ring *ring = NULL;
+    if (ring_id != -1 && (ring = (struct result_ring *)shmat(ring_id, NULL, 0)) == (void *)-1)
     {
-        perror("[Secondary Server] BFS Main Thread: Error in shmat \n");
-        exit(EXIT_FAILURE);
-    }
-    dtt->current_vertex = *shmptr;
-    // Choose an appropriate size for your filename
-    char filename[250];
-    // Make sure the filename is null-terminated, and copy it to the 'filename' array
-    snprintf(filename, sizeof(filename), "%s", dtt->msg->data.graph_name);
-    // SEMAPHORE PART
-    char sema_name_rw[256];
-    snprintf(sema_name_rw, sizeof(sema_name_rw), "rw_%s", filename);
-    char sema_name_read[256];
-    snprintf(sema_name_read, sizeof(sema_name_read), "read_%s", filename);
-
-    // If O_CREAT is specified, and a semaphore with the given name already exists,
-    // then mode and value are ignored.
-    sem_t *rw_sem = sem_open(sema_name_rw, O_CREAT, 0644, 1);
-    sem_t *read_sem = sem_open(sema_name_read, O_CREAT, 0644, 1);
-    sem_t *read_count = sem_open("Assignment_Read_Count", O_CREAT, 0644, 200);
-
-    printf("[Secondary Server] Waiting for the semaphore to be available\n");
-    sem_wait(read_sem);
-    int current_readers = 0;
-    sem_post(read_count);
-    sem_getvalue(read_count, &current_readers);
-    if (current_readers == 1)
-        sem_wait(rw_sem);
-    sem_post(read_sem);
-
-    // Opening the Graph file to read the read the adjacency matrix
-    FILE *fptr = fopen(dtt->msg->data.graph_name, "r");
-    if (fptr == NULL)
-    {
-        printf("[Seconday Server] BFS Main Thread: Error opening file");
+        perror("[Secondary Server] BFS Main Thread: Error while attaching to the result ring");
         exit(EXIT_FAILURE);
     }
-    fscanf(fptr, "%d", dtt->number_of_nodes);
+    int streamed = 0;
 
-    // Allocate space for adjacency matrix
-    dtt->adjacency_matrix = (int **)malloc((*dtt->number_of_nodes) * sizeof(int *));
-    for (int i = 0; i < (*dtt->number_of_nodes); i++)
-    {
-        dtt->adjacency_matrix[i] = (int *)malloc((*dtt->number_of_nodes) * sizeof(int));
-    }
-    for (int i = 0; i < (*dtt->number_of_nodes); i++)
+    // The client may also pick the direction of the traversal, to compare the two
+    int direction = shmptr[2] != BFS_DEFAULT ? shmptr[2] : bfs_direction;
+
+    // Get the graph from the cache, it is only mapped again if a newer version was written
+    struct cache_entry *entry = cache_acquire(dtt->msg->data.graph_name);
+    if (entry == NULL)
     {
-        for (int j = 0; j < (*dtt->number_of_nodes); j++)
+        // A streaming client waits on the ring until it is finished
+        if (ring != NULL)
+        {
+            result_ring_finish(ring);
+            if (shmdt(ring) == -1)
+            {
+                perror("[Secondary Server] BFS Main Thread: Could not detach from the result ring");
+                exit(EXIT_FAILURE);
+            }
+        }
+        reply_unreadable(dtt->msg, "BFS Main Thread");
+        if (arena_unresolve(dtt->msg->data.request_handle, shmptr) == -1)
         {
-            fscanf(fptr, "%d", &(dtt->adjacency_matrix[i][j]));
+            perror("[Secondary Server] BFS Main Thread: Could not detach from shared memory\n");
+            exit(EXIT_FAILURE);
         }
+        return;
     }
-    fclose(fptr);
-
-    printf("[Secondary Server] Releasing the semaphore\n");
+    dtt->graph = &entry->graph;
+    dtt->dense = entry->dense.rows != NULL ? &entry->dense : NULL;
 
-    sem_wait(read_sem);
-    sem_wait(read_count);
-    sem_getvalue(read_count, &current_readers);
-    if (current_readers == 0)
-        sem_post(rw_sem);
-    sem_post(read_sem);
-
-    dtt->visited = (int *)malloc(*dtt->number_of_nodes * sizeof(int));
-    for (int i = 0; i < *dtt->number_of_nodes; i++)
+    // Bottom-up steps follow edges backwards, they would miss vertices of a directed graph
+    if (direction == BFS_DIRECTION_OPTIMIZING)
     {
-        dtt->visited[i] = 0;
+        int symmetric = __atomic_load_n(&entry->symmetric, __ATOMIC_RELAXED);
+        if (symmetric == -1)
+        {
+            symmetric = bfs_graph_is_symmetric(dtt->graph, dtt->dense);
+            __atomic_store_n(&entry->symmetric, symmetric, __ATOMIC_RELAXED);
+        }
+        if (!symmetric)
+        {
+            printf("[Secondary Server] BFS Main Thread: %s is directed, traversing it top-down\n", dtt->msg->data.graph_name);
+            direction = BFS_TOP_DOWN;
+        }
     }
+    // The result is a buffer of the worker, its BFS state keeps the order and the visited bitmap
+    worker_reserve(worker, dtt, dtt->graph->number_of_nodes);
+    struct bfs *bfs = &worker->bfs;
 
     int starting_vertex = dtt->current_vertex + 1;
-    dtt->visited[dtt->current_vertex] = 1;
 
     // Debugging
-    printf("[Secondary Server] BFS Main Thread: Adjacency Matrix Read Successfully\n");
+    printf("[Secondary Server] BFS Main Thread: Graph Read Successfully\n");
     printf("[Secondary Server] BFS Main Thread: Number of nodes: %d\n", *dtt->number_of_nodes);
     printf("[Secondary Server] BFS Main Thread: Starting vertex: %d\n", starting_vertex);
 
-    // push starting vertex into queue
-    enqueue((dtt->bfs_queue), dtt->current_vertex);
-    // printf("Entry in queue is: %d", starting_vertex);
-
-    while (!isEmpty((dtt->bfs_queue)))
+    // Expand the graph level by level, large levels are split across the traversal threads
+    long frontier = 1;
+    if (bfs_begin(bfs, dtt->graph, dtt->dense, dtt->current_vertex, direction) == -1)
     {
-        int entry = 0;
-        int queue_size = queueSize((dtt->bfs_queue));
-        printf("Queue size: %d\n", queue_size);
-        int array[queue_size];
-
-        // Copy entries into array, empty queue
-        while (!isEmpty(dtt->bfs_queue))
+        if (errno != EINVAL)
         {
-            array[entry++] = dequeue((dtt->bfs_queue));
+            perror("[Secondary Server] BFS Main Thread: Error while starting the BFS");
+            exit(EXIT_FAILURE);
+        }
+        printf("[Secondary Server] BFS Main Thread: %d is not a vertex of the graph\n", starting_vertex);
+        frontier = 0;
+    }
+    while (frontier > 0)
+    {
+        // Number the vertices of the level from 1 like the client does
+        for (uint64_t i = bfs->frontier_begin; i < bfs->frontier_end; i++)
+        {
+            dtt->result->vertices[dtt->result->length++] = bfs->order[i] + 1;
         }
 
-        pthread_t subthread_ids[queue_size];
-        int threads[queue_size];
-        int threadIndex = 0;
-
-        for (int i = 0; i < queue_size; i++)
+        // Stream this level to the client before starting on the next one
+        if (ring != NULL && streamed != -1)
         {
-            struct data_to_thread *newdtt = malloc(sizeof(struct data_to_thread));
-            *newdtt = *dtt;
-            newdtt->current_vertex = array[i];
-            pthread_create(&subthread_ids[i], NULL, bfs_subthread, (void *)newdtt);
-            threads[threadIndex++] = i;
+            if (result_ring_push(ring, ring_id, dtt->result->vertices + streamed, dtt->result->length - streamed) == -1)
+            {
+                printf("[Secondary Server] BFS Main Thread: The client stopped reading the result\n");
+                streamed = -1;
+            }
+            else
+            {
+                streamed = dtt->result->length;
+            }
         }
 
-        // Join all the subthreads
-        for (int i = 0; i < threadIndex; i++)
+        if ((frontier = bfs_next_level(bfs)) == -1)
         {
-            pthread_join(subthread_ids[threads[i]], NULL);
+            perror("[Secondary Server] BFS Main Thread: Error while expanding a level");
+            exit(EXIT_FAILURE);
         }
     }
+    printf("[Secondary Server] BFS Main Thread: %d vertices in %lu levels, %lu of them in parallel, %lu bottom-up\n", dtt->result->length, (unsigned long)bfs->levels,
+           (unsigned long)bfs->parallel_levels, (unsigned long)bfs->bottom_up_levels);
 
-    dtt->msg->data.graph_name[++(*dtt->index)] = '\0';
-
-    // Sending shit to client
+    // Send the BFS order to the client, the message only says where to find it.
+    // A streamed result has already been delivered, the reply only carries its length.
+    if (ring != NULL)
+    {
+        result_ring_finish(ring);
+        if (shmdt(ring) == -1)
+        {
+            perror("[Secondary Server] BFS Main Thread: Could not detach from the result ring");
+            exit(EXIT_FAILURE);
+        }
+        dtt->msg->data.result_handle = -1;
+        dtt->msg->data.result_length = dtt->result->length;
+    }
+    else
+    {
+        store_result(dtt);
+    }
     dtt->msg->msg_type = dtt->msg->data.seq_num;
     dtt->msg->data.operation = 0;
 
-    printf("[Secondary Server] BFS Main Thread: Sending reply to the client %ld @ %d\n", dtt->msg->msg_type, *dtt->msg_queue_id);
+    printf("[Secondary Server] BFS Main Thread: Sending reply to the client %ld\n", dtt->msg->msg_type);
 
-    if (msgsnd(*dtt->msg_queue_id, dtt->msg, sizeof(struct data), 0) == -1)
+    load_client_done(loads, load, dtt->msg->data.client_id);
+    if (message_queue_reply(&queue, dtt->msg->data.client_id, dtt->msg, sizeof(struct data)) == -1)
     {
         perror("[Secondary Server] BFS Main Thread: Message could not be sent, please try again");
         exit(EXIT_FAILURE);
     }
 
-    // Detach from the shared memory
-    if (shmdt(shmptr) == -1)
+    // Stop using the parameters, the client gives the block back to the arena
+    if (arena_unresolve(dtt->msg->data.request_handle, shmptr) == -1)
     {
         perror("[Secondary Server] BFS Main Thread: Could not detach from shared memory\n");
         exit(EXIT_FAILURE);
     }
 
-    // Free the structs
-    printf("[Secondary Server] BFS Main Thread: Freeing dtt\n");
-    free(dtt);
+    // Unmap the graph, the buffers are kept by the worker for its next request
+    cache_release(entry);
+
+    printf("[Secondary Server] BFS Main Thread: Exiting...\n");
+    printf("[Secondary Server] Successfully Completed Operation 4\n");
+}
+
+/**
+ * @brief Called by a worker thread for several BFS requests on the same graph. The ones that
+ * leave the direction to the server and do not stream their result are traversed in a single
+ * multi-source pass over one version of the graph, and each client gets the order of its own
+ * starting vertex. The other ones are handled one by one by bfs_mainthread.
+ *
+ * @param worker
+ * @param batch
+ * @param count
+ */
+void bfs_batchthread(struct worker *worker, struct msg_buffer *batch, int count)
+{
+    struct msg_buffer *members[MSBFS_MAX_SOURCES];
+    int *parameters[MSBFS_MAX_SOURCES];
+    uint32_t sources[MSBFS_MAX_SOURCES];
+    int number_of_sources = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int *shmptr = (int *)arena_resolve(arena, batch[i].data.request_handle);
+        if (shmptr == NULL)
+        {
+            perror("[Secondary Server] BFS Batch: Error while resolving the request parameters \n");
+            exit(EXIT_FAILURE);
+        }
+        if (shmptr[1] == -1 && shmptr[2] == BFS_DEFAULT)
+        {
+            members[number_of_sources] = &batch[i];
+            parameters[number_of_sources] = shmptr;
+            sources[number_of_sources++] = (uint32_t)shmptr[0];
+            continue;
+        }
+        if (arena_unresolve(batch[i].data.request_handle, shmptr) == -1)
+        {
+            perror("[Secondary Server] BFS Batch: Could not detach from shared memory\n");
+            exit(EXIT_FAILURE);
+        }
+        bfs_mainthread(worker, &batch[i]);
+    }
+    if (number_of_sources == 0)
+    {
+        return;
+    }
+
+    // Get the graph from the cache once for the whole batch
+    struct cache_entry *entry = cache_acquire(members[0]->data.graph_name);
+
+    // With nothing to share the pass with, or a graph too small for it to pay, each request
+    // is traversed on its own and keeps the order of a top-down BFS. A graph that could not be
+    // read is answered with an error by each of them.
+    if (entry == NULL || number_of_sources == 1 || entry->graph.number_of_nodes < MSBFS_MIN_VERTICES)
+    {
+        if (entry != NULL)
+        {
+            cache_release(entry);
+        }
+        for (int i = 0; i < number_of_sources; i++)
+        {
+            if (arena_unresolve(members[i]->data.request_handle, parameters[i]) == -1)
+            {
+                perror("[Secondary Server] BFS Batch: Could not detach from shared memory\n");
+                exit(EXIT_FAILURE);
+            }
+            bfs_mainthread(worker, members[i]);
+        }
+        return;
+    }
+    struct msbfs *msbfs = &worker->msbfs;
+    if (msbfs_begin(msbfs, &entry->graph, entry->dense.rows != NULL ? &entry->dense : NULL, sources, number_of_sources) == -1)
+    {
+        perror("[Secondary Server] BFS Batch: Error while starting the BFS");
+        exit(EXIT_FAILURE);
+    }
+    long active = 1;
+    while (active > 0)
+    {
+        if ((active = msbfs_next_level(msbfs)) == -1)
+        {
+            perror("[Secondary Server] BFS Batch: Error while expanding a level");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("[Secondary Server] BFS Batch: %d requests on %s in %lu levels, %lu of them in parallel\n", number_of_sources, members[0]->data.graph_name,
+           (unsigned long)msbfs->levels, (unsigned long)msbfs->parallel_levels);
 
-    // Destroy mutexLock
-    if (pthread_mutex_destroy(dtt->mutexLock) != 0)
+    // Send every client the order of its own starting vertex
+    for (int i = 0; i < number_of_sources; i++)
     {
-        printf("[Secondary Server] BFS Main Thread: Error destroying mutexLock");
+        struct data_to_thread request = {.msg = members[i], .number_of_nodes = &worker->number_of_nodes};
+        struct data_to_thread *dtt = &request;
+        worker_reserve(worker, dtt, entry->graph.number_of_nodes);
+        if (sources[i] >= entry->graph.number_of_nodes)
+        {
+            printf("[Secondary Server] BFS Batch: %u is not a vertex of the graph\n", sources[i] + 1);
+        }
+        for (uint64_t j = 0; j < msbfs->orders[i].length; j++)
+        {
+            dtt->result->vertices[dtt->result->length++] = msbfs->orders[i].vertices[j] + 1;
+        }
+        store_result(dtt);
+        dtt->msg->msg_type = dtt->msg->data.seq_num;
+        dtt->msg->data.operation = 0;
+
+        printf("[Secondary Server] BFS Batch: Sending reply to the client %ld\n", dtt->msg->msg_type);
+
+        load_client_done(loads, load, dtt->msg->data.client_id);
+        if (message_queue_reply(&queue, dtt->msg->data.client_id, dtt->msg, sizeof(struct data)) == -1)
+        {
+            perror("[Secondary Server] BFS Batch: Message could not be sent, please try again");
+            exit(EXIT_FAILURE);
+        }
+        if (arena_unresolve(dtt->msg->data.request_handle, parameters[i]) == -1)
+        {
+            perror("[Secondary Server] BFS Batch: Could not detach from shared memory\n");
+            exit(EXIT_FAILURE);
+        }
+        printf("[Secondary Server] Successfully Completed Operation 4\n");
     }
 
-    // Destroy queueLock
-    if (pthread_mutex_destroy(dtt->queueLock) != 0)
+    cache_release(entry);
+}
+
+/**
+ * @brief Worker thread, handles the requests of the request queue until the server
+ * terminates, BFS requests for the same graph in batches
+ *
+ * @param arg the worker
+ * @return void*
+ */
+void *worker_thread(void *arg)
+{
+    struct worker *worker = (struct worker *)arg;
+    struct msg_buffer msg;
+    while (request_queue_pop(&requests, &msg) == 0)
     {
-        printf("[Secondary Server] BFS Main Thread: Error destroying queueLock");
+        printf("[Secondary Server] Worker %d: Op: %ld File Name: %s\n", worker->id, msg.data.operation, msg.data.graph_name);
+        // Tell the load balancer how much work the traversal adds until it is done
+        uint64_t cost = traversal_cost(msg.data.graph_name);
+        if (msg.data.operation == 3)
+        {
+            load_begin(load, 1, cost);
+            dfs_mainthread(worker, &msg);
+            load_end(load, 1, cost, traversal_cost(msg.data.graph_name));
+            request_queue_finish(&requests, &msg);
+            worker->requests++;
+            continue;
+        }
+
+        // Other BFS requests waiting for the same graph are traversed together with this one
+        struct msg_buffer batch[MSBFS_MAX_SOURCES];
+        batch[0] = msg;
+        int count = 1;
+        if (bfs_batch_size > 1)
+        {
+            count += request_queue_take_batch(&requests, msg.data.graph_name, batch + 1, bfs_batch_size - 1);
+        }
+        load_begin(load, count, cost);
+        if (count > 1)
+        {
+            bfs_batchthread(worker, batch, count);
+        }
+        else
+        {
+            bfs_mainthread(worker, &msg);
+        }
+        load_end(load, count, cost, traversal_cost(msg.data.graph_name));
+        request_queue_finish(&requests, &msg);
+        worker->requests += count;
     }
 
-    // Exit the BFS thread
-    printf("[Secondary Server] BFS Main Thread: Exiting...\n");
-    printf("[Secondary Server] Successfully Completed Operation 4\n");
+    if (worker->capacity > 0)
+    {
+        free_result(worker->result);
+    }
+    bfs_free(&worker->bfs);
+    dfs_free(&worker->dfs);
+    msbfs_free(&worker->msbfs);
     pthread_exit(NULL);
 }
 
@@ -685,147 +1361,224 @@ int main()
     }
     printf("[Secondary Server] Successfully connected to the Message Queue with Key:%d ID:%d\n", key, msg_queue_id);
 
-    // Store the thread_ids thread
-    pthread_t thread_ids[200];
-    int threads[200];
-    int threadIndex = 0;
+    // Attach to the graph catalog created by the load balancer
+    if ((catalog = catalog_attach()) == NULL)
+    {
+        perror("[Secondary Server] Error while attaching to the graph catalog");
+        exit(EXIT_FAILURE);
+    }
 
-    int channel;
-    printf("[Secondary Server] Enter the channel number: ");
-    scanf("%d", &channel);
-    if (channel == 1)
+    // Attach to the shared memory arena created by the load balancer
+    if ((arena = arena_attach()) == NULL)
     {
-        channel = SECONDARY_SERVER_CHANNEL_1;
+        perror("[Secondary Server] Error while attaching to the shared memory arena");
+        exit(EXIT_FAILURE);
     }
-    else
+
+    // Size of the graph cache
+    char *cache_budget = getenv("GRAPH_CACHE_BYTES");
+    if (cache_budget != NULL)
+    {
+        cache.budget = strtoul(cache_budget, NULL, 10);
+    }
+    printf("[Secondary Server] Graph cache budget: %zu bytes\n", cache.budget);
+
+    // Which graphs are traversed on a bit matrix
+    char *dense_graphs = getenv("DENSE_GRAPHS");
+    if (dense_graphs != NULL && strcmp(dense_graphs, "always") == 0)
+    {
+        dense_mode = DENSE_ALWAYS;
+    }
+    else if (dense_graphs != NULL && strcmp(dense_graphs, "never") == 0)
+    {
+        dense_mode = DENSE_NEVER;
+    }
+
+    // Only the main thread handles SIGINT and SIGTERM, every thread started from here on blocks them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // Number of worker threads and size of the request queue
+    int number_of_workers = DEFAULT_WORKERS;
+    char *workers_setting = getenv("SECONDARY_WORKERS");
+    if (workers_setting != NULL && atoi(workers_setting) > 0)
+    {
+        number_of_workers = atoi(workers_setting);
+    }
+    requests.capacity = DEFAULT_REQUEST_QUEUE_SIZE;
+    char *queue_setting = getenv("REQUEST_QUEUE_SIZE");
+    if (queue_setting != NULL && atoi(queue_setting) > 0)
+    {
+        requests.capacity = atoi(queue_setting);
+    }
+    for (int i = 0; i < REQUEST_LEVELS; i++)
+    {
+        requests.levels[i].items = (struct msg_buffer *)malloc(requests.capacity * sizeof(struct msg_buffer));
+    }
+    // One worker is always left for interactive requests, unless there is only one
+    requests.max_batch_running = number_of_workers > 1 ? number_of_workers - 1 : 1;
+    struct worker *workers = (struct worker *)calloc(number_of_workers, sizeof(struct worker));
+    if (requests.levels[0].items == NULL || requests.levels[1].items == NULL || workers == NULL)
+    {
+        perror("[Secondary Server] Error while allocating the workers");
+        exit(EXIT_FAILURE);
+    }
+
+    // Threads that expand large BFS levels, one per CPU by default
+    char *traversal_setting = getenv("TRAVERSAL_THREADS");
+    if (traversal_pool_start(&pool, traversal_setting != NULL ? atoi(traversal_setting) : 0) == -1)
+    {
+        perror("[Secondary Server] Error while starting the traversal threads");
+        exit(EXIT_FAILURE);
+    }
+
+    // Largest batch of BFS requests traversed in one pass
+    char *batch_setting = getenv("BFS_BATCH");
+    if (batch_setting != NULL && atoi(batch_setting) > 0)
+    {
+        bfs_batch_size = atoi(batch_setting) < MSBFS_MAX_SOURCES ? atoi(batch_setting) : MSBFS_MAX_SOURCES;
+    }
+
+    // Direction of the BFS requests that leave it to the server
+    char *direction_setting = getenv("BFS_DIRECTION");
+    if (direction_setting != NULL && strcmp(direction_setting, "top-down") == 0)
+    {
+        bfs_direction = BFS_TOP_DOWN;
+    }
+
+    // Attach to the table the load balancer routes reads with
+    if ((loads = load_table_attach()) == NULL)
+    {
+        perror("[Secondary Server] Error while attaching to the load table");
+        exit(EXIT_FAILURE);
+    }
+
+    // The load balancer assigns the channel, and routes reads to the server from now on
+    long channel = register_with_load_balancer(msg_queue_id);
+    if (channel == -1)
+    {
+        printf("[Secondary Server] The load balancer has no channel left for another Secondary Server\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("[Secondary Server] Registered as Secondary Server %ld, using Channel: %ld\n", channel - SECONDARY_SERVER_CHANNEL_1 + 1, channel);
+    load = &loads->servers[channel - SECONDARY_SERVER_CHANNEL_1];
+    if (message_queue_open(&queue, msg_queue_id, channel, sizeof(struct msg_buffer)) == -1)
+    {
+        perror("[Secondary Server] Error while opening the POSIX message queue");
+        exit(EXIT_FAILURE);
+    }
+
+    // Start the workers, they handle every request from now on
+    for (int i = 0; i < number_of_workers; i++)
+    {
+        workers[i].id = i;
+        bfs_init(&workers[i].bfs, &pool);
+        dfs_init(&workers[i].dfs, &pool);
+        msbfs_init(&workers[i].msbfs, &pool);
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, (void *)&workers[i]) != 0)
+        {
+            perror("[Secondary Server] Error in worker thread creation");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("[Secondary Server] Started %d workers with a request queue of %d and %d traversal threads\n", number_of_workers, requests.capacity, pool.number_of_threads);
+
+    // SIGINT and SIGTERM interrupt the main thread, which then deregisters the server
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = leave;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGINT, &action, NULL) == -1 || sigaction(SIGTERM, &action, NULL) == -1 ||
+        pthread_sigmask(SIG_UNBLOCK, &signals, NULL) != 0)
     {
-        channel = SECONDARY_SERVER_CHANNEL_2;
+        perror("[Secondary Server] Error while handling termination signals");
+        exit(EXIT_FAILURE);
     }
+    int deregistered = 0;
 
-    printf("[Secondary Server] Using Channel: %d\n", channel);
     // Listen to the message queue for new requests from the clients
     while (1)
     {
-        struct data_to_thread *dtt = (struct data_to_thread *)malloc(sizeof(struct data_to_thread)); // Declare dtt here
-        struct msg_buffer *msg = (struct msg_buffer *)malloc(sizeof(struct msg_buffer));
+        struct msg_buffer msg;
 
-        if (msgrcv(msg_queue_id, msg, sizeof(msg->data), channel, 0) == -1)
+        if (leaving && !deregistered)
         {
-            perror("[Secondary Server] Error while receiving message from the client");
-            exit(EXIT_FAILURE);
+            // Ask the load balancer to stop sending reads, it answers with a termination message
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_type = LOAD_BALANCER_CHANNEL;
+            msg.data.seq_num = channel;
+            msg.data.operation = 7;
+            strcpy(msg.data.graph_name, "-");
+            if (message_queue_send(&queue, &msg, sizeof(msg.data)) == -1)
+            {
+                perror("[Secondary Server] Error while deregistering from the load balancer");
+            }
+            printf("[Secondary Server] Deregistering, finishing the reads already sent\n");
+            deregistered = 1;
+        }
+
+        if (message_queue_receive(&queue, &msg, sizeof(msg.data), channel) == -1)
+        {
+            // A signal interrupts the wait so that the server can deregister
+            if (errno != EINTR)
+            {
+                perror("[Secondary Server] Error while receiving message from the client");
+                exit(EXIT_FAILURE);
+            }
         }
         else
         {
-            printf("[Secondary Server] Received a message from Client: Op: %ld File Name: %s\n", msg->data.operation, msg->data.graph_name);
+            printf("[Secondary Server] Received a message from Client: Op: %ld File Name: %s\n", msg.data.operation, msg.data.graph_name);
 
-            if (msg->data.operation == 3)
+            if (msg.data.operation == 3 || msg.data.operation == 4)
             {
-                // Operation code for DFS request
-                // Create a data_to_thread structure
-                dtt->msg_queue_id = (int *)malloc(sizeof(int));
-                dtt->msg = (struct msg_buffer *)malloc(sizeof(struct msg_buffer));
-                dtt->index = (int *)malloc(sizeof(int));
-                *dtt->index = 0;
-                dtt->number_of_nodes = (int *)malloc(sizeof(int));
-
-                dtt->mutexLock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
-                if (pthread_mutex_init(dtt->mutexLock, NULL) != 0)
-                {
-                    perror("[Secondary Server] Error initializing mutexLock");
-                    exit(EXIT_FAILURE);
-                }
-
-                *dtt->msg_queue_id = msg_queue_id;
-                dtt->msg = msg;
-
-                // Determine the channel based on seq_num
-                int channel;
-                if (msg->data.seq_num % 2 == 1)
-                {
-                    channel = SECONDARY_SERVER_CHANNEL_1;
-                }
-                else
-                {
-                    channel = SECONDARY_SERVER_CHANNEL_2;
-                }
-
-                // Set the channel in the message structure
-                dtt->msg->msg_type = channel;
-
-                // Create a new thread to handle BFS
-                if (pthread_create(&thread_ids[msg->data.seq_num], NULL, dfs_mainthread, (void *)dtt) != 0)
-                {
-                    perror("[Secondary Server] Error in DFS thread creation");
-                    exit(EXIT_FAILURE);
-                }
-                threads[threadIndex++] = msg->data.seq_num;
+                // DFS or BFS request, handed to the first free worker
+                load_client_taken(load, msg.data.client_id);
+                request_queue_push(&requests, &msg);
             }
-            else if (msg->data.operation == 4)
+            else if (msg.data.operation == 5)
             {
-                // Operation code for BFS request
-                // Create a data_to_thread structure
-                dtt->msg_queue_id = (int *)malloc(sizeof(int));
-                dtt->msg = (struct msg_buffer *)malloc(sizeof(struct msg_buffer));
-                dtt->index = (int *)malloc(sizeof(int));
-                *dtt->index = 0;
-                dtt->number_of_nodes = (int *)malloc(sizeof(int));
-
-                dtt->mutexLock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
-                if (pthread_mutex_init(dtt->mutexLock, NULL) != 0)
+                // Operation code for cleanup, let the workers finish the queued requests
+                request_queue_stop(&requests);
+                for (int i = 0; i < number_of_workers; i++)
                 {
-                    perror("[Secondary Server] Error initializing mutexLock");
-                    exit(EXIT_FAILURE);
-                }
-
-                dtt->queueLock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
-                if (pthread_mutex_init(dtt->queueLock, NULL) != 0)
-                {
-                    perror("[Secondary Server] Error initializing queueLock");
-                    exit(EXIT_FAILURE);
+                    if (pthread_join(workers[i].thread, NULL) != 0)
+                    {
+                        perror("[Secondary Server] Error joining thread");
+                    }
+                    printf("[Secondary Server] Worker %d handled %lu requests, buffers for %d vertices\n", i, workers[i].requests, workers[i].capacity);
                 }
+                printf("[Secondary Server] Request queue was full %lu times, %lu interactive and %lu batch requests were taken from it\n", requests.full, requests.taken[0], requests.taken[1]);
+                printf("[Secondary Server] Traversal threads ran %lu parallel jobs\n", pool.jobs);
+                traversal_pool_stop(&pool);
 
-                dtt->bfs_queue = createQueue();
-
-                *dtt->msg_queue_id = msg_queue_id;
-                dtt->msg = msg;
-
-                // Determine the channel based on seq_num
-                int channel;
-                if (msg->data.seq_num % 2 == 1)
-                {
-                    channel = SECONDARY_SERVER_CHANNEL_1;
-                }
-                else
+                free(workers);
+                for (int i = 0; i < REQUEST_LEVELS; i++)
                 {
-                    channel = SECONDARY_SERVER_CHANNEL_2;
+                    free(requests.levels[i].items);
                 }
-
-                // Set the channel in the message structure
-                dtt->msg->msg_type = channel;
-
-                // Create a new thread to handle BFS
-                if (pthread_create(&thread_ids[msg->data.seq_num], NULL, bfs_mainthread, (void *)dtt) != 0)
+                cache_print_stats();
+                if (queue.posix)
                 {
-                    perror("[Secondary Server] Error in BFS thread creation");
-                    exit(EXIT_FAILURE);
+                    printf("[Secondary Server] %lu replies dropped, their client was gone\n", queue.dropped);
                 }
-                threads[threadIndex++] = msg->data.seq_num;
-            }
-            else if (msg->data.operation == 5)
-            {
-                // Operation code for cleanup
-                for (int i = 0; i < threadIndex; i++)
+                // Every request has been replied to, acknowledge the termination message
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_type = LOAD_BALANCER_CHANNEL;
+                msg.data.seq_num = channel;
+                msg.data.operation = 8;
+                msg.data.client_id = getpid();
+                strcpy(msg.data.graph_name, "-");
+                if (message_queue_send(&queue, &msg, sizeof(msg.data)) == -1 || message_queue_flush(&queue) == -1)
                 {
-                    // printf("Attempting to Clean: %d %lu\n", i, thread_ids[i]);
-                    if (thread_ids[threads[i]] != 0)
-                    {
-                        if (pthread_join(thread_ids[threads[i]], NULL) != 0)
-                        {
-                            perror("[Secondary Server] Error joining thread");
-                        }
-                    }
+                    perror("[Secondary Server] Error while acknowledging the termination message");
                 }
-
+                message_queue_close(&queue);
+                // The slot is free for the next Secondary Server now that nothing is left on the channel
+                __atomic_store_n(&load->pid, 0, __ATOMIC_RELEASE);
                 printf("[Secondary Server] Terminating...\n");
                 exit(EXIT_SUCCESS);
             }
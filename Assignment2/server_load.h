@@ -0,0 +1,407 @@
+/**
+ * @file server_load.h
+ * @brief Shared memory table of the load of the secondary servers, used to route reads
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * The load balancer creates the table and every secondary server attaches it. A secondary
+ * server registers with the load balancer when it starts, and gets a free slot of the table and
+ * the channel of that slot. The load balancer writes the pid of the server into the slot, and the
+ * server clears it when it terminates, so the slot stays taken until then.
+ *
+ * The load balancer counts the requests it sends to a server, and the server counts the
+ * requests it has completed, how many it is traversing right now and what those traversals
+ * cost. The cost of a traversal is the number of vertices plus the number of edges of its graph.
+ * Each counter has a single writer and is updated with atomics, so neither side ever takes a
+ * lock.
+ *
+ * The requests sent to a server that it has not completed are outstanding. Those it has not
+ * started yet, in its message queue or its request queue, are expected to cost as much as its
+ * average completed request. The work of a server is the cost of its traversals plus that
+ * estimate for its waiting requests, and load_pick sends a read to the server with the least
+ * work among two picked at random (power of two choices).
+ *
+ * load_ring_pick keeps the reads of a graph on one server instead, so that only that server
+ * caches the graph. Every server has LOAD_RING_POINTS points on a hash ring, and a read goes to
+ * the server of the first point after the hash of its graph name (consistent hashing). Servers
+ * joining or leaving only move the graphs next to their points. The load is bounded (Mirrokni
+ * et al., "Consistent Hashing with Bounded Loads"): a server with 'bound' times the average
+ * number of outstanding requests is passed over for the next server on the ring, so a hot graph
+ * spills to a second server while the others keep their graphs.
+ *
+ * The table also counts the writes of the primary server, and the requests of every client
+ * that were sent to a server and not replied to yet. Clients are counted in one of
+ * LOAD_CLIENT_BUCKETS buckets by pid. The load balancer admits a request only while the server
+ * and the client are under their limits, and answers the others as busy right away. Every server
+ * also counts the requests of each bucket it has received and not replied to, so that the
+ * requests a server took with it when it died can be given back to their clients.
+ */
+
+#ifndef SERVER_LOAD_H
+#define SERVER_LOAD_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#define SERVER_LOAD_PROJECT_ID 'L'
+#define SERVER_LOAD_SLOTS 16
+#define LOAD_RING_POINTS 64
+#define LOAD_CLIENT_BUCKETS 1024
+
+struct server_load
+{
+    int pid;                 // server using the slot, 0 when it is free
+    uint64_t sent;           // requests sent to the server, written by the load balancer
+    uint64_t completed;      // requests the server has replied to
+    uint64_t in_flight;      // requests the server is traversing
+    uint64_t cost_in_flight; // cost of the traversals the server is running
+    uint64_t total_cost;     // cost of the requests the server has completed
+    uint32_t client_taken[LOAD_CLIENT_BUCKETS]; // requests of the clients the server has received and not replied to
+};
+
+struct load_table
+{
+    struct server_load servers[SERVER_LOAD_SLOTS];
+    struct server_load primary;                    // writes, the primary server has no traversal cost
+    uint64_t client_sent[LOAD_CLIENT_BUCKETS];      // requests of the clients sent to a server, by pid
+    uint64_t client_completed[LOAD_CLIENT_BUCKETS]; // requests of the clients a server has replied to
+};
+
+struct load_ring_point
+{
+    uint64_t hash;
+    int server;
+};
+
+// Hash ring of the live servers, kept by the load balancer
+struct load_ring
+{
+    struct load_ring_point points[SERVER_LOAD_SLOTS * LOAD_RING_POINTS];
+    int number_of_points;
+};
+
+/**
+ * @brief Creates and initialises the table, called once by the load balancer
+ *
+ * @param table_id set to the shared memory id so that the creator can remove it
+ * @return struct load_table* or NULL on failure with errno set
+ */
+static inline struct load_table *load_table_create(int *table_id)
+{
+    key_t key = ftok(".", SERVER_LOAD_PROJECT_ID);
+    if (key == -1)
+    {
+        return NULL;
+    }
+    if ((*table_id = shmget(key, sizeof(struct load_table), 0666 | IPC_CREAT)) == -1)
+    {
+        return NULL;
+    }
+    struct load_table *table = (struct load_table *)shmat(*table_id, NULL, 0);
+    if (table == (void *)-1)
+    {
+        return NULL;
+    }
+    memset(table, 0, sizeof(struct load_table));
+    return table;
+}
+
+/**
+ * @brief Attaches to the table created by the load balancer
+ *
+ * @return struct load_table* or NULL on failure with errno set
+ */
+static inline struct load_table *load_table_attach(void)
+{
+    key_t key = ftok(".", SERVER_LOAD_PROJECT_ID);
+    if (key == -1)
+    {
+        return NULL;
+    }
+    int table_id = shmget(key, sizeof(struct load_table), 0666);
+    if (table_id == -1)
+    {
+        return NULL;
+    }
+    struct load_table *table = (struct load_table *)shmat(table_id, NULL, 0);
+    return table == (void *)-1 ? NULL : table;
+}
+
+/**
+ * @brief Called by a server when it starts traversing 'count' requests that cost 'cost' each
+ */
+static inline void load_begin(struct server_load *load, uint64_t count, uint64_t cost)
+{
+    __atomic_add_fetch(&load->in_flight, count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&load->cost_in_flight, count * cost, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Called by a server once it has replied to the requests of load_begin. 'actual' is
+ * what each of them turned out to cost, once the server knows the size of their graph.
+ */
+static inline void load_end(struct server_load *load, uint64_t count, uint64_t cost, uint64_t actual)
+{
+    __atomic_add_fetch(&load->total_cost, count * actual, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&load->cost_in_flight, count * cost, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&load->in_flight, count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&load->completed, count, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Requests sent to a server that it has not replied to
+ */
+static inline uint64_t load_outstanding(const struct server_load *load)
+{
+    uint64_t completed = __atomic_load_n(&load->completed, __ATOMIC_ACQUIRE);
+    uint64_t sent = __atomic_load_n(&load->sent, __ATOMIC_RELAXED);
+    // The counters are read one by one, so the server may look briefly ahead of the load balancer
+    return sent > completed ? sent - completed : 0;
+}
+
+/**
+ * @brief Called by the load balancer when it sends a request of 'client' to a server
+ */
+static inline void load_client_sent(struct load_table *table, int client)
+{
+    __atomic_add_fetch(&table->client_sent[(unsigned int)client % LOAD_CLIENT_BUCKETS], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Called by a server when it receives a request of 'client' on its channel
+ */
+static inline void load_client_taken(struct server_load *load, int client)
+{
+    __atomic_add_fetch(&load->client_taken[(unsigned int)client % LOAD_CLIENT_BUCKETS], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Called by a server before it replies to a request of 'client', so that the client
+ * is never over its limit once it has the reply
+ *
+ * @param load slot of the server that received the request, NULL if no server received it
+ */
+static inline void load_client_done(struct load_table *table, struct server_load *load, int client)
+{
+    unsigned int bucket = (unsigned int)client % LOAD_CLIENT_BUCKETS;
+    if (load != NULL)
+    {
+        __atomic_sub_fetch(&load->client_taken[bucket], 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&table->client_completed[bucket], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Counts the requests a server that exited received and never replied to as completed.
+ * The requests still on its channel are left to the next server of the slot.
+ *
+ * @return number of requests given back to their clients
+ */
+static inline uint64_t load_client_release(struct load_table *table, struct server_load *load)
+{
+    uint64_t released = 0;
+    for (int i = 0; i < LOAD_CLIENT_BUCKETS; i++)
+    {
+        // Taken as a whole, so that a request is not given back twice
+        uint32_t taken = __atomic_exchange_n(&load->client_taken[i], 0, __ATOMIC_RELAXED);
+        if (taken > 0)
+        {
+            __atomic_add_fetch(&table->client_completed[i], taken, __ATOMIC_RELEASE);
+            released += taken;
+        }
+    }
+    return released;
+}
+
+/**
+ * @brief Requests of 'client', and of any other client in its bucket, that no server has replied to
+ */
+static inline uint64_t load_client_outstanding(struct load_table *table, int client)
+{
+    unsigned int bucket = (unsigned int)client % LOAD_CLIENT_BUCKETS;
+    uint64_t completed = __atomic_load_n(&table->client_completed[bucket], __ATOMIC_ACQUIRE);
+    uint64_t sent = __atomic_load_n(&table->client_sent[bucket], __ATOMIC_RELAXED);
+    return sent > completed ? sent - completed : 0;
+}
+
+/**
+ * @brief Average cost of the requests a server has completed, at least 1
+ */
+static inline uint64_t load_average_cost(const struct server_load *load)
+{
+    uint64_t completed = __atomic_load_n(&load->completed, __ATOMIC_ACQUIRE);
+    uint64_t total_cost = __atomic_load_n(&load->total_cost, __ATOMIC_RELAXED);
+    return completed > 0 && total_cost / completed > 0 ? total_cost / completed : 1;
+}
+
+/**
+ * @brief Work a server has left: the cost of its traversals plus an estimate for the
+ * requests it has not started
+ */
+static inline uint64_t load_work(const struct server_load *load)
+{
+    uint64_t outstanding = load_outstanding(load);
+    uint64_t in_flight = __atomic_load_n(&load->in_flight, __ATOMIC_RELAXED);
+    uint64_t cost_in_flight = __atomic_load_n(&load->cost_in_flight, __ATOMIC_RELAXED);
+    uint64_t waiting = outstanding > in_flight ? outstanding - in_flight : 0;
+    return cost_in_flight + waiting * load_average_cost(load);
+}
+
+/**
+ * @brief Picks the server with the least work among two of the candidates picked at random,
+ * or among all of them if there are only two. Ties go to the server with fewer outstanding
+ * requests.
+ *
+ * @param candidates slots of the servers that can take the request
+ * @param seed state of rand_r
+ * @return the slot of the server
+ */
+static inline int load_pick(struct load_table *table, const int *candidates, int number_of_candidates, unsigned int *seed)
+{
+    if (number_of_candidates == 1)
+    {
+        return candidates[0];
+    }
+    int first = 0;
+    int second = 1;
+    if (number_of_candidates > 2)
+    {
+        first = rand_r(seed) % number_of_candidates;
+        second = rand_r(seed) % (number_of_candidates - 1);
+        second += second >= first;
+    }
+    struct server_load *a = &table->servers[candidates[first]];
+    struct server_load *b = &table->servers[candidates[second]];
+    uint64_t work_a = load_work(a);
+    uint64_t work_b = load_work(b);
+    if (work_a != work_b)
+    {
+        return work_a < work_b ? candidates[first] : candidates[second];
+    }
+    uint64_t outstanding_a = load_outstanding(a);
+    uint64_t outstanding_b = load_outstanding(b);
+    if (outstanding_a != outstanding_b)
+    {
+        return outstanding_a < outstanding_b ? candidates[first] : candidates[second];
+    }
+    return rand_r(seed) % 2 == 0 ? candidates[first] : candidates[second];
+}
+
+/**
+ * @brief Mixes the bits of a 64-bit value (splitmix64), so nearby values land far apart on the ring
+ */
+static inline uint64_t load_ring_mix(uint64_t value)
+{
+    value += 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+/**
+ * @brief Position of a graph on the ring, FNV-1a of its name
+ */
+static inline uint64_t load_ring_hash(const char *name)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++)
+    {
+        hash = (hash ^ *c) * 0x100000001B3ULL;
+    }
+    return load_ring_mix(hash);
+}
+
+static inline int load_ring_compare(const void *a, const void *b)
+{
+    uint64_t x = ((const struct load_ring_point *)a)->hash;
+    uint64_t y = ((const struct load_ring_point *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Puts the points of the servers on the ring, called whenever a server joins or leaves.
+ * The points of a server only depend on its slot, so the server that takes over a slot takes
+ * over its graphs too.
+ *
+ * @param servers slots of the live servers
+ */
+static inline void load_ring_build(struct load_ring *ring, const int *servers, int number_of_servers)
+{
+    ring->number_of_points = 0;
+    for (int i = 0; i < number_of_servers; i++)
+    {
+        for (int j = 0; j < LOAD_RING_POINTS; j++)
+        {
+            struct load_ring_point *point = &ring->points[ring->number_of_points++];
+            point->hash = load_ring_mix(((uint64_t)servers[i] << 32) | (uint64_t)j);
+            point->server = servers[i];
+        }
+    }
+    qsort(ring->points, ring->number_of_points, sizeof(struct load_ring_point), load_ring_compare);
+}
+
+/**
+ * @brief Picks the server of a graph: the first server after the graph on the ring whose
+ * outstanding requests stay within 'bound' times the average, rounded up, with the new one
+ *
+ * @param bound at least 1, how far above the average a server may go before a graph spills
+ * @param spilled set to whether the graph was passed on from its first server
+ * @return the slot of the server, or -1 if the ring is empty
+ */
+static inline int load_ring_pick(struct load_table *table, const struct load_ring *ring, const char *graph_name, double bound, int *spilled)
+{
+    *spilled = 0;
+    if (ring->number_of_points == 0)
+    {
+        return -1;
+    }
+
+    // Outstanding requests of every live server, the ring holds each of them LOAD_RING_POINTS times
+    uint64_t total = 0;
+    for (int i = 0; i < ring->number_of_points; i++)
+    {
+        total += load_outstanding(&table->servers[ring->points[i].server]);
+    }
+    total /= LOAD_RING_POINTS;
+    int number_of_servers = ring->number_of_points / LOAD_RING_POINTS;
+    // Rounded up, so the server with the fewest outstanding requests is always under it
+    double average = bound * (double)(total + 1) / number_of_servers;
+    uint64_t capacity = (uint64_t)average;
+    capacity += (double)capacity < average;
+
+    // First point at or after the graph
+    uint64_t hash = load_ring_hash(graph_name);
+    int low = 0;
+    int high = ring->number_of_points;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (ring->points[middle].hash < hash)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    int first = ring->points[low % ring->number_of_points].server;
+    for (int i = 0; i < ring->number_of_points; i++)
+    {
+        int server = ring->points[(low + i) % ring->number_of_points].server;
+        if (load_outstanding(&table->servers[server]) + 1 <= capacity)
+        {
+            *spilled = server != first;
+            return server;
+        }
+    }
+    return first;
+}
+
+#endif
@@ -0,0 +1,290 @@
+/**
+ * @file shm_arena.h
+ * @brief Preallocated shared memory arena for request parameters and traversal results
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * The load balancer creates one long-lived shared memory segment split into fixed size slots
+ * of a few size classes, and every process attaches it once at startup. A request then leases
+ * a slot instead of creating, attaching and removing a segment of its own, and passes the
+ * 32 bit handle of the slot in the message. Handles do not depend on seq_num, so any number
+ * of requests can be in flight without key collisions.
+ *
+ * The free slots of each size class form a lock-free stack (Treiber stack). The head packs a
+ * 32 bit tag with the slot index and is updated with a 64 bit compare-and-swap. The tag is
+ * bumped on every update, so a slot that is leased and given back between a read of the head
+ * and the CAS cannot corrupt the stack (ABA).
+ *
+ * Blocks larger than the biggest slot get a private segment of their own. Their handle is
+ * -2 - shmid, so arena_resolve and arena_release work the same for both. -1 means no block.
+ */
+
+#ifndef SHM_ARENA_H
+#define SHM_ARENA_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#define ARENA_PROJECT_ID 'A'
+#define ARENA_CLASSES 3
+#define ARENA_ALIGNMENT 4096
+#define ARENA_INDEX_BITS 24
+
+// 4 KiB slots for parameters and small results, 256 KiB and 16 MiB slots for graphs and large results
+static const uint64_t arena_slot_sizes[ARENA_CLASSES] = {4096, 256 * 1024, 16 * 1024 * 1024};
+static const uint32_t arena_slot_counts[ARENA_CLASSES] = {1024, 64, 4};
+
+struct arena_class
+{
+    uint64_t head; // tag << 32 | (index of the first free slot + 1), 0 if there is none
+    uint64_t slot_size;
+    uint64_t offset;     // of the first slot from the start of the arena
+    uint32_t first_next; // index of the first slot of this class in 'next'
+    uint32_t number_of_slots;
+    uint32_t in_use;
+};
+
+struct arena
+{
+    struct arena_class classes[ARENA_CLASSES];
+    uint64_t size;
+    uint32_t next[]; // next[first_next + i] is the slot below slot i in the free stack, + 1
+};
+
+static inline uint64_t arena_size(uint64_t *slots_offset)
+{
+    uint32_t total_slots = 0;
+    for (int c = 0; c < ARENA_CLASSES; c++)
+    {
+        total_slots += arena_slot_counts[c];
+    }
+    uint64_t header = sizeof(struct arena) + total_slots * sizeof(uint32_t);
+    *slots_offset = (header + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+    uint64_t size = *slots_offset;
+    for (int c = 0; c < ARENA_CLASSES; c++)
+    {
+        size += arena_slot_sizes[c] * arena_slot_counts[c];
+    }
+    return size;
+}
+
+/**
+ * @brief Creates the arena with every slot free, called once by the load balancer.
+ * Only the header is written, the slots are backed by memory once they are first used.
+ *
+ * @param arena_id set to the shared memory id so that the creator can remove it
+ * @return struct arena* or NULL on failure with errno set
+ */
+static inline struct arena *arena_create(int *arena_id)
+{
+    key_t key = ftok(".", ARENA_PROJECT_ID);
+    if (key == -1)
+    {
+        return NULL;
+    }
+    uint64_t offset;
+    uint64_t size = arena_size(&offset);
+    if ((*arena_id = shmget(key, size, 0666 | IPC_CREAT)) == -1)
+    {
+        return NULL;
+    }
+    struct arena *arena = (struct arena *)shmat(*arena_id, NULL, 0);
+    if (arena == (void *)-1)
+    {
+        return NULL;
+    }
+
+    arena->size = size;
+    uint32_t first_next = 0;
+    for (int c = 0; c < ARENA_CLASSES; c++)
+    {
+        struct arena_class *class = &arena->classes[c];
+        class->slot_size = arena_slot_sizes[c];
+        class->offset = offset;
+        class->first_next = first_next;
+        class->number_of_slots = arena_slot_counts[c];
+        class->in_use = 0;
+        // Initially slot i sits on top of slot i + 1
+        for (uint32_t i = 0; i < class->number_of_slots; i++)
+        {
+            arena->next[first_next + i] = i + 1 < class->number_of_slots ? i + 2 : 0;
+        }
+        class->head = 1;
+        offset += class->slot_size * class->number_of_slots;
+        first_next += class->number_of_slots;
+    }
+    return arena;
+}
+
+/**
+ * @brief Attaches to the arena created by the load balancer
+ *
+ * @return struct arena* or NULL on failure with errno set
+ */
+static inline struct arena *arena_attach(void)
+{
+    key_t key = ftok(".", ARENA_PROJECT_ID);
+    if (key == -1)
+    {
+        return NULL;
+    }
+    int arena_id = shmget(key, 0, 0666);
+    if (arena_id == -1)
+    {
+        return NULL;
+    }
+    struct arena *arena = (struct arena *)shmat(arena_id, NULL, 0);
+    return arena == (void *)-1 ? NULL : arena;
+}
+
+/**
+ * @brief Pops a free slot of one size class
+ *
+ * @return the index of the slot, -1 if all slots of the class are in use
+ */
+static inline int64_t arena_pop(struct arena *arena, int c)
+{
+    struct arena_class *class = &arena->classes[c];
+    uint64_t head = __atomic_load_n(&class->head, __ATOMIC_ACQUIRE);
+    while (1)
+    {
+        uint32_t top = (uint32_t)head;
+        if (top == 0)
+        {
+            return -1;
+        }
+        uint32_t below = __atomic_load_n(&arena->next[class->first_next + top - 1], __ATOMIC_RELAXED);
+        uint64_t new_head = ((head >> 32) + 1) << 32 | below;
+        if (__atomic_compare_exchange_n(&class->head, &head, new_head, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_add_fetch(&class->in_use, 1, __ATOMIC_RELAXED);
+            return top - 1;
+        }
+    }
+}
+
+static inline void arena_push(struct arena *arena, int c, uint32_t index)
+{
+    struct arena_class *class = &arena->classes[c];
+    uint64_t head = __atomic_load_n(&class->head, __ATOMIC_ACQUIRE);
+    while (1)
+    {
+        __atomic_store_n(&arena->next[class->first_next + index], (uint32_t)head, __ATOMIC_RELAXED);
+        uint64_t new_head = ((head >> 32) + 1) << 32 | (index + 1);
+        if (__atomic_compare_exchange_n(&class->head, &head, new_head, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_sub_fetch(&class->in_use, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Leases a block of at least 'size' bytes, from the smallest size class with a free slot
+ * or from a private segment if there is none
+ *
+ * @param handle set to the handle of the block, to be passed to the other process
+ * @return pointer to the block, or NULL on failure with errno set
+ */
+static inline void *arena_lease(struct arena *arena, uint64_t size, int *handle)
+{
+    for (int c = 0; c < ARENA_CLASSES; c++)
+    {
+        if (arena->classes[c].slot_size < size)
+        {
+            continue;
+        }
+        int64_t index = arena_pop(arena, c);
+        if (index != -1)
+        {
+            *handle = c << ARENA_INDEX_BITS | (int)index;
+            return (char *)arena + arena->classes[c].offset + (uint64_t)index * arena->classes[c].slot_size;
+        }
+    }
+
+    int shm_id = shmget(IPC_PRIVATE, size > 0 ? size : 1, 0666 | IPC_CREAT);
+    if (shm_id == -1)
+    {
+        return NULL;
+    }
+    void *block = shmat(shm_id, NULL, 0);
+    if (block == (void *)-1)
+    {
+        shmctl(shm_id, IPC_RMID, 0);
+        return NULL;
+    }
+    *handle = -2 - shm_id;
+    return block;
+}
+
+/**
+ * @brief Pointer to a block leased by another process
+ *
+ * @return pointer to the block, or NULL on failure with errno set
+ */
+static inline void *arena_resolve(struct arena *arena, int handle)
+{
+    if (handle < -1)
+    {
+        void *block = shmat(-2 - handle, NULL, 0);
+        return block == (void *)-1 ? NULL : block;
+    }
+    int c = handle >> ARENA_INDEX_BITS;
+    uint32_t index = handle & ((1 << ARENA_INDEX_BITS) - 1);
+    if (handle < 0 || c >= ARENA_CLASSES || index >= arena->classes[c].number_of_slots)
+    {
+        return NULL;
+    }
+    return (char *)arena + arena->classes[c].offset + (uint64_t)index * arena->classes[c].slot_size;
+}
+
+/**
+ * @brief Size of a block leased by another process, so that the counts it holds can be checked
+ * against it before they are trusted
+ *
+ * @return size of the block in bytes, 0 if the handle is not valid
+ */
+static inline uint64_t arena_block_size(struct arena *arena, int handle)
+{
+    if (handle < -1)
+    {
+        struct shmid_ds segment;
+        return shmctl(-2 - handle, IPC_STAT, &segment) == -1 ? 0 : (uint64_t)segment.shm_segsz;
+    }
+    int c = handle >> ARENA_INDEX_BITS;
+    uint32_t index = handle & ((1 << ARENA_INDEX_BITS) - 1);
+    if (handle < 0 || c >= ARENA_CLASSES || index >= arena->classes[c].number_of_slots)
+    {
+        return 0;
+    }
+    return arena->classes[c].slot_size;
+}
+
+/**
+ * @brief Stops using a block returned by arena_resolve, without giving it back
+ */
+static inline int arena_unresolve(int handle, void *block)
+{
+    return handle < -1 ? shmdt(block) : 0;
+}
+
+/**
+ * @brief Gives a block back, once neither process uses it anymore
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static inline int arena_release(struct arena *arena, int handle, void *block)
+{
+    if (handle < -1)
+    {
+        return shmdt(block) == -1 || shmctl(-2 - handle, IPC_RMID, 0) == -1 ? -1 : 0;
+    }
+    arena_push(arena, handle >> ARENA_INDEX_BITS, handle & ((1 << ARENA_INDEX_BITS) - 1));
+    return 0;
+}
+
+#endif
@@ -0,0 +1,145 @@
+/**
+ * @file traversal_pool.h
+ * @brief Fixed team of threads that run the parallel phases of a traversal
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * The threads are started once with the server. A traversal hands them a job with
+ * traversal_pool_run, which runs job(arg, thread) on every thread of the team, the calling
+ * thread included as thread 0, and returns once all of them are done. The threads wait on a
+ * barrier between jobs instead of being created and joined for every job.
+ *
+ * Jobs of different requests are run one after the other, so a job should be one phase of a
+ * traversal (one BFS level, say) and not a whole traversal. A job must not call
+ * traversal_pool_run itself.
+ */
+
+#ifndef TRAVERSAL_POOL_H
+#define TRAVERSAL_POOL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct traversal_pool;
+
+struct traversal_thread
+{
+    pthread_t thread;
+    struct traversal_pool *pool;
+    int index;
+};
+
+struct traversal_pool
+{
+    pthread_mutex_t lock; // held by the thread that runs a job
+    pthread_barrier_t start;
+    pthread_barrier_t finish;
+    struct traversal_thread *threads;
+    int number_of_threads; // including the thread that runs the job
+    void (*job)(void *arg, int thread);
+    void *arg;
+    int stopping;
+    unsigned long jobs;
+};
+
+static inline void *traversal_pool_thread(void *arg)
+{
+    struct traversal_thread *self = (struct traversal_thread *)arg;
+    struct traversal_pool *pool = self->pool;
+    while (1)
+    {
+        pthread_barrier_wait(&pool->start);
+        if (pool->stopping)
+        {
+            return NULL;
+        }
+        pool->job(pool->arg, self->index);
+        pthread_barrier_wait(&pool->finish);
+    }
+}
+
+/**
+ * @brief Starts number_of_threads - 1 threads, the thread that runs a job is the last one.
+ * Uses one thread per online CPU if number_of_threads is not positive.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static inline int traversal_pool_start(struct traversal_pool *pool, int number_of_threads)
+{
+    if (number_of_threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        number_of_threads = cpus > 0 ? (int)cpus : 1;
+    }
+    pool->number_of_threads = number_of_threads;
+    pool->stopping = 0;
+    pool->jobs = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    if (pthread_barrier_init(&pool->start, NULL, number_of_threads) != 0 ||
+        pthread_barrier_init(&pool->finish, NULL, number_of_threads) != 0)
+    {
+        return -1;
+    }
+    pool->threads = (struct traversal_thread *)calloc(number_of_threads, sizeof(struct traversal_thread));
+    if (pool->threads == NULL)
+    {
+        return -1;
+    }
+    for (int i = 1; i < number_of_threads; i++)
+    {
+        pool->threads[i].pool = pool;
+        pool->threads[i].index = i;
+        if (pthread_create(&pool->threads[i].thread, NULL, traversal_pool_thread, &pool->threads[i]) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs job(arg, thread) on every thread of the team, thread 0 being the caller
+ */
+static inline void traversal_pool_run(struct traversal_pool *pool, void (*job)(void *, int), void *arg)
+{
+    if (pool->number_of_threads == 1)
+    {
+        job(arg, 0);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->arg = arg;
+    pool->jobs++;
+    pthread_barrier_wait(&pool->start);
+    job(arg, 0);
+    pthread_barrier_wait(&pool->finish);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Stops and joins the threads, no job may be running
+ */
+static inline void traversal_pool_stop(struct traversal_pool *pool)
+{
+    if (pool->number_of_threads > 1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = 1;
+        pthread_barrier_wait(&pool->start);
+        for (int i = 1; i < pool->number_of_threads; i++)
+        {
+            pthread_join(pool->threads[i].thread, NULL);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->finish);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+}
+
+#endif